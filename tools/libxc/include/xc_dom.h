@@ -184,6 +184,11 @@ struct xc_dom_image {
     unsigned int *vnode_to_pnode;
     unsigned int nr_vnodes;
 
+    /* Threads populating HVM guest memory, 0 to pick automatically. */
+    unsigned int populate_threads;
+    /* Extents of each size HVM guest memory ended up populated with. */
+    unsigned long nr_4k_pages, nr_2mb_pages, nr_1gb_pages;
+
     /* domain type/architecture specific data */
     void *arch_private;
 
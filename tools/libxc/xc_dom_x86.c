@@ -27,6 +27,8 @@
 #include <string.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <xen/xen.h>
 #include <xen/foreign/x86_32.h>
@@ -1264,15 +1266,238 @@ static int check_mmio_hole(uint64_t start, uint64_t memsize,
         return 1;
 }
 
+struct populate_stats {
+    unsigned long nr_4k_pages, nr_2mb_pages, nr_1gb_pages;
+};
+
+/*
+ * Populate p2m_host entries [cur_pages, end_pages) of an HVM guest.
+ *
+ * We attempt to allocate 1GB pages if possible. It falls back on 2MB
+ * pages if 1GB allocation fails. 4KB pages will be used eventually if
+ * both fail.
+ *
+ * Under 2MB mode, we allocate pages in batches of no more than 8MB to
+ * ensure that we can be preempted and hence dom0 remains responsive.
+ */
+static int populate_hvm_range(struct xc_dom_image *dom,
+                              unsigned long cur_pages, unsigned long end_pages,
+                              unsigned int memflags,
+                              struct populate_stats *stats)
+{
+    xc_interface *xch = dom->xch;
+    uint32_t domid = dom->guest_domid;
+    unsigned long i, cur_pfn;
+    int rc = 0;
+
+    while ( (rc == 0) && (end_pages > cur_pages) )
+    {
+        /* Clip count to maximum 1GB extent. */
+        unsigned long count = end_pages - cur_pages;
+        unsigned long max_pages = SUPERPAGE_1GB_NR_PFNS;
+
+        if ( count > max_pages )
+            count = max_pages;
+
+        cur_pfn = dom->p2m_host[cur_pages];
+
+        /* Take care the corner cases of super page tails */
+        if ( ((cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
+             (count > (-cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1))) )
+            count = -cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1);
+        else if ( ((count & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
+                  (count > SUPERPAGE_1GB_NR_PFNS) )
+            count &= ~(SUPERPAGE_1GB_NR_PFNS - 1);
+
+        /* Attemp to allocate 1GB super page. Because in each pass
+         * we only allocate at most 1GB, we don't have to clip
+         * super page boundaries.
+         */
+        if ( ((count | cur_pfn) & (SUPERPAGE_1GB_NR_PFNS - 1)) == 0 &&
+             /* Check if there exists MMIO hole in the 1GB memory
+              * range */
+             !check_mmio_hole(cur_pfn << PAGE_SHIFT,
+                              SUPERPAGE_1GB_NR_PFNS << PAGE_SHIFT,
+                              dom->mmio_start, dom->mmio_size) )
+        {
+            long done;
+            unsigned long nr_extents = count >> SUPERPAGE_1GB_SHIFT;
+            xen_pfn_t sp_extents[nr_extents];
+
+            for ( i = 0; i < nr_extents; i++ )
+                sp_extents[i] =
+                    dom->p2m_host[cur_pages+(i<<SUPERPAGE_1GB_SHIFT)];
+
+            done = xc_domain_populate_physmap(xch, domid, nr_extents,
+                                              SUPERPAGE_1GB_SHIFT,
+                                              memflags, sp_extents);
+
+            if ( done > 0 )
+            {
+                stats->nr_1gb_pages += done;
+                done <<= SUPERPAGE_1GB_SHIFT;
+                cur_pages += done;
+                count -= done;
+            }
+        }
+
+        if ( count != 0 )
+        {
+            /* Clip count to maximum 8MB extent. */
+            max_pages = SUPERPAGE_2MB_NR_PFNS * 4;
+            if ( count > max_pages )
+                count = max_pages;
+
+            /* Clip partial superpage extents to superpage
+             * boundaries. */
+            if ( ((cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
+                 (count > (-cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1))) )
+                count = -cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1);
+            else if ( ((count & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
+                      (count > SUPERPAGE_2MB_NR_PFNS) )
+                count &= ~(SUPERPAGE_2MB_NR_PFNS - 1); /* clip non-s.p. tail */
+
+            /* Attempt to allocate superpage extents. */
+            if ( ((count | cur_pfn) & (SUPERPAGE_2MB_NR_PFNS - 1)) == 0 )
+            {
+                long done;
+                unsigned long nr_extents = count >> SUPERPAGE_2MB_SHIFT;
+                xen_pfn_t sp_extents[nr_extents];
+
+                for ( i = 0; i < nr_extents; i++ )
+                    sp_extents[i] =
+                        dom->p2m_host[cur_pages+(i<<SUPERPAGE_2MB_SHIFT)];
+
+                done = xc_domain_populate_physmap(xch, domid, nr_extents,
+                                                  SUPERPAGE_2MB_SHIFT,
+                                                  memflags, sp_extents);
+
+                if ( done > 0 )
+                {
+                    stats->nr_2mb_pages += done;
+                    done <<= SUPERPAGE_2MB_SHIFT;
+                    cur_pages += done;
+                    count -= done;
+                }
+            }
+        }
+
+        /* Fall back to 4kB extents. */
+        if ( count != 0 )
+        {
+            rc = xc_domain_populate_physmap_exact(
+                xch, domid, count, 0, memflags, &dom->p2m_host[cur_pages]);
+            cur_pages += count;
+            stats->nr_4k_pages += count;
+        }
+    }
+
+    return rc;
+}
+
+/*
+ * Memory of large guests is populated by several threads, which take
+ * slices of up to POPULATE_SLICE_PAGES in turn.  Hypercalls made by
+ * different threads can run on different pcpus, and populating is mostly
+ * spent in the hypervisor allocating, scrubbing and mapping memory.
+ * Slices are 1GB aligned, so they don't get in the way of superpages.
+ */
+#define POPULATE_SLICE_PAGES (16 * SUPERPAGE_1GB_NR_PFNS)
+#define POPULATE_MAX_THREADS 8
+
+struct populate_slice {
+    unsigned long start, end;
+    unsigned int memflags;
+};
+
+struct populate_ctx {
+    struct xc_dom_image *dom;
+    struct populate_slice *slices;
+    unsigned int nr_slices, next_slice;
+    pthread_mutex_t lock;
+    int rc;
+    struct populate_stats stats;
+};
+
+static void *populate_worker(void *arg)
+{
+    struct populate_ctx *pc = arg;
+    struct populate_stats stats = { 0 };
+    struct populate_slice *slice;
+    int rc = 0;
+
+    do {
+        pthread_mutex_lock(&pc->lock);
+        slice = NULL;
+        if ( pc->rc == 0 && pc->next_slice < pc->nr_slices )
+            slice = &pc->slices[pc->next_slice++];
+        pthread_mutex_unlock(&pc->lock);
+
+        if ( slice )
+            rc = populate_hvm_range(pc->dom, slice->start, slice->end,
+                                    slice->memflags, &stats);
+    } while ( slice && rc == 0 );
+
+    pthread_mutex_lock(&pc->lock);
+    if ( rc != 0 )
+        pc->rc = rc;
+    pc->stats.nr_4k_pages += stats.nr_4k_pages;
+    pc->stats.nr_2mb_pages += stats.nr_2mb_pages;
+    pc->stats.nr_1gb_pages += stats.nr_1gb_pages;
+    pthread_mutex_unlock(&pc->lock);
+
+    return NULL;
+}
+
+/* Populate the given slices, with as many threads as worthwhile. */
+static int populate_hvm_slices(struct xc_dom_image *dom,
+                               struct populate_slice *slices,
+                               unsigned int nr_slices)
+{
+    struct populate_ctx pc = {
+        .dom = dom,
+        .slices = slices,
+        .nr_slices = nr_slices,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+    };
+    pthread_t threads[POPULATE_MAX_THREADS];
+    unsigned int i, nr_threads = dom->populate_threads;
+    long cpus;
+
+    if ( nr_threads == 0 )
+    {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nr_threads = cpus > 0 ? cpus : 1;
+    }
+    if ( nr_threads > POPULATE_MAX_THREADS )
+        nr_threads = POPULATE_MAX_THREADS;
+    if ( nr_threads > nr_slices )
+        nr_threads = nr_slices;
+
+    /* This thread is one of the workers. */
+    for ( i = 0; i + 1 < nr_threads; i++ )
+        if ( pthread_create(&threads[i], NULL, populate_worker, &pc) )
+            break;
+    populate_worker(&pc);
+    while ( i-- > 0 )
+        pthread_join(threads[i], NULL);
+
+    dom->nr_4k_pages += pc.stats.nr_4k_pages;
+    dom->nr_2mb_pages += pc.stats.nr_2mb_pages;
+    dom->nr_1gb_pages += pc.stats.nr_1gb_pages;
+
+    return pc.rc;
+}
+
 static int meminit_hvm(struct xc_dom_image *dom)
 {
     unsigned long i, vmemid, nr_pages = dom->total_pages;
     unsigned long p2m_size;
     unsigned long target_pages = dom->target_pages;
-    unsigned long cur_pages, cur_pfn;
+    unsigned long cur_pages;
     int rc;
-    unsigned long stat_normal_pages = 0, stat_2mb_pages = 0, 
-        stat_1gb_pages = 0;
+    struct populate_slice *slices;
+    unsigned int nr_slices;
     unsigned int memflags = 0;
     int claim_enabled = dom->claim_enabled;
     uint64_t total_pages;
@@ -1406,14 +1631,8 @@ static int meminit_hvm(struct xc_dom_image *dom)
     }
 
     /*
-     * Allocate memory for HVM guest, skipping VGA hole 0xA0000-0xC0000.
-     *
-     * We attempt to allocate 1GB pages if possible. It falls back on 2MB
-     * pages if 1GB allocation fails. 4KB pages will be used eventually if
-     * both fail.
-     * 
-     * Under 2MB mode, we allocate pages in batches of no more than 8MB to 
-     * ensure that we can be preempted and hence dom0 remains responsive.
+     * Allocate memory for HVM guest, skipping VGA hole 0xA0000-0xC0000,
+     * superpages first (see populate_hvm_range()).
      */
     if ( dom->device_model )
     {
@@ -1426,7 +1645,20 @@ static int meminit_hvm(struct xc_dom_image *dom)
         }
     }
 
-    stat_normal_pages = 0;
+    dom->nr_4k_pages = dom->nr_2mb_pages = dom->nr_1gb_pages = 0;
+
+    nr_slices = 0;
+    for ( vmemid = 0; vmemid < nr_vmemranges; vmemid++ )
+        nr_slices += ((vmemranges[vmemid].end - vmemranges[vmemid].start) >>
+                      PAGE_SHIFT) / POPULATE_SLICE_PAGES + 2;
+    slices = malloc(nr_slices * sizeof(*slices));
+    if ( slices == NULL )
+    {
+        DOMPRINTF("Could not allocate memory population slices");
+        goto error_out;
+    }
+
+    nr_slices = 0;
     for ( vmemid = 0; vmemid < nr_vmemranges; vmemid++ )
     {
         unsigned int new_memflags = memflags;
@@ -1446,125 +1678,36 @@ static int meminit_hvm(struct xc_dom_image *dom)
         if ( vmemranges[vmemid].start == 0 && dom->device_model )
         {
             cur_pages = 0xc0;
-            stat_normal_pages += 0xc0;
+            dom->nr_4k_pages += 0xc0;
         }
         else
             cur_pages = vmemranges[vmemid].start >> PAGE_SHIFT;
 
-        rc = 0;
-        while ( (rc == 0) && (end_pages > cur_pages) )
+        /* Cut the range into slices ending at slice aligned pfns. */
+        while ( cur_pages < end_pages )
         {
-            /* Clip count to maximum 1GB extent. */
-            unsigned long count = end_pages - cur_pages;
-            unsigned long max_pages = SUPERPAGE_1GB_NR_PFNS;
-
-            if ( count > max_pages )
-                count = max_pages;
-
-            cur_pfn = dom->p2m_host[cur_pages];
-
-            /* Take care the corner cases of super page tails */
-            if ( ((cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
-                 (count > (-cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1))) )
-                count = -cur_pfn & (SUPERPAGE_1GB_NR_PFNS-1);
-            else if ( ((count & (SUPERPAGE_1GB_NR_PFNS-1)) != 0) &&
-                      (count > SUPERPAGE_1GB_NR_PFNS) )
-                count &= ~(SUPERPAGE_1GB_NR_PFNS - 1);
-
-            /* Attemp to allocate 1GB super page. Because in each pass
-             * we only allocate at most 1GB, we don't have to clip
-             * super page boundaries.
-             */
-            if ( ((count | cur_pfn) & (SUPERPAGE_1GB_NR_PFNS - 1)) == 0 &&
-                 /* Check if there exists MMIO hole in the 1GB memory
-                  * range */
-                 !check_mmio_hole(cur_pfn << PAGE_SHIFT,
-                                  SUPERPAGE_1GB_NR_PFNS << PAGE_SHIFT,
-                                  dom->mmio_start, dom->mmio_size) )
-            {
-                long done;
-                unsigned long nr_extents = count >> SUPERPAGE_1GB_SHIFT;
-                xen_pfn_t sp_extents[nr_extents];
-
-                for ( i = 0; i < nr_extents; i++ )
-                    sp_extents[i] =
-                        dom->p2m_host[cur_pages+(i<<SUPERPAGE_1GB_SHIFT)];
-
-                done = xc_domain_populate_physmap(xch, domid, nr_extents,
-                                                  SUPERPAGE_1GB_SHIFT,
-                                                  new_memflags, sp_extents);
-
-                if ( done > 0 )
-                {
-                    stat_1gb_pages += done;
-                    done <<= SUPERPAGE_1GB_SHIFT;
-                    cur_pages += done;
-                    count -= done;
-                }
-            }
-
-            if ( count != 0 )
-            {
-                /* Clip count to maximum 8MB extent. */
-                max_pages = SUPERPAGE_2MB_NR_PFNS * 4;
-                if ( count > max_pages )
-                    count = max_pages;
-
-                /* Clip partial superpage extents to superpage
-                 * boundaries. */
-                if ( ((cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
-                     (count > (-cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1))) )
-                    count = -cur_pfn & (SUPERPAGE_2MB_NR_PFNS-1);
-                else if ( ((count & (SUPERPAGE_2MB_NR_PFNS-1)) != 0) &&
-                          (count > SUPERPAGE_2MB_NR_PFNS) )
-                    count &= ~(SUPERPAGE_2MB_NR_PFNS - 1); /* clip non-s.p. tail */
-
-                /* Attempt to allocate superpage extents. */
-                if ( ((count | cur_pfn) & (SUPERPAGE_2MB_NR_PFNS - 1)) == 0 )
-                {
-                    long done;
-                    unsigned long nr_extents = count >> SUPERPAGE_2MB_SHIFT;
-                    xen_pfn_t sp_extents[nr_extents];
-
-                    for ( i = 0; i < nr_extents; i++ )
-                        sp_extents[i] =
-                            dom->p2m_host[cur_pages+(i<<SUPERPAGE_2MB_SHIFT)];
-
-                    done = xc_domain_populate_physmap(xch, domid, nr_extents,
-                                                      SUPERPAGE_2MB_SHIFT,
-                                                      new_memflags, sp_extents);
-
-                    if ( done > 0 )
-                    {
-                        stat_2mb_pages += done;
-                        done <<= SUPERPAGE_2MB_SHIFT;
-                        cur_pages += done;
-                        count -= done;
-                    }
-                }
-            }
-
-            /* Fall back to 4kB extents. */
-            if ( count != 0 )
-            {
-                rc = xc_domain_populate_physmap_exact(
-                    xch, domid, count, 0, new_memflags, &dom->p2m_host[cur_pages]);
-                cur_pages += count;
-                stat_normal_pages += count;
-            }
+            slices[nr_slices].start = cur_pages;
+            cur_pages = (cur_pages | (POPULATE_SLICE_PAGES - 1)) + 1;
+            if ( cur_pages > end_pages )
+                cur_pages = end_pages;
+            slices[nr_slices].end = cur_pages;
+            slices[nr_slices].memflags = new_memflags;
+            nr_slices++;
         }
+    }
 
-        if ( rc != 0 )
-        {
-            DOMPRINTF("Could not allocate memory for HVM guest.");
-            goto error_out;
-        }
+    rc = populate_hvm_slices(dom, slices, nr_slices);
+    free(slices);
+    if ( rc != 0 )
+    {
+        DOMPRINTF("Could not allocate memory for HVM guest.");
+        goto error_out;
     }
 
-    DPRINTF("PHYSICAL MEMORY ALLOCATION:\n");
-    DPRINTF("  4KB PAGES: 0x%016lx\n", stat_normal_pages);
-    DPRINTF("  2MB PAGES: 0x%016lx\n", stat_2mb_pages);
-    DPRINTF("  1GB PAGES: 0x%016lx\n", stat_1gb_pages);
+    DOMPRINTF("PHYSICAL MEMORY ALLOCATION:");
+    DOMPRINTF("  4KB PAGES: 0x%016lx", dom->nr_4k_pages);
+    DOMPRINTF("  2MB PAGES: 0x%016lx", dom->nr_2mb_pages);
+    DOMPRINTF("  1GB PAGES: 0x%016lx", dom->nr_1gb_pages);
 
     rc = 0;
     goto out;
@@ -38,6 +38,8 @@ static const char *mandatory_rec_types[] =
     [REC_TYPE_VERIFY]                       = "Verify",
     [REC_TYPE_CHECKPOINT]                   = "Checkpoint",
     [REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST]    = "Checkpoint dirty pfn list",
+    [REC_TYPE_ZERO_PAGE_DATA]               = "Zero page data",
+    [REC_TYPE_COMPRESSED_PAGE_DATA]         = "Compressed page data",
 };
 
 const char *rec_type_to_str(uint32_t type)
@@ -2,6 +2,7 @@
 #define __COMMON__H
 
 #include <stdbool.h>
+#include <pthread.h>
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
@@ -18,6 +19,7 @@ const char *rec_type_to_str(uint32_t type);
 
 struct xc_sr_context;
 struct xc_sr_record;
+struct xc_sr_save_batch;
 
 /**
  * Save operations.  To be implemented for each type of guest, for use by the
@@ -198,14 +200,39 @@ struct xc_sr_context
             /* Further debugging information in the stream. */
             bool debug;
 
+            /* Send page data as COMPRESSED_PAGE_DATA records. */
+            bool compress;
+
             /* Parameters for tweaking live migration. */
             unsigned max_iterations;
             unsigned dirty_threshold;
+            /* Target for the time the domain is suspended, in ms. */
+            unsigned max_downtime;
+
+            /*
+             * Measurements from the last live iteration: pages dirtied and
+             * sent per second, and the predicted downtime in ms if the
+             * domain were suspended now.
+             */
+            unsigned iteration;
+            unsigned long dirty_rate, send_rate, downtime;
 
             unsigned long p2m_size;
 
-            xen_pfn_t *batch_pfns;
-            unsigned nr_batch_pfns;
+            /*
+             * Pipeline of PAGE_DATA batches.  Batches are filled at
+             * batch_head, prepared by the worker threads from batch_next
+             * on, and written to the stream in order at batch_tail.
+             */
+            struct xc_sr_save_batch *batches;
+            unsigned nr_batches;
+            unsigned batch_head, batch_next, batch_tail;
+            pthread_mutex_t batch_lock;
+            pthread_cond_t batch_work, batch_ready;
+            pthread_t *workers;
+            unsigned nr_workers;
+            bool workers_stop;
+
             unsigned long *deferred_pages;
             unsigned long nr_deferred_pages;
             xc_hypercall_buffer_t dirty_bitmap_hbuf;
@@ -222,6 +249,7 @@ struct xc_sr_context
 
             /* From Image Header. */
             uint32_t format_version;
+            bool compressed;
 
             /* From Domain Header. */
             uint32_t guest_type;
@@ -399,6 +427,18 @@ int read_record(struct xc_sr_context *ctx, int fd, struct xc_sr_record *rec);
 int populate_pfns(struct xc_sr_context *ctx, unsigned count,
                   const xen_pfn_t *original_pfns, const uint32_t *types);
 
+/*
+ * LZ4 block compression of page data, for COMPRESSED_PAGE_DATA records.
+ *
+ * xc_sr_lz4_compress() returns the compressed size, or 0 if the result
+ * doesn't fit into dst_len bytes.  xc_sr_lz4_decompress() returns 0 on
+ * success, and fails unless the data decompresses to exactly dst_len bytes.
+ */
+size_t xc_sr_lz4_compress(const void *src, size_t src_len,
+                          void *dst, size_t dst_len);
+int xc_sr_lz4_decompress(const void *src, size_t src_len,
+                         void *dst, size_t dst_len);
+
 #endif
 /*
  * Local variables:
@@ -0,0 +1,175 @@
+#include "xc_sr_common.h"
+
+#include "../../xen/include/xen/lz4.h"
+
+/*
+ * LZ4 block format compression for COMPRESSED_PAGE_DATA records.  The
+ * stream is decompressed with the LZ4 decompressor libxc already carries
+ * for kernel images (xc_dom_decompress_lz4.c).
+ *
+ * This is a simple greedy compressor: each position is looked up in a hash
+ * table of earlier positions, and a match is emitted as soon as one is
+ * found.  It doesn't aim for the best ratio, but for being fast enough to
+ * keep up with the network.
+ */
+
+#define LZ4_HASH_LOG      12
+#define LZ4_MIN_MATCH     4
+/*
+ * The decompressor rejects matches shorter than 8 bytes (its length
+ * wrap check assumes a full 8 byte copy step), so only look for those.
+ */
+#define LZ4_MIN_SEARCH    8
+/* The last match must start this many bytes before the end of the input. */
+#define LZ4_MF_LIMIT      12
+/* The last bytes of the input are always literals. */
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MAX_OFFSET    65535
+#define LZ4_RUN_MASK      15
+#define LZ4_ML_MASK       15
+
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline unsigned lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Emit an LZ4 length extension for len (which is at least 15). */
+static uint8_t *lz4_put_length(uint8_t *op, size_t len)
+{
+    for ( len -= 15; len >= 255; len -= 255 )
+        *op++ = 255;
+    *op++ = len;
+
+    return op;
+}
+
+size_t xc_sr_lz4_compress(const void *src, size_t src_len,
+                          void *dst, size_t dst_len)
+{
+    uint32_t table[1 << LZ4_HASH_LOG];
+    const uint8_t *const base = src, *const iend = base + src_len;
+    const uint8_t *const mflimit = iend - LZ4_MF_LIMIT;
+    const uint8_t *const matchlimit = iend - LZ4_LAST_LITERALS;
+    const uint8_t *ip = base, *anchor = base, *ref, *mp;
+    uint8_t *op = dst, *const oend = op + dst_len, *token;
+    size_t lit_len, match_len;
+    unsigned h;
+
+    if ( src_len < LZ4_MF_LIMIT + 1 )
+        goto last_literals;
+
+    memset(table, 0, sizeof(table));
+
+    for ( ++ip; ip < mflimit; )
+    {
+        h = lz4_hash(lz4_read32(ip));
+        ref = base + table[h];
+        table[h] = ip - base;
+
+        if ( ref >= ip || ip - ref > LZ4_MAX_OFFSET ||
+             lz4_read32(ref) != lz4_read32(ip) ||
+             lz4_read32(ref + 4) != lz4_read32(ip + 4) )
+        {
+            ++ip;
+            continue;
+        }
+
+        /* Extend the match backwards into the pending literals. */
+        while ( ip > anchor && ref > base && ip[-1] == ref[-1] )
+        {
+            --ip;
+            --ref;
+        }
+
+        /* ... and forwards, stopping short of the last literals. */
+        for ( mp = ip + LZ4_MIN_SEARCH;
+              mp < matchlimit && *mp == ref[mp - ip]; ++mp )
+            ;
+
+        lit_len = ip - anchor;
+        match_len = mp - ip - LZ4_MIN_MATCH;
+
+        /* Token, literals, offset and both length extensions. */
+        if ( op + 1 + lit_len + lit_len / 255 + 1 + 2 + match_len / 255 + 1 >
+             oend )
+            return 0;
+
+        token = op++;
+        if ( lit_len >= LZ4_RUN_MASK )
+        {
+            *token = LZ4_RUN_MASK << 4;
+            op = lz4_put_length(op, lit_len);
+        }
+        else
+            *token = lit_len << 4;
+
+        memcpy(op, anchor, lit_len);
+        op += lit_len;
+
+        *op++ = (ip - ref) & 0xff;
+        *op++ = (ip - ref) >> 8;
+
+        if ( match_len >= LZ4_ML_MASK )
+        {
+            *token |= LZ4_ML_MASK;
+            op = lz4_put_length(op, match_len);
+        }
+        else
+            *token |= match_len;
+
+        anchor = ip = mp;
+
+        /* Make the end of this match available for the next one. */
+        if ( ip < mflimit )
+            table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - base;
+    }
+
+ last_literals:
+    lit_len = iend - anchor;
+    if ( op + 1 + lit_len + lit_len / 255 + 1 > oend )
+        return 0;
+
+    token = op++;
+    if ( lit_len >= LZ4_RUN_MASK )
+    {
+        *token = LZ4_RUN_MASK << 4;
+        op = lz4_put_length(op, lit_len);
+    }
+    else
+        *token = lit_len << 4;
+
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    return op - (uint8_t *)dst;
+}
+
+int xc_sr_lz4_decompress(const void *src, size_t src_len,
+                         void *dst, size_t dst_len)
+{
+    size_t len = dst_len;
+
+    if ( lz4_decompress_unknownoutputsize(src, src_len, dst, &len) ||
+         len != dst_len )
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -46,6 +46,7 @@ static int read_headers(struct xc_sr_context *ctx)
     }
 
     ctx->restore.format_version = ihdr.version;
+    ctx->restore.compressed = ihdr.options & IHDR_OPT_COMPRESSED;
 
     if ( read_exact(ctx->fd, &dhdr, sizeof(dhdr)) )
     {
@@ -194,10 +195,13 @@ int populate_pfns(struct xc_sr_context *ctx, unsigned count,
     return rc;
 }
 
+/* Contents of all pages in a ZERO_PAGE_DATA record. */
+static const uint8_t zero_page[PAGE_SIZE];
+
 /*
  * Given a list of pfns, their types, and a block of page data from the
  * stream, populate and record their types, map the relevant subset and copy
- * the data into the guest.
+ * the data into the guest.  page_data is NULL for a ZERO_PAGE_DATA record.
  */
 static int process_page_data(struct xc_sr_context *ctx, unsigned count,
                              xen_pfn_t *pfns, uint32_t *types, void *page_data)
@@ -286,7 +290,8 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         }
 
         /* Undo page normalisation done by the saver. */
-        rc = ctx->restore.ops.localise_page(ctx, types[i], page_data);
+        rc = page_data ? ctx->restore.ops.localise_page(ctx, types[i],
+                                                        page_data) : 0;
         if ( rc )
         {
             ERROR("Failed to localise pfn %#"PRIpfn" (type %#"PRIx32")",
@@ -297,19 +302,25 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
         if ( ctx->restore.verify )
         {
             /* Verify mode - compare incoming data to what we already have. */
-            if ( memcmp(guest_page, page_data, PAGE_SIZE) )
+            if ( memcmp(guest_page, page_data ?: zero_page, PAGE_SIZE) )
                 ERROR("verify pfn %#"PRIpfn" failed (type %#"PRIx32")",
                       pfns[i], types[i] >> XEN_DOMCTL_PFINFO_LTAB_SHIFT);
         }
-        else
+        else if ( page_data )
         {
             /* Regular mode - copy incoming data into place. */
             memcpy(guest_page, page_data, PAGE_SIZE);
         }
+        else
+        {
+            /* Memory from Xen isn't necessarily clear: zero it. */
+            memset(guest_page, 0, PAGE_SIZE);
+        }
 
         ++j;
         guest_page += PAGE_SIZE;
-        page_data += PAGE_SIZE;
+        if ( page_data )
+            page_data += PAGE_SIZE;
     }
 
  done:
@@ -326,34 +337,47 @@ static int process_page_data(struct xc_sr_context *ctx, unsigned count,
 }
 
 /*
- * Validate a PAGE_DATA record from the stream, and pass the results to
- * process_page_data() to actually perform the legwork.
+ * Validate a PAGE_DATA, ZERO_PAGE_DATA or COMPRESSED_PAGE_DATA record from
+ * the stream, and pass the results to process_page_data() to actually
+ * perform the legwork.
  */
 static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
 {
     xc_interface *xch = ctx->xch;
     struct xc_sr_rec_page_data_header *pages = rec->data;
+    bool zero = rec->type == REC_TYPE_ZERO_PAGE_DATA;
+    bool compressed = rec->type == REC_TYPE_COMPRESSED_PAGE_DATA;
+    const char *name = zero ? "ZERO_PAGE_DATA" :
+        compressed ? "COMPRESSED_PAGE_DATA" : "PAGE_DATA";
     unsigned i, pages_of_data = 0;
+    size_t data_len;
+    void *page_data, *uncompressed = NULL;
     int rc = -1;
 
     xen_pfn_t *pfns = NULL, pfn;
     uint32_t *types = NULL, type;
 
+    if ( compressed && !ctx->restore.compressed )
+    {
+        ERROR("%s record in a stream not declared as compressed", name);
+        goto err;
+    }
+
     if ( rec->length < sizeof(*pages) )
     {
-        ERROR("PAGE_DATA record truncated: length %u, min %zu",
-              rec->length, sizeof(*pages));
+        ERROR("%s record truncated: length %u, min %zu",
+              name, rec->length, sizeof(*pages));
         goto err;
     }
     else if ( pages->count < 1 )
     {
-        ERROR("Expected at least 1 pfn in PAGE_DATA record");
+        ERROR("Expected at least 1 pfn in %s record", name);
         goto err;
     }
     else if ( rec->length < sizeof(*pages) + (pages->count * sizeof(uint64_t)) )
     {
-        ERROR("PAGE_DATA record (length %u) too short to contain %u"
-              " pfns worth of information", rec->length, pages->count);
+        ERROR("%s record (length %u) too short to contain %u"
+              " pfns worth of information", name, rec->length, pages->count);
         goto err;
     }
 
@@ -387,24 +411,63 @@ static int handle_page_data(struct xc_sr_context *ctx, struct xc_sr_record *rec)
             /* NOTAB and all L1 through L4 tables (including pinned) should
              * have a page worth of data in the record. */
             pages_of_data++;
+        else if ( zero )
+        {
+            ERROR("Type %#"PRIx32" for pfn %#"PRIpfn" (index %u) has no"
+                  " data in ZERO_PAGE_DATA record", type, pfn, i);
+            goto err;
+        }
 
         pfns[i] = pfn;
         types[i] = type;
     }
 
-    if ( rec->length != (sizeof(*pages) +
-                         (sizeof(uint64_t) * pages->count) +
-                         (PAGE_SIZE * pages_of_data)) )
+    /* Zero pages have no data in the stream. */
+    if ( zero )
+        pages_of_data = 0;
+
+    page_data = &pages->pfn[pages->count];
+    data_len = rec->length - sizeof(*pages) - sizeof(uint64_t) * pages->count;
+
+    if ( compressed )
+    {
+        /* The pages' data, as one LZ4 block filling the rest of the record. */
+        if ( !pages_of_data || !data_len )
+        {
+            ERROR("%s record without page data", name);
+            goto err;
+        }
+
+        uncompressed = malloc(PAGE_SIZE * pages_of_data);
+        if ( !uncompressed )
+        {
+            ERROR("Unable to allocate %lu bytes for page data",
+                  PAGE_SIZE * pages_of_data);
+            goto err;
+        }
+
+        if ( xc_sr_lz4_decompress(page_data, data_len, uncompressed,
+                                  PAGE_SIZE * pages_of_data) )
+        {
+            ERROR("%s record failed to decompress to %u pages", name,
+                  pages_of_data);
+            goto err;
+        }
+
+        page_data = uncompressed;
+    }
+    else if ( data_len != PAGE_SIZE * pages_of_data )
     {
-        ERROR("PAGE_DATA record wrong size: length %u, expected "
-              "%zu + %zu + %lu", rec->length, sizeof(*pages),
+        ERROR("%s record wrong size: length %u, expected "
+              "%zu + %zu + %lu", name, rec->length, sizeof(*pages),
               (sizeof(uint64_t) * pages->count), (PAGE_SIZE * pages_of_data));
         goto err;
     }
 
     rc = process_page_data(ctx, pages->count, pfns, types,
-                           &pages->pfn[pages->count]);
+                           zero ? NULL : page_data);
  err:
+    free(uncompressed);
     free(types);
     free(pfns);
 
@@ -637,6 +700,8 @@ static int process_record(struct xc_sr_context *ctx, struct xc_sr_record *rec)
         break;
 
     case REC_TYPE_PAGE_DATA:
+    case REC_TYPE_ZERO_PAGE_DATA:
+    case REC_TYPE_COMPRESSED_PAGE_DATA:
         rc = handle_page_data(ctx, rec);
         break;
 
@@ -31,6 +31,9 @@ static int write_headers(struct xc_sr_context *ctx, uint16_t guest_type)
         return -1;
     }
 
+    if ( ctx->save.compress )
+        ihdr.options |= htons(IHDR_OPT_COMPRESSED);
+
     if ( write_exact(ctx->fd, &ihdr, sizeof(ihdr)) )
     {
         PERROR("Unable to write Image Header to stream");
@@ -67,67 +70,191 @@ static int write_checkpoint_record(struct xc_sr_context *ctx)
 }
 
 /*
- * Writes a batch of memory as a PAGE_DATA record into the stream.  The batch
- * is constructed in ctx->save.batch_pfns.
+ * A batch of pages on its way into the stream as a PAGE_DATA record.
  *
- * This function:
- * - gets the types for each pfn in the batch.
- * - for each pfn with real data:
- *   - maps and attempts to localise the pages.
- * - construct and writes a PAGE_DATA record into the stream.
+ * Mapping the guest pages and constructing the record is done by worker
+ * threads, while the main thread writes earlier batches to the stream, so
+ * mapping, normalising and writing overlap.  Batches are always written
+ * in the order they were filled, so later copies of a page in the stream
+ * supersede earlier ones as before.
  */
-static int write_batch(struct xc_sr_context *ctx)
+struct xc_sr_save_batch
 {
-    xc_interface *xch = ctx->xch;
-    xen_pfn_t *mfns = NULL, *types = NULL;
-    void *guest_mapping = NULL;
-    void **guest_data = NULL;
-    void **local_pages = NULL;
-    int *errors = NULL, rc = -1;
-    unsigned i, p, nr_pages = 0, nr_pages_mapped = 0;
-    unsigned nr_pfns = ctx->save.nr_batch_pfns;
-    void *page, *orig_page;
-    uint64_t *rec_pfns = NULL;
-    struct iovec *iov = NULL; int iovcnt = 0;
-    struct xc_sr_rec_page_data_header hdr = { 0 };
-    struct xc_sr_record rec =
-    {
-        .type = REC_TYPE_PAGE_DATA,
-    };
+    /* Pfns of the batch, filled by add_to_batch(). */
+    xen_pfn_t *pfns;
+    unsigned nr_pfns;
 
-    assert(nr_pfns != 0);
+    /* Result of prepare_batch(), and whether it has completed. */
+    int rc;
+    bool ready;
 
     /* Mfns of the batch pfns. */
-    mfns = malloc(nr_pfns * sizeof(*mfns));
+    xen_pfn_t *mfns;
     /* Types of the batch pfns. */
-    types = malloc(nr_pfns * sizeof(*types));
+    xen_pfn_t *types;
     /* Errors from attempting to map the gfns. */
-    errors = malloc(nr_pfns * sizeof(*errors));
+    int *errors;
     /* Pointers to page data to send.  Mapped gfns or local allocations. */
-    guest_data = calloc(nr_pfns, sizeof(*guest_data));
+    void **guest_data;
     /* Pointers to locally allocated pages.  Need freeing. */
-    local_pages = calloc(nr_pfns, sizeof(*local_pages));
-    /* iovec[] for writev(). */
-    iov = malloc((nr_pfns + 4) * sizeof(*iov));
+    void **local_pages;
+    /* Pfns to be sent again after the domain is suspended. */
+    xen_pfn_t *deferred;
+    unsigned nr_deferred;
 
-    if ( !mfns || !types || !errors || !guest_data || !local_pages || !iov )
+    void *guest_mapping;
+    unsigned nr_pages_mapped;
+
+    /* The PAGE_DATA and ZERO_PAGE_DATA records, and iovec[] for writev(). */
+    struct xc_sr_record rec, zero_rec;
+    struct xc_sr_rec_page_data_header hdr, zero_hdr;
+    uint64_t *rec_pfns, *zero_pfns;
+    struct iovec *iov;
+    int iovcnt;
+
+    /*
+     * With compression, the page data gathered into one buffer, and the
+     * LZ4 block sent in its place.
+     */
+    void *raw_data, *compressed_data;
+};
+
+/* Upper bound for the number of threads preparing batches. */
+#define MAX_SAVE_WORKERS 4
+
+static void defer_page(struct xc_sr_save_batch *batch, xen_pfn_t pfn)
+{
+    batch->deferred[batch->nr_deferred++] = pfn;
+}
+
+static bool page_is_zero(const void *page)
+{
+    const uint64_t *p = page;
+    unsigned i;
+
+    /* Check a cache line at a time, most non-zero pages fail early. */
+    for ( i = 0; i < PAGE_SIZE / sizeof(*p); i += 8 )
+        if ( p[i] | p[i + 1] | p[i + 2] | p[i + 3] |
+             p[i + 4] | p[i + 5] | p[i + 6] | p[i + 7] )
+            return false;
+
+    return true;
+}
+
+/*
+ * Compress the nr_pages pages of the batch into a COMPRESSED_PAGE_DATA
+ * record, queued after its header.  Returns false if compression doesn't
+ * save anything, in which case the PAGE_DATA record is sent as it is.
+ */
+static bool compress_page_record(struct xc_sr_save_batch *batch,
+                                 unsigned nr_pages)
+{
+    static const char zeroes[(1u << REC_ALIGN_ORDER) - 1] = { 0 };
+    size_t raw_len = (size_t)nr_pages * PAGE_SIZE, len;
+    unsigned i, p;
+
+    for ( i = 0, p = 0; p < nr_pages; ++i )
+        if ( batch->guest_data[i] )
+            memcpy(batch->raw_data + (p++ * PAGE_SIZE),
+                   batch->guest_data[i], PAGE_SIZE);
+
+    /* Leave room for the padding, so the record really gets shorter. */
+    len = xc_sr_lz4_compress(batch->raw_data, raw_len,
+                             batch->compressed_data,
+                             raw_len - sizeof(zeroes) - 1);
+    if ( !len )
+        return false;
+
+    batch->rec.type = REC_TYPE_COMPRESSED_PAGE_DATA;
+    batch->rec.length -= raw_len - len;
+
+    batch->iov[batch->iovcnt].iov_base = batch->compressed_data;
+    batch->iov[batch->iovcnt].iov_len = len;
+    batch->iovcnt++;
+
+    len = ROUNDUP(len, REC_ALIGN_ORDER) - len;
+    if ( len )
     {
-        ERROR("Unable to allocate arrays for a batch of %u pages",
-              nr_pfns);
-        goto err;
+        batch->iov[batch->iovcnt].iov_base = (void *)zeroes;
+        batch->iov[batch->iovcnt].iov_len = len;
+        batch->iovcnt++;
     }
 
+    return true;
+}
+
+/* Queue a PAGE_DATA style record of count pfns for writev(). */
+static void queue_page_record(struct xc_sr_save_batch *batch,
+                              struct xc_sr_record *rec,
+                              struct xc_sr_rec_page_data_header *hdr,
+                              uint64_t *pfns, unsigned count,
+                              unsigned nr_pages)
+{
+    struct iovec *iov = &batch->iov[batch->iovcnt];
+
+    hdr->count = count;
+
+    rec->length = sizeof(*hdr);
+    rec->length += count * sizeof(*pfns);
+    rec->length += nr_pages * PAGE_SIZE;
+
+    iov[0].iov_base = &rec->type;
+    iov[0].iov_len = sizeof(rec->type);
+
+    iov[1].iov_base = &rec->length;
+    iov[1].iov_len = sizeof(rec->length);
+
+    iov[2].iov_base = hdr;
+    iov[2].iov_len = sizeof(*hdr);
+
+    iov[3].iov_base = pfns;
+    iov[3].iov_len = count * sizeof(*pfns);
+
+    batch->iovcnt += 4;
+}
+
+/*
+ * Prepares a batch of memory as a PAGE_DATA record, ready to be written
+ * into the stream.  Called from the worker threads, so it must not change
+ * any state in ctx.
+ *
+ * This function:
+ * - gets the types for each pfn in the batch.
+ * - for each pfn with real data:
+ *   - maps and attempts to localise the pages.
+ * - constructs the PAGE_DATA record, and a ZERO_PAGE_DATA record for
+ *   pages which only contain zeroes.
+ * - if enabled, compresses the page data into a COMPRESSED_PAGE_DATA
+ *   record instead.
+ */
+static int prepare_batch(struct xc_sr_context *ctx,
+                         struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    xen_pfn_t *mfns = batch->mfns, *types = batch->types;
+    int *errors = batch->errors;
+    void **guest_data = batch->guest_data;
+    void **local_pages = batch->local_pages;
+    struct iovec *iov = batch->iov;
+    int rc = -1;
+    unsigned i, p, nr_pages = 0, nr_data = 0, nr_zero = 0;
+    unsigned nr_pfns = batch->nr_pfns;
+    void *page, *orig_page;
+    uint64_t pfn;
+
+    assert(nr_pfns != 0);
+
+    memset(guest_data, 0, nr_pfns * sizeof(*guest_data));
+    memset(local_pages, 0, nr_pfns * sizeof(*local_pages));
+    batch->nr_deferred = 0;
+
     for ( i = 0; i < nr_pfns; ++i )
     {
-        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx,
-                                                      ctx->save.batch_pfns[i]);
+        types[i] = mfns[i] = ctx->save.ops.pfn_to_gfn(ctx, batch->pfns[i]);
 
         /* Likely a ballooned page. */
         if ( mfns[i] == INVALID_MFN )
-        {
-            set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-            ++ctx->save.nr_deferred_pages;
-        }
+            defer_page(batch, batch->pfns[i]);
     }
 
     rc = xc_get_pfn_type_batch(xch, ctx->domid, nr_pfns, types);
@@ -153,14 +280,14 @@ static int write_batch(struct xc_sr_context *ctx)
 
     if ( nr_pages > 0 )
     {
-        guest_mapping = xenforeignmemory_map(xch->fmem,
+        batch->guest_mapping = xenforeignmemory_map(xch->fmem,
             ctx->domid, PROT_READ, nr_pages, mfns, errors);
-        if ( !guest_mapping )
+        if ( !batch->guest_mapping )
         {
             PERROR("Failed to map guest pages");
             goto err;
         }
-        nr_pages_mapped = nr_pages;
+        batch->nr_pages_mapped = nr_pages;
 
         for ( i = 0, p = 0; i < nr_pfns; ++i )
         {
@@ -175,11 +302,11 @@ static int write_batch(struct xc_sr_context *ctx)
             if ( errors[p] )
             {
                 ERROR("Mapping of pfn %#"PRIpfn" (mfn %#"PRIpfn") failed %d",
-                      ctx->save.batch_pfns[i], mfns[p], errors[p]);
+                      batch->pfns[i], mfns[p], errors[p]);
                 goto err;
             }
 
-            orig_page = page = guest_mapping + (p * PAGE_SIZE);
+            orig_page = page = batch->guest_mapping + (p * PAGE_SIZE);
             rc = ctx->save.ops.normalise_page(ctx, types[i], &page);
 
             if ( orig_page != page )
@@ -189,14 +316,15 @@ static int write_batch(struct xc_sr_context *ctx)
             {
                 if ( rc == -1 && errno == EAGAIN )
                 {
-                    set_bit(ctx->save.batch_pfns[i], ctx->save.deferred_pages);
-                    ++ctx->save.nr_deferred_pages;
+                    defer_page(batch, batch->pfns[i]);
                     types[i] = XEN_DOMCTL_PFINFO_XTAB;
                     --nr_pages;
                 }
                 else
                     goto err;
             }
+            else if ( page_is_zero(page) )
+                --nr_pages;
             else
                 guest_data[i] = page;
 
@@ -205,111 +333,239 @@ static int write_batch(struct xc_sr_context *ctx)
         }
     }
 
-    rec_pfns = malloc(nr_pfns * sizeof(*rec_pfns));
-    if ( !rec_pfns )
+    /*
+     * Pages with data but no guest_data are all zeroes, and only their pfn
+     * goes into the stream.
+     */
+    for ( i = 0; i < nr_pfns; ++i )
     {
-        ERROR("Unable to allocate %zu bytes of memory for page data pfn list",
-              nr_pfns * sizeof(*rec_pfns));
-        goto err;
-    }
-
-    hdr.count = nr_pfns;
+        pfn = ((uint64_t)(types[i]) << 32) | batch->pfns[i];
 
-    rec.length = sizeof(hdr);
-    rec.length += nr_pfns * sizeof(*rec_pfns);
-    rec.length += nr_pages * PAGE_SIZE;
-
-    for ( i = 0; i < nr_pfns; ++i )
-        rec_pfns[i] = ((uint64_t)(types[i]) << 32) | ctx->save.batch_pfns[i];
+        switch ( types[i] )
+        {
+        case XEN_DOMCTL_PFINFO_BROKEN:
+        case XEN_DOMCTL_PFINFO_XALLOC:
+        case XEN_DOMCTL_PFINFO_XTAB:
+            batch->rec_pfns[nr_data++] = pfn;
+            continue;
+        }
 
-    iov[0].iov_base = &rec.type;
-    iov[0].iov_len = sizeof(rec.type);
+        if ( guest_data[i] )
+            batch->rec_pfns[nr_data++] = pfn;
+        else
+            batch->zero_pfns[nr_zero++] = pfn;
+    }
 
-    iov[1].iov_base = &rec.length;
-    iov[1].iov_len = sizeof(rec.length);
+    batch->iovcnt = 0;
 
-    iov[2].iov_base = &hdr;
-    iov[2].iov_len = sizeof(hdr);
+    if ( nr_zero )
+    {
+        batch->zero_rec.type = REC_TYPE_ZERO_PAGE_DATA;
+        queue_page_record(batch, &batch->zero_rec, &batch->zero_hdr,
+                          batch->zero_pfns, nr_zero, 0);
+    }
 
-    iov[3].iov_base = rec_pfns;
-    iov[3].iov_len = nr_pfns * sizeof(*rec_pfns);
+    if ( !nr_data )
+        goto done;
 
-    iovcnt = 4;
+    batch->rec.type = REC_TYPE_PAGE_DATA;
+    queue_page_record(batch, &batch->rec, &batch->hdr,
+                      batch->rec_pfns, nr_data, nr_pages);
 
-    if ( nr_pages )
+    if ( nr_pages && ctx->save.compress &&
+         compress_page_record(batch, nr_pages) )
+        nr_pages = 0;
+    else if ( nr_pages )
     {
         for ( i = 0; i < nr_pfns; ++i )
         {
             if ( guest_data[i] )
             {
-                iov[iovcnt].iov_base = guest_data[i];
-                iov[iovcnt].iov_len = PAGE_SIZE;
-                iovcnt++;
+                iov[batch->iovcnt].iov_base = guest_data[i];
+                iov[batch->iovcnt].iov_len = PAGE_SIZE;
+                batch->iovcnt++;
                 --nr_pages;
             }
         }
     }
 
-    if ( writev_exact(ctx->fd, iov, iovcnt) )
+    /* Sanity check we have queued all the pages we expected to. */
+    assert(nr_pages == 0);
+
+ done:
+    rc = 0;
+
+ err:
+    return rc;
+}
+
+/*
+ * Release the mappings and local pages of a written batch.
+ */
+static void release_batch(struct xc_sr_context *ctx,
+                          struct xc_sr_save_batch *batch)
+{
+    xc_interface *xch = ctx->xch;
+    unsigned i;
+
+    if ( batch->guest_mapping )
+        xenforeignmemory_unmap(xch->fmem, batch->guest_mapping,
+                               batch->nr_pages_mapped);
+    batch->guest_mapping = NULL;
+    batch->nr_pages_mapped = 0;
+
+    for ( i = 0; i < batch->nr_pfns; ++i )
     {
-        PERROR("Failed to write page data to stream");
-        goto err;
+        free(batch->local_pages[i]);
+        batch->local_pages[i] = NULL;
     }
 
-    /* Sanity check we have sent all the pages we expected to. */
-    assert(nr_pages == 0);
-    rc = ctx->save.nr_batch_pfns = 0;
+    batch->nr_pfns = 0;
+    batch->ready = false;
 
- err:
-    free(rec_pfns);
-    if ( guest_mapping )
-        xenforeignmemory_unmap(xch->fmem, guest_mapping, nr_pages_mapped);
-    for ( i = 0; local_pages && i < nr_pfns; ++i )
-        free(local_pages[i]);
-    free(iov);
-    free(local_pages);
-    free(guest_data);
-    free(errors);
-    free(types);
-    free(mfns);
+    VALGRIND_MAKE_MEM_UNDEFINED(batch->pfns,
+                                MAX_BATCH_SIZE * sizeof(*batch->pfns));
+}
+
+/*
+ * Prepare the next submitted batch, if there is one which isn't being
+ * prepared yet.  Called with batch_lock held.
+ */
+static bool prepare_next_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_batch *batch;
+
+    if ( ctx->save.batch_next == ctx->save.batch_head )
+        return false;
+
+    batch = &ctx->save.batches[ctx->save.batch_next++ %
+                               ctx->save.nr_batches];
+
+    pthread_mutex_unlock(&ctx->save.batch_lock);
+    batch->rc = prepare_batch(ctx, batch);
+    pthread_mutex_lock(&ctx->save.batch_lock);
+
+    batch->ready = true;
+    pthread_cond_broadcast(&ctx->save.batch_ready);
+
+    return true;
+}
+
+static void *save_worker(void *arg)
+{
+    struct xc_sr_context *ctx = arg;
+
+    pthread_mutex_lock(&ctx->save.batch_lock);
+
+    while ( !ctx->save.workers_stop )
+    {
+        if ( !prepare_next_batch(ctx) )
+            pthread_cond_wait(&ctx->save.batch_work, &ctx->save.batch_lock);
+    }
+
+    pthread_mutex_unlock(&ctx->save.batch_lock);
+
+    return NULL;
+}
+
+/*
+ * Write the oldest submitted batch into the stream, once it is prepared.
+ * With write false, the batch is only released, after an earlier error.
+ */
+static int write_next_batch(struct xc_sr_context *ctx, bool write)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_batch *batch =
+        &ctx->save.batches[ctx->save.batch_tail % ctx->save.nr_batches];
+    unsigned i;
+    int rc;
+
+    pthread_mutex_lock(&ctx->save.batch_lock);
+
+    /* Rather than waiting for the workers, help them out. */
+    while ( !batch->ready )
+    {
+        if ( !prepare_next_batch(ctx) )
+            pthread_cond_wait(&ctx->save.batch_ready, &ctx->save.batch_lock);
+    }
+
+    pthread_mutex_unlock(&ctx->save.batch_lock);
+
+    rc = batch->rc;
+    if ( !rc && write )
+    {
+        for ( i = 0; i < batch->nr_deferred; ++i )
+            set_bit(batch->deferred[i], ctx->save.deferred_pages);
+        ctx->save.nr_deferred_pages += batch->nr_deferred;
+
+        if ( writev_exact(ctx->fd, batch->iov, batch->iovcnt) )
+        {
+            PERROR("Failed to write page data to stream");
+            rc = -1;
+        }
+    }
+
+    release_batch(ctx, batch);
+    ctx->save.batch_tail++;
 
     return rc;
 }
 
 /*
- * Flush a batch of pfns into the stream.
+ * Hand the batch being filled over to the workers.  Writes the oldest
+ * batch if the pipeline is full.
  */
-static int flush_batch(struct xc_sr_context *ctx)
+static int submit_batch(struct xc_sr_context *ctx)
 {
     int rc = 0;
 
-    if ( ctx->save.nr_batch_pfns == 0 )
-        return rc;
+    pthread_mutex_lock(&ctx->save.batch_lock);
+    ctx->save.batch_head++;
+    pthread_cond_signal(&ctx->save.batch_work);
+    pthread_mutex_unlock(&ctx->save.batch_lock);
 
-    rc = write_batch(ctx);
+    if ( ctx->save.batch_head - ctx->save.batch_tail == ctx->save.nr_batches )
+        rc = write_next_batch(ctx, true);
 
-    if ( !rc )
+    return rc;
+}
+
+/*
+ * Flush all pending batches into the stream.
+ */
+static int flush_batch(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_batch *batch =
+        &ctx->save.batches[ctx->save.batch_head % ctx->save.nr_batches];
+    int rc = 0;
+
+    if ( batch->nr_pfns )
+        rc = submit_batch(ctx);
+
+    while ( ctx->save.batch_tail != ctx->save.batch_head )
     {
-        VALGRIND_MAKE_MEM_UNDEFINED(ctx->save.batch_pfns,
-                                    MAX_BATCH_SIZE *
-                                    sizeof(*ctx->save.batch_pfns));
+        int wrc = write_next_batch(ctx, !rc);
+
+        if ( !rc )
+            rc = wrc;
     }
 
     return rc;
 }
 
 /*
- * Add a single pfn to the batch, flushing the batch if full.
+ * Add a single pfn to the batch, submitting the batch if full.
  */
 static int add_to_batch(struct xc_sr_context *ctx, xen_pfn_t pfn)
 {
+    struct xc_sr_save_batch *batch =
+        &ctx->save.batches[ctx->save.batch_head % ctx->save.nr_batches];
     int rc = 0;
 
-    if ( ctx->save.nr_batch_pfns == MAX_BATCH_SIZE )
-        rc = flush_batch(ctx);
+    batch->pfns[batch->nr_pfns++] = pfn;
 
-    if ( rc == 0 )
-        ctx->save.batch_pfns[ctx->save.nr_batch_pfns++] = pfn;
+    if ( batch->nr_pfns == MAX_BATCH_SIZE )
+        rc = submit_batch(ctx);
 
     return rc;
 }
@@ -451,9 +707,17 @@ static int update_progress_string(struct xc_sr_context *ctx,
 {
     xc_interface *xch = ctx->xch;
     char *new_str = NULL;
+    int len;
 
-    if ( asprintf(&new_str, "Frames iteration %u of %u",
-                  iter, ctx->save.max_iterations) == -1 )
+    if ( iter == 0 )
+        len = asprintf(&new_str, "Frames iteration %u of %u",
+                       iter, ctx->save.max_iterations);
+    else
+        len = asprintf(&new_str, "Frames iteration %u of %u "
+                       "(dirty %lu/s, sent %lu/s, downtime %lums)",
+                       iter, ctx->save.max_iterations, ctx->save.dirty_rate,
+                       ctx->save.send_rate, ctx->save.downtime);
+    if ( len == -1 )
     {
         PERROR("Unable to allocate new progress string");
         return -1;
@@ -466,29 +730,112 @@ static int update_progress_string(struct xc_sr_context *ctx,
     return 0;
 }
 
+/* Defaults for the live migration parameters of xc_domain_save(). */
+#define DEFAULT_MAX_ITERATIONS 30
+#define DEFAULT_MAX_DOWNTIME   300 /* ms */
+
+static uint64_t get_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Decide whether to stop iterating and suspend the domain, now that the
+ * pages dirtied during the last iteration are known.  Updates the
+ * measurements in ctx from the last iteration, which sent sent pages in
+ * send_us, while dirty pages were dirtied in dirty_us.
+ */
+static bool live_converged(struct xc_sr_context *ctx, unsigned long dirty,
+                           unsigned long sent, uint64_t dirty_us,
+                           uint64_t send_us, unsigned *stalled)
+{
+    xc_interface *xch = ctx->xch;
+    const char *why;
+    char msg[128];
+
+    ctx->save.dirty_rate = dirty * 1000000ULL / (dirty_us ?: 1);
+    ctx->save.send_rate = sent * 1000000ULL / (send_us ?: 1) ?: 1;
+    ctx->save.downtime = dirty * 1000ULL / ctx->save.send_rate;
+
+    DPRINTF("Iteration %u: %lu pages dirty at %lu/s, sending %lu/s, "
+            "predicted downtime %lums (target %ums)", ctx->save.iteration,
+            dirty, ctx->save.dirty_rate, ctx->save.send_rate,
+            ctx->save.downtime, ctx->save.max_downtime);
+
+    /*
+     * If pages are dirtied nearly as fast as they are sent, further
+     * iterations won't get the downtime any lower.  Tolerate a single
+     * slow iteration, the guest may just have been busy for a moment.
+     */
+    if ( ctx->save.dirty_rate * 10 >= ctx->save.send_rate * 9 )
+        ++*stalled;
+    else
+        *stalled = 0;
+
+    /*
+     * The first iteration also sends the holes in the p2m, which cost next
+     * to nothing, so its rate only counts once confirmed by a second one.
+     */
+    if ( dirty <= ctx->save.dirty_threshold ||
+         (ctx->save.downtime <= ctx->save.max_downtime &&
+          ctx->save.iteration > 1) )
+        why = "downtime target met";
+    else if ( *stalled >= 2 )
+        why = "not converging";
+    else if ( ctx->save.iteration >= ctx->save.max_iterations )
+        why = "iteration limit reached";
+    else
+        return false;
+
+    snprintf(msg, sizeof(msg), "Suspending after %u iterations, %s: "
+             "predicted downtime %lums", ctx->save.iteration, why,
+             ctx->save.downtime);
+    xc_report_progress_single(xch, msg);
+
+    return true;
+}
+
 /*
  * Send memory while guest is running.
+ *
+ * Iterate until sending the pages still dirty is predicted to take no
+ * longer than the downtime target, based on the rate the guest dirties
+ * pages and the rate they are sent at.  Give up early if that rate doesn't
+ * shrink the set of dirty pages any more.
  */
 static int send_memory_live(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
     xc_shadow_op_stats_t stats = { 0, ctx->save.p2m_size };
     char *progress_str = NULL;
-    unsigned x;
+    unsigned stalled = 0;
+    unsigned long sent;
+    uint64_t start, now, cleaned;
     int rc;
+    DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
+                                    &ctx->save.dirty_bitmap_hbuf);
 
+    ctx->save.iteration = 0;
     rc = update_progress_string(ctx, &progress_str, 0);
     if ( rc )
         goto out;
 
+    /* Logdirty has just been enabled. */
+    cleaned = start = get_time_us();
+
     rc = send_all_pages(ctx);
     if ( rc )
         goto out;
+    sent = ctx->save.p2m_size;
 
-    for ( x = 1;
-          ((x < ctx->save.max_iterations) &&
-           (stats.dirty_count > ctx->save.dirty_threshold)); ++x )
+    for ( ;; )
     {
+        now = get_time_us();
+
         if ( xc_shadow_control(
                  xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_CLEAN,
                  &ctx->save.dirty_bitmap_hbuf, ctx->save.p2m_size,
@@ -499,16 +846,29 @@ static int send_memory_live(struct xc_sr_context *ctx)
             goto out;
         }
 
-        if ( stats.dirty_count == 0 )
+        ++ctx->save.iteration;
+
+        if ( live_converged(ctx, stats.dirty_count, sent,
+                            now - cleaned, now - start, &stalled) )
+        {
+            /* The pages just collected go out with the final iteration. */
+            bitmap_or(ctx->save.deferred_pages, dirty_bitmap,
+                      ctx->save.p2m_size);
+            ctx->save.nr_deferred_pages += stats.dirty_count;
             break;
+        }
+        cleaned = now;
 
-        rc = update_progress_string(ctx, &progress_str, x);
+        rc = update_progress_string(ctx, &progress_str,
+                                    ctx->save.iteration);
         if ( rc )
             goto out;
 
+        start = get_time_us();
         rc = send_dirty_pages(ctx, stats.dirty_count);
         if ( rc )
             goto out;
+        sent = stats.dirty_count;
     }
 
  out:
@@ -601,7 +961,7 @@ static int suspend_and_send_dirty(struct xc_sr_context *ctx)
     if ( ctx->save.live )
     {
         rc = update_progress_string(ctx, &progress_str,
-                                    ctx->save.max_iterations);
+                                    ctx->save.iteration);
         if ( rc )
             goto out;
     }
@@ -733,6 +1093,129 @@ static int send_domain_memory_nonlive(struct xc_sr_context *ctx)
     return rc;
 }
 
+static int setup_batches(struct xc_sr_context *ctx)
+{
+    xc_interface *xch = ctx->xch;
+    struct xc_sr_save_batch *batch;
+    unsigned i;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* One thread per spare cpu, the main thread writes the stream. */
+    ctx->save.nr_workers = cpus > 1 ? cpus - 1 : 0;
+    if ( ctx->save.nr_workers > MAX_SAVE_WORKERS )
+        ctx->save.nr_workers = MAX_SAVE_WORKERS;
+
+    /* Keep every thread busy while the main thread is writing. */
+    ctx->save.nr_batches = 2 * (ctx->save.nr_workers + 1);
+    ctx->save.batches = calloc(ctx->save.nr_batches,
+                               sizeof(*ctx->save.batches));
+    if ( !ctx->save.batches )
+        goto err;
+
+    for ( i = 0; i < ctx->save.nr_batches; ++i )
+    {
+        batch = &ctx->save.batches[i];
+
+        batch->pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->pfns));
+        batch->mfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->mfns));
+        batch->types = malloc(MAX_BATCH_SIZE * sizeof(*batch->types));
+        batch->errors = malloc(MAX_BATCH_SIZE * sizeof(*batch->errors));
+        batch->guest_data = calloc(MAX_BATCH_SIZE,
+                                   sizeof(*batch->guest_data));
+        batch->local_pages = calloc(MAX_BATCH_SIZE,
+                                    sizeof(*batch->local_pages));
+        batch->deferred = malloc(MAX_BATCH_SIZE * sizeof(*batch->deferred));
+        batch->rec_pfns = malloc(MAX_BATCH_SIZE * sizeof(*batch->rec_pfns));
+        batch->zero_pfns = malloc(MAX_BATCH_SIZE *
+                                  sizeof(*batch->zero_pfns));
+        /* Headers of two records, and the page data. */
+        batch->iov = malloc((MAX_BATCH_SIZE + 8) * sizeof(*batch->iov));
+
+        if ( !batch->pfns || !batch->mfns || !batch->types ||
+             !batch->errors || !batch->guest_data || !batch->local_pages ||
+             !batch->deferred || !batch->rec_pfns || !batch->zero_pfns ||
+             !batch->iov )
+            goto err;
+
+        if ( ctx->save.compress )
+        {
+            batch->raw_data = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+            batch->compressed_data = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+
+            if ( !batch->raw_data || !batch->compressed_data )
+                goto err;
+        }
+    }
+
+    ctx->save.workers = calloc(ctx->save.nr_workers + 1,
+                               sizeof(*ctx->save.workers));
+    if ( !ctx->save.workers )
+        goto err;
+
+    for ( i = 0; i < ctx->save.nr_workers; ++i )
+    {
+        /* Fewer workers only mean less parallelism. */
+        if ( pthread_create(&ctx->save.workers[i], NULL, save_worker, ctx) )
+        {
+            PERROR("Unable to create save worker thread %u", i);
+            ctx->save.nr_workers = i;
+            break;
+        }
+    }
+
+    DPRINTF("Using %u save worker threads", ctx->save.nr_workers);
+
+    return 0;
+
+ err:
+    ERROR("Unable to allocate memory for %u batches of %u pages",
+          ctx->save.nr_batches, MAX_BATCH_SIZE);
+    ctx->save.nr_workers = 0;
+    errno = ENOMEM;
+    return -1;
+}
+
+static void cleanup_batches(struct xc_sr_context *ctx)
+{
+    struct xc_sr_save_batch *batch;
+    unsigned i;
+
+    if ( !ctx->save.batches )
+        return;
+
+    /* Release batches left in the pipeline after an error. */
+    while ( ctx->save.batch_tail != ctx->save.batch_head )
+        write_next_batch(ctx, false);
+
+    pthread_mutex_lock(&ctx->save.batch_lock);
+    ctx->save.workers_stop = true;
+    pthread_cond_broadcast(&ctx->save.batch_work);
+    pthread_mutex_unlock(&ctx->save.batch_lock);
+
+    for ( i = 0; i < ctx->save.nr_workers; ++i )
+        pthread_join(ctx->save.workers[i], NULL);
+    free(ctx->save.workers);
+
+    for ( i = 0; i < ctx->save.nr_batches; ++i )
+    {
+        batch = &ctx->save.batches[i];
+
+        free(batch->pfns);
+        free(batch->mfns);
+        free(batch->types);
+        free(batch->errors);
+        free(batch->guest_data);
+        free(batch->local_pages);
+        free(batch->deferred);
+        free(batch->rec_pfns);
+        free(batch->zero_pfns);
+        free(batch->iov);
+        free(batch->raw_data);
+        free(batch->compressed_data);
+    }
+    free(ctx->save.batches);
+}
+
 static int setup(struct xc_sr_context *ctx)
 {
     xc_interface *xch = ctx->xch;
@@ -740,26 +1223,28 @@ static int setup(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
 
+    pthread_mutex_init(&ctx->save.batch_lock, NULL);
+    pthread_cond_init(&ctx->save.batch_work, NULL);
+    pthread_cond_init(&ctx->save.batch_ready, NULL);
+
     rc = ctx->save.ops.setup(ctx);
     if ( rc )
         goto err;
 
     dirty_bitmap = xc_hypercall_buffer_alloc_pages(
                    xch, dirty_bitmap, NRPAGES(bitmap_size(ctx->save.p2m_size)));
-    ctx->save.batch_pfns = malloc(MAX_BATCH_SIZE *
-                                  sizeof(*ctx->save.batch_pfns));
     ctx->save.deferred_pages = calloc(1, bitmap_size(ctx->save.p2m_size));
 
-    if ( !ctx->save.batch_pfns || !dirty_bitmap || !ctx->save.deferred_pages )
+    if ( !dirty_bitmap || !ctx->save.deferred_pages )
     {
-        ERROR("Unable to allocate memory for dirty bitmaps, batch pfns and"
+        ERROR("Unable to allocate memory for dirty bitmaps and"
               " deferred pages");
         rc = -1;
         errno = ENOMEM;
         goto err;
     }
 
-    rc = 0;
+    rc = setup_batches(ctx);
 
  err:
     return rc;
@@ -771,6 +1256,8 @@ static void cleanup(struct xc_sr_context *ctx)
     DECLARE_HYPERCALL_BUFFER_SHADOW(unsigned long, dirty_bitmap,
                                     &ctx->save.dirty_bitmap_hbuf);
 
+    /* Stop the workers before the guest specific state goes away. */
+    cleanup_batches(ctx);
 
     xc_shadow_control(xch, ctx->domid, XEN_DOMCTL_SHADOW_OP_OFF,
                       NULL, 0, NULL, 0, NULL);
@@ -780,8 +1267,12 @@ static void cleanup(struct xc_sr_context *ctx)
 
     xc_hypercall_buffer_free_pages(xch, dirty_bitmap,
                                    NRPAGES(bitmap_size(ctx->save.p2m_size)));
+
+    pthread_cond_destroy(&ctx->save.batch_ready);
+    pthread_cond_destroy(&ctx->save.batch_work);
+    pthread_mutex_destroy(&ctx->save.batch_lock);
+
     free(ctx->save.deferred_pages);
-    free(ctx->save.batch_pfns);
 }
 
 /*
@@ -930,6 +1421,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
     ctx.save.callbacks = callbacks;
     ctx.save.live  = !!(flags & XCFLAGS_LIVE);
     ctx.save.debug = !!(flags & XCFLAGS_DEBUG);
+    ctx.save.compress = !!(flags & XCFLAGS_STREAM_COMPRESS);
     ctx.save.checkpointed = stream_type;
     ctx.save.recv_fd = recv_fd;
 
@@ -939,13 +1431,16 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom,
            stream_type == XC_MIG_STREAM_COLO);
 
     /*
-     * TODO: Find some time to better tweak the live migration algorithm.
-     *
-     * These parameters are better than the legacy algorithm especially for
-     * busy guests.
+     * The downtime target decides when to stop iterating.  The iteration
+     * limit only bounds migrations which converge very slowly.
      */
-    ctx.save.max_iterations = 5;
+    ctx.save.max_iterations = max_iters ?: DEFAULT_MAX_ITERATIONS;
     ctx.save.dirty_threshold = 50;
+    /*
+     * max_factor bounded the data sent relative to the domain's memory in
+     * the legacy algorithm.  It now carries the downtime target in ms.
+     */
+    ctx.save.max_downtime = max_factor ?: DEFAULT_MAX_DOWNTIME;
 
     /* Sanity checks for callbacks. */
     if ( hvm )
@@ -29,6 +29,9 @@ struct xc_sr_ihdr
 #define IHDR_OPT_LITTLE_ENDIAN (0 << _IHDR_OPT_ENDIAN)
 #define IHDR_OPT_BIG_ENDIAN    (1 << _IHDR_OPT_ENDIAN)
 
+#define _IHDR_OPT_COMPRESSED 1
+#define IHDR_OPT_COMPRESSED    (1 << _IHDR_OPT_COMPRESSED)
+
 /*
  * Domain Header
  */
@@ -76,10 +79,12 @@ struct xc_sr_rhdr
 #define REC_TYPE_VERIFY                     0x0000000dU
 #define REC_TYPE_CHECKPOINT                 0x0000000eU
 #define REC_TYPE_CHECKPOINT_DIRTY_PFN_LIST  0x0000000fU
+#define REC_TYPE_ZERO_PAGE_DATA             0x00000010U
+#define REC_TYPE_COMPRESSED_PAGE_DATA       0x00000011U
 
 #define REC_TYPE_OPTIONAL             0x80000000U
 
-/* PAGE_DATA */
+/* PAGE_DATA, ZERO_PAGE_DATA, COMPRESSED_PAGE_DATA */
 struct xc_sr_rec_page_data_header
 {
     uint32_t count;
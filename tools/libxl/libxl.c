@@ -926,8 +926,9 @@ static void domain_suspend_cb(libxl__egc *egc,
 
 }
 
-int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
-                         const libxl_asyncop_how *ao_how)
+static int domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
+                          uint32_t max_downtime_ms,
+                          const libxl_asyncop_how *ao_how)
 {
     AO_CREATE(ctx, domid, ao_how);
     int rc;
@@ -949,6 +950,8 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     dss->type = type;
     dss->live = flags & LIBXL_SUSPEND_LIVE;
     dss->debug = flags & LIBXL_SUSPEND_DEBUG;
+    dss->compress = flags & LIBXL_SUSPEND_COMPRESS;
+    dss->max_downtime = max_downtime_ms;
     dss->checkpointed_stream = LIBXL_CHECKPOINTED_STREAM_NONE;
 
     rc = libxl__fd_flags_modify_save(gc, dss->fd,
@@ -963,6 +966,19 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
     return AO_CREATE_FAIL(rc);
 }
 
+int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd, int flags,
+                         const libxl_asyncop_how *ao_how)
+{
+    return domain_suspend(ctx, domid, fd, flags, 0, ao_how);
+}
+
+int libxl_domain_suspend_downtime(libxl_ctx *ctx, uint32_t domid, int fd,
+                                  int flags, uint32_t max_downtime_ms,
+                                  const libxl_asyncop_how *ao_how)
+{
+    return domain_suspend(ctx, domid, fd, flags, max_downtime_ms, ao_how);
+}
+
 int libxl_domain_pause(libxl_ctx *ctx, uint32_t domid)
 {
     int ret;
@@ -4491,7 +4507,8 @@ int libxl_get_free_memory(libxl_ctx *ctx, uint64_t *memkb)
     if (rc < 0)
         goto out;
 
-    *memkb = (info.free_pages + info.scrub_pages) * 4;
+    /* Pages waiting to be scrubbed are part of free_pages. */
+    *memkb = info.free_pages * 4;
 
 out:
     GC_FREE;
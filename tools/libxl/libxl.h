@@ -221,6 +221,11 @@
  */
 #define LIBXL_HAVE_BUILDINFO_HVM_MMIO_HOLE_MEMKB 1
 
+/*
+ * libxl_domain_build_info has the u.hvm.pod_lazy field.
+ */
+#define LIBXL_HAVE_BUILDINFO_HVM_POD_LAZY 1
+
 /*
  * libxl_domain_info returns ERROR_DOMAIN_NOTFOUND if the domain
  * is not present, instead of ERROR_INVAL.
@@ -1012,6 +1017,22 @@ void libxl_mac_copy(libxl_ctx *ctx, libxl_mac *dst, const libxl_mac *src);
  */
 #define LIBXL_HAVE_MEMKB_64BITS 1
 
+/*
+ * LIBXL_HAVE_SUSPEND_COMPRESS
+ *
+ * If this is defined, libxl_domain_suspend() accepts LIBXL_SUSPEND_COMPRESS
+ * to send the guest memory compressed.  The receiver must support
+ * compressed streams as well.
+ */
+#define LIBXL_HAVE_SUSPEND_COMPRESS 1
+
+/*
+ * LIBXL_HAVE_SUSPEND_DOWNTIME
+ *
+ * If this is defined, libxl_domain_suspend_downtime() exists.
+ */
+#define LIBXL_HAVE_SUSPEND_DOWNTIME 1
+
 typedef char **libxl_string_list;
 void libxl_string_list_dispose(libxl_string_list *sl);
 int libxl_string_list_length(const libxl_string_list *sl);
@@ -1361,6 +1382,20 @@ int libxl_domain_suspend(libxl_ctx *ctx, uint32_t domid, int fd,
                          LIBXL_EXTERNAL_CALLERS_ONLY;
 #define LIBXL_SUSPEND_DEBUG 1
 #define LIBXL_SUSPEND_LIVE 2
+#define LIBXL_SUSPEND_COMPRESS 4
+
+/*
+ * As libxl_domain_suspend(), with a target for how long the domain may be
+ * paused at the end of a live suspend, in milliseconds.  The domain memory
+ * is sent while it runs until the remaining dirty memory is expected to be
+ * sent within the target, or until doing so doesn't make progress any more.
+ * 0 selects the default target.
+ */
+int libxl_domain_suspend_downtime(libxl_ctx *ctx, uint32_t domid, int fd,
+                                  int flags, /* LIBXL_SUSPEND_* */
+                                  uint32_t max_downtime_ms,
+                                  const libxl_asyncop_how *ao_how)
+                                  LIBXL_EXTERNAL_CALLERS_ONLY;
 
 /* @param suspend_cancel [from xenctrl.h:xc_domain_resume( @param fast )]
  *   If this parameter is true, use co-operative resume. The guest
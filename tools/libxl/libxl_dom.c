@@ -293,6 +293,8 @@ static void hvm_set_conf_params(xc_interface *handle, uint32_t domid,
                     libxl_defbool_val(info->u.hvm.nested_hvm));
     xc_hvm_param_set(handle, domid, HVM_PARAM_ALTP2M,
                     libxl_defbool_val(info->u.hvm.altp2m));
+    xc_hvm_param_set(handle, domid, HVM_PARAM_POD_LAZY,
+                    libxl_defbool_val(info->u.hvm.pod_lazy));
 }
 
 int libxl__build_pre(libxl__gc *gc, uint32_t domid,
@@ -653,6 +655,9 @@ static int libxl__build_dom(libxl__gc *gc, uint32_t domid,
         LOGE(ERROR, "xc_dom_boot_mem_init failed");
         goto out;
     }
+    if ( dom->container_type == XC_DOM_HVM_CONTAINER )
+        LOG(DEBUG, "populated memory with %lu 1GB, %lu 2MB and %lu 4kB pages",
+            dom->nr_1gb_pages, dom->nr_2mb_pages, dom->nr_4k_pages);
     if ( (ret = libxl__arch_domain_finalise_hw_description(gc, info, dom)) != 0 ) {
         LOGE(ERROR, "libxl__arch_domain_finalise_hw_description failed");
         goto out;
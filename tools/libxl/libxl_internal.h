@@ -3274,6 +3274,8 @@ struct libxl__domain_save_state {
     libxl_domain_type type;
     int live;
     int debug;
+    int compress;
+    uint32_t max_downtime; /* ms, 0 for the default */
     int checkpointed_stream;
     const libxl_domain_remus_info *remus;
     /* private */
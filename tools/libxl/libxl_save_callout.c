@@ -89,7 +89,7 @@ void libxl__xc_domain_save(libxl__egc *egc, libxl__domain_save_state *dss,
         libxl__srm_callout_enumcallbacks_save(&shs->callbacks.save.a);
 
     const unsigned long argnums[] = {
-        dss->domid, 0, 0, dss->xcflags, dss->hvm,
+        dss->domid, 0, dss->max_downtime, dss->xcflags, dss->hvm,
         cbflags, dss->checkpointed_stream,
     };
 
@@ -1674,6 +1674,8 @@ static void parse_config_data(const char *config_source,
 
         xlu_cfg_get_defbool(config, "altp2mhvm", &b_info->u.hvm.altp2m, 0);
 
+        xlu_cfg_get_defbool(config, "pod_lazy", &b_info->u.hvm.pod_lazy, 0);
+
         xlu_cfg_replace_string(config, "smbios_firmware",
                                &b_info->u.hvm.smbios_firmware, 0);
         xlu_cfg_replace_string(config, "acpi_firmware",
@@ -4682,6 +4684,7 @@ static void migrate_do_preamble(int send_fd, int recv_fd, pid_t child,
 }
 
 static void migrate_domain(uint32_t domid, const char *rune, int debug,
+                           int compress, uint32_t max_downtime,
                            const char *override_config_file)
 {
     pid_t child = -1;
@@ -4710,7 +4713,10 @@ static void migrate_domain(uint32_t domid, const char *rune, int debug,
 
     if (debug)
         flags |= LIBXL_SUSPEND_DEBUG;
-    rc = libxl_domain_suspend(ctx, domid, send_fd, flags, NULL);
+    if (compress)
+        flags |= LIBXL_SUSPEND_COMPRESS;
+    rc = libxl_domain_suspend_downtime(ctx, domid, send_fd, flags,
+                                       max_downtime, NULL);
     if (rc) {
         fprintf(stderr, "migration sender: libxl_domain_suspend failed"
                 " (rc=%d)\n", rc);
@@ -5135,9 +5141,13 @@ int main_migrate(int argc, char **argv)
     char *rune = NULL;
     char *host;
     int opt, daemonize = 1, monitor = 1, debug = 0, pause_after_migration = 0;
+    int compress = 0;
+    uint32_t max_downtime = 0;
     static struct option opts[] = {
         {"debug", 0, 0, 0x100},
         {"live", 0, 0, 0x200},
+        {"compress", 0, 0, 0x300},
+        {"downtime", 1, 0, 0x400},
         COMMON_LONG_OPTS
     };
 
@@ -5164,6 +5174,12 @@ int main_migrate(int argc, char **argv)
     case 0x200: /* --live */
         /* ignored for compatibility with xm */
         break;
+    case 0x300: /* --compress */
+        compress = 1;
+        break;
+    case 0x400: /* --downtime */
+        max_downtime = parse_ulong(optarg);
+        break;
     }
 
     domid = find_domain(argv[optind]);
@@ -5194,7 +5210,8 @@ int main_migrate(int argc, char **argv)
                   pause_after_migration ? " -p" : "");
     }
 
-    migrate_domain(domid, rune, debug, config_filename);
+    migrate_domain(domid, rune, debug, compress, max_downtime,
+                   config_filename);
     return EXIT_SUCCESS;
 }
 #endif
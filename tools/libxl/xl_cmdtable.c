@@ -165,6 +165,9 @@ struct cmd_spec cmd_table[] = {
       "-e              Do not wait in the background (on <host>) for the death\n"
       "                of the domain.\n"
       "--debug         Print huge (!) amount of debug during the migration process.\n"
+      "--compress      Compress the guest memory sent to <host>.\n"
+      "--downtime <ms> Aim to pause the domain for no longer than <ms>\n"
+      "                milliseconds at the end of the migration.\n"
       "-p              Do not unpause domain after migrating it."
     },
     { "restore",
@@ -25,7 +25,10 @@ IHDR_OPT_BIT_ENDIAN = 0
 IHDR_OPT_LE = (0 << IHDR_OPT_BIT_ENDIAN)
 IHDR_OPT_BE = (1 << IHDR_OPT_BIT_ENDIAN)
 
-IHDR_OPT_RESZ_MASK = 0xfffe
+IHDR_OPT_BIT_COMPRESSED = 1
+IHDR_OPT_COMPRESSED = (1 << IHDR_OPT_BIT_COMPRESSED)
+
+IHDR_OPT_RESZ_MASK = 0xfffc
 
 # Domain Header
 DHDR_FORMAT = "IHHII"
@@ -61,6 +64,8 @@ REC_TYPE_x86_pv_vcpu_msrs           = 0x0000000c
 REC_TYPE_verify                     = 0x0000000d
 REC_TYPE_checkpoint                 = 0x0000000e
 REC_TYPE_checkpoint_dirty_pfn_list  = 0x0000000f
+REC_TYPE_zero_page_data             = 0x00000010
+REC_TYPE_compressed_page_data       = 0x00000011
 
 rec_type_to_str = {
     REC_TYPE_end                        : "End",
@@ -78,7 +83,9 @@ rec_type_to_str = {
     REC_TYPE_x86_pv_vcpu_msrs           : "x86 PV vcpu msrs",
     REC_TYPE_verify                     : "Verify",
     REC_TYPE_checkpoint                 : "Checkpoint",
-    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list"
+    REC_TYPE_checkpoint_dirty_pfn_list  : "Checkpoint dirty pfn list",
+    REC_TYPE_zero_page_data             : "Zero page data",
+    REC_TYPE_compressed_page_data       : "Compressed page data",
 }
 
 # page_data
@@ -123,6 +130,7 @@ class VerifyLibxc(VerifyBase):
         VerifyBase.__init__(self, info, read)
 
         self.squashed_pagedata_records = 0
+        self.compressed = False
 
 
     def verify(self):
@@ -165,8 +173,11 @@ class VerifyLibxc(VerifyBase):
             raise StreamError(
                 "Stream is not native endianess - unable to validate")
 
+        self.compressed = bool(options & IHDR_OPT_COMPRESSED)
+
         endian = ["little", "big"][options & IHDR_OPT_LE]
-        self.info("Libxc Image Header: %s endian" % (endian, ))
+        self.info("Libxc Image Header: %s endian%s"
+                  % (endian, ["", ", compressed"][self.compressed]))
 
 
     def verify_dhdr(self):
@@ -205,7 +216,7 @@ class VerifyLibxc(VerifyBase):
         contentsz = (length + 7) & ~7
         content = self.rdexact(contentsz)
 
-        if rtype != REC_TYPE_page_data:
+        if rtype not in (REC_TYPE_page_data, REC_TYPE_compressed_page_data):
 
             if self.squashed_pagedata_records > 0:
                 self.info("Squashed %d Page Data records together"
@@ -281,6 +292,88 @@ class VerifyLibxc(VerifyBase):
                               % (minsz, pfnsz, pagesz, len(content)))
 
 
+    def verify_record_zero_page_data(self, content):
+        """ Zero Page Data record """
+        minsz = calcsize(PAGE_DATA_FORMAT)
+
+        if len(content) <= minsz:
+            raise RecordError("ZERO_PAGE_DATA record must be at least %d bytes"
+                              " long" % (minsz, ))
+
+        count, res1 = unpack(PAGE_DATA_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved bits set in ZERO_PAGE_DATA record"
+                              " 0x%04x" % (res1, ))
+
+        pfnsz = count * 8
+        if len(content) != minsz + pfnsz:
+            raise RecordError("Expected %u + %u, got %u"
+                              % (minsz, pfnsz, len(content)))
+
+        pfns = list(unpack("=%dQ" % (count,), content[minsz:minsz + pfnsz]))
+
+        for idx, pfn in enumerate(pfns):
+
+            if pfn & PAGE_DATA_PFN_RESZ_MASK:
+                raise RecordError("Reserved bits set in pfn[%d]: 0x%016x",
+                                  idx, pfn & PAGE_DATA_PFN_RESZ_MASK)
+
+            # Only normal pages and pagetables have contents to elide
+            if pfn >> PAGE_DATA_TYPE_SHIFT in (5, 6, 7, 8) or \
+                    not PAGE_DATA_TYPE_NOTAB <= \
+                    (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) <= \
+                    PAGE_DATA_TYPE_L4TAB:
+                raise RecordError("Invalid type value in pfn[%d]: 0x%016x",
+                                  idx, pfn & PAGE_DATA_TYPE_LTAB_MASK)
+
+
+    def verify_record_compressed_page_data(self, content):
+        """ Compressed Page Data record """
+        minsz = calcsize(PAGE_DATA_FORMAT)
+
+        if not self.compressed:
+            raise RecordError("COMPRESSED_PAGE_DATA record in a stream without"
+                              " the compressed option")
+
+        if len(content) <= minsz:
+            raise RecordError("COMPRESSED_PAGE_DATA record must be at least %d"
+                              " bytes long" % (minsz, ))
+
+        count, res1 = unpack(PAGE_DATA_FORMAT, content[:minsz])
+
+        if res1 != 0:
+            raise StreamError("Reserved bits set in COMPRESSED_PAGE_DATA record"
+                              " 0x%04x" % (res1, ))
+
+        pfnsz = count * 8
+        if (len(content) - minsz) <= pfnsz:
+            raise RecordError("COMPRESSED_PAGE_DATA record must contain a pfn"
+                              " record for each count, and compressed data")
+
+        pfns = list(unpack("=%dQ" % (count,), content[minsz:minsz + pfnsz]))
+
+        nr_pages = 0
+        for idx, pfn in enumerate(pfns):
+
+            if pfn & PAGE_DATA_PFN_RESZ_MASK:
+                raise RecordError("Reserved bits set in pfn[%d]: 0x%016x",
+                                  idx, pfn & PAGE_DATA_PFN_RESZ_MASK)
+
+            if pfn >> PAGE_DATA_TYPE_SHIFT in (5, 6, 7, 8):
+                raise RecordError("Invalid type value in pfn[%d]: 0x%016x",
+                                  idx, pfn & PAGE_DATA_TYPE_LTAB_MASK)
+
+            if PAGE_DATA_TYPE_NOTAB <= (pfn & PAGE_DATA_TYPE_LTABTYPE_MASK) \
+                    <= PAGE_DATA_TYPE_L4TAB:
+                nr_pages += 1
+
+        # The compressed data itself is not checked
+        if nr_pages == 0:
+            raise RecordError("COMPRESSED_PAGE_DATA record without any page"
+                              " data")
+
+
     def verify_record_x86_pv_info(self, content):
         """ x86 PV Info record """
 
@@ -451,4 +544,8 @@ record_verifiers = {
         VerifyLibxc.verify_record_checkpoint,
     REC_TYPE_checkpoint_dirty_pfn_list:
         VerifyLibxc.verify_record_checkpoint_dirty_pfn_list,
+    REC_TYPE_zero_page_data:
+        VerifyLibxc.verify_record_zero_page_data,
+    REC_TYPE_compressed_page_data:
+        VerifyLibxc.verify_record_compressed_page_data,
     }
@@ -0,0 +1,162 @@
+/*
+ * bench.c
+ *
+ * Helpers shared by the benchmarks under tools/tests.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void bench_sleep_until(uint64_t t)
+{
+    struct timespec ts = {
+        .tv_sec = t / NSEC_PER_SEC,
+        .tv_nsec = t % NSEC_PER_SEC,
+    };
+
+    while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+            EINTR )
+        continue;
+}
+
+/* Copy len bytes over a pipe, in either direction. */
+static bool xfer(int fd, void *buf, size_t len, bool out)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while ( len )
+    {
+        n = out ? write(fd, p, len) : read(fd, p, len);
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n <= 0 )
+            return false;
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static int run_worker(bench_worker_fn *fn, unsigned int idx, uint64_t start,
+                      uint64_t end, size_t stats_size, int fd)
+{
+    void *stats = calloc(1, stats_size);
+
+    if ( !stats )
+    {
+        PERROR("Failed to allocate memory");
+        return 1;
+    }
+
+    if ( fn(idx, start, end, stats) )
+        return 1;
+
+    if ( !xfer(fd, stats, stats_size, true) )
+    {
+        PERROR("Failed to write results");
+        return 1;
+    }
+
+    return 0;
+}
+
+unsigned int bench_run(unsigned int nr, unsigned int duration,
+                       bench_worker_fn *fn, void *stats, size_t stats_size)
+{
+    unsigned int i, failed = 0;
+    uint64_t start, end;
+    int *fds, pipefd[2];
+    char *s = stats;
+    pid_t pid;
+
+    fds = calloc(nr, sizeof(*fds));
+    if ( !fds )
+    {
+        PERROR("Failed to allocate memory");
+        exit(1);
+    }
+
+    /* Give the workers time to set up before they all start. */
+    start = bench_now_ns() + NSEC_PER_SEC / 2 + nr * 1000000ULL;
+    end = start + duration * NSEC_PER_SEC;
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( pipe(pipefd) )
+        {
+            PERROR("Failed to create pipe");
+            exit(1);
+        }
+
+        pid = fork();
+        if ( pid < 0 )
+        {
+            PERROR("Failed to fork");
+            exit(1);
+        }
+
+        if ( pid == 0 )
+        {
+            close(pipefd[0]);
+            exit(run_worker(fn, i, start, end, stats_size, pipefd[1]));
+        }
+
+        close(pipefd[1]);
+        fds[i] = pipefd[0];
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        if ( !xfer(fds[i], s + i * stats_size, stats_size, false) )
+        {
+            ERROR("No results from worker %u", i);
+            memset(s + i * stats_size, 0, stats_size);
+            failed++;
+        }
+        close(fds[i]);
+    }
+
+    while ( wait(NULL) > 0 )
+        continue;
+
+    free(fds);
+
+    return failed;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
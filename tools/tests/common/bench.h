@@ -0,0 +1,61 @@
+/*
+ * bench.h
+ *
+ * Helpers shared by the benchmarks under tools/tests: timing, and running
+ * worker processes in parallel and collecting their results.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TOOLS_TESTS_BENCH_H__
+#define __TOOLS_TESTS_BENCH_H__
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ERROR(a, b...) fprintf(stderr, a "\n", ## b)
+#define PERROR(a, b...) fprintf(stderr, a ": %s\n", ## b, strerror(errno))
+
+#define NSEC_PER_SEC 1000000000ULL
+
+uint64_t bench_now_ns(void);
+void bench_sleep_until(uint64_t t);
+
+/*
+ * Worker idx sets itself up, waits for start with bench_sleep_until() and
+ * runs until end, filling in its results at stats.  Returns 0 on success.
+ */
+typedef int bench_worker_fn(unsigned int idx, uint64_t start, uint64_t end,
+                            void *stats);
+
+/*
+ * Run nr workers for duration seconds, each in its own process.  The
+ * results of worker i, stats_size bytes, end up at stats + i * stats_size.
+ * Returns the number of workers which failed: their results are zero.
+ */
+unsigned int bench_run(unsigned int nr, unsigned int duration,
+                       bench_worker_fn *fn, void *stats, size_t stats_size);
+
+#endif /* __TOOLS_TESTS_BENCH_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
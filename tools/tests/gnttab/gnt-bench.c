@@ -0,0 +1,234 @@
+/*
+ * gnt-bench.c
+ *
+ * Benchmark for grant map and unmap throughput.
+ *
+ * Each worker process shares a number of its own pages with the domain
+ * it runs in and then maps and unmaps them through the grant device in
+ * a loop, the way a backend maps guest buffers, one batch per request.
+ * Running several workers spread over the vCPUs of the domain exercises
+ * the maptrack allocator and the grant table locks from all of them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <xengnttab.h>
+
+#include "bench.h"
+
+struct worker_stats {
+    uint64_t batches;
+    uint64_t errors;
+    uint64_t map_ns;
+    uint64_t unmap_ns;
+};
+
+static unsigned int nr_workers = 1;
+static unsigned int batch = 32;
+static unsigned int duration = 10;
+static uint32_t domid;
+static bool pin;
+
+static int worker(unsigned int idx, uint64_t start, uint64_t end, void *priv)
+{
+    struct worker_stats *stats = priv;
+    xengntshr_handle *xgs;
+    xengnttab_handle *xgt;
+    uint32_t *refs;
+    void *shared, *map;
+    uint64_t t0, t1;
+
+    if ( pin )
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(idx % sysconf(_SC_NPROCESSORS_ONLN), &set);
+        if ( sched_setaffinity(0, sizeof(set), &set) )
+            PERROR("Worker %u: failed to set CPU affinity", idx);
+    }
+
+    refs = calloc(batch, sizeof(*refs));
+    if ( !refs )
+    {
+        PERROR("Failed to allocate memory");
+        return 1;
+    }
+
+    xgs = xengntshr_open(NULL, 0);
+    xgt = xengnttab_open(NULL, 0);
+    if ( !xgs || !xgt )
+    {
+        PERROR("Failed to open grant devices");
+        return 1;
+    }
+
+    if ( xengnttab_set_max_grants(xgt, batch) )
+    {
+        PERROR("Failed to set max grants");
+        return 1;
+    }
+
+    shared = xengntshr_share_pages(xgs, domid, batch, refs, 0);
+    if ( !shared )
+    {
+        PERROR("Failed to share %u pages with domain %u", batch, domid);
+        return 1;
+    }
+
+    bench_sleep_until(start);
+
+    for ( t0 = bench_now_ns(); t0 < end; t0 = bench_now_ns() )
+    {
+        map = xengnttab_map_domain_grant_refs(xgt, batch, domid, refs,
+                                              PROT_READ | PROT_WRITE);
+        t1 = bench_now_ns();
+        if ( !map )
+        {
+            stats->errors++;
+            continue;
+        }
+        stats->map_ns += t1 - t0;
+
+        if ( xengnttab_unmap(xgt, map, batch) )
+        {
+            PERROR("Worker %u: failed to unmap grants", idx);
+            return 1;
+        }
+        stats->unmap_ns += bench_now_ns() - t1;
+        stats->batches++;
+    }
+
+    xengntshr_unshare(xgs, shared, batch);
+    xengntshr_close(xgs);
+    xengnttab_close(xgt);
+    free(refs);
+
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+"Usage: %s [options]\n"
+"\n"
+"  -w, --workers <nb>     number of worker processes (default %u),\n"
+"  -b, --batch <nb>       grants mapped per request (default %u),\n"
+"  -t, --time <secs>      duration of the run (default %u),\n"
+"  -d, --domid <domid>    id of the domain this runs in (default %u),\n"
+"  -p, --pin              pin worker n to CPU n,\n"
+"  -h, --help             to output this message.\n",
+            prog, nr_workers, batch, duration, domid);
+}
+
+static struct option options[] = {
+    { "workers", 1, NULL, 'w' },
+    { "batch", 1, NULL, 'b' },
+    { "time", 1, NULL, 't' },
+    { "domid", 1, NULL, 'd' },
+    { "pin", 0, NULL, 'p' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+    struct worker_stats *stats, total = { 0 };
+    unsigned int i;
+    int opt, rc;
+
+    while ( (opt = getopt_long(argc, argv, "w:b:t:d:ph", options,
+                               NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'w':
+            nr_workers = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            duration = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            domid = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            pin = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if ( optind != argc || !nr_workers || !batch || !duration )
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    stats = calloc(nr_workers, sizeof(*stats));
+    if ( !stats )
+    {
+        PERROR("Failed to allocate memory");
+        return 1;
+    }
+
+    rc = bench_run(nr_workers, duration, worker, stats, sizeof(*stats)) != 0;
+
+    for ( i = 0; i < nr_workers; i++ )
+    {
+        total.batches += stats[i].batches;
+        total.errors += stats[i].errors;
+        total.map_ns += stats[i].map_ns;
+        total.unmap_ns += stats[i].unmap_ns;
+    }
+
+    printf("gnt-bench: %u workers, %u grants per batch, %u seconds\n",
+           nr_workers, batch, duration);
+    printf("  %10s %12s %12s %12s %7s\n",
+           "batches", "maps/s", "map(ns/op)", "unmap(ns/op)", "errors");
+    printf("  %10"PRIu64" %12.0f %12.1f %12.1f %7"PRIu64"\n",
+           total.batches, (double)total.batches * batch / duration,
+           total.batches ? (double)total.map_ns / total.batches / batch : 0,
+           total.batches ? (double)total.unmap_ns / total.batches / batch : 0,
+           total.errors);
+
+    free(stats);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
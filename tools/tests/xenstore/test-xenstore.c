@@ -0,0 +1,195 @@
+/*
+ * test-xenstore.c
+ *
+ * Tests of xenstored transaction semantics, using two connections to
+ * the daemon.  As only the xenstore socket is needed, this can be run
+ * against a local "xenstored -N -D" without a hypervisor.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <xenstore.h>
+
+#define TEST_DIR "/test-xenstore"
+
+static struct xs_handle *xsh, *xsh2;
+
+static const char *path(const char *node)
+{
+    static char buf[64];
+
+    snprintf(buf, sizeof(buf), TEST_DIR "/%s", node);
+    return buf;
+}
+
+static bool write_node(struct xs_handle *h, xs_transaction_t t,
+                       const char *node, const char *val)
+{
+    return xs_write(h, t, path(node), val, strlen(val));
+}
+
+/* Does node read as val?  A NULL val means it must not exist. */
+static bool check_node(struct xs_handle *h, xs_transaction_t t,
+                       const char *node, const char *val)
+{
+    unsigned int len;
+    char *data = xs_read(h, t, path(node), &len);
+    bool ok = val ? data && !strcmp(data, val) : !data && errno == ENOENT;
+
+    if ( !ok )
+        fprintf(stderr, "  %s: expected %s, read %s\n", path(node),
+                val ?: "(none)", data ?: "(none)");
+    free(data);
+
+    return ok;
+}
+
+static bool setup(void)
+{
+    xs_rm(xsh, XBT_NULL, TEST_DIR);
+
+    return write_node(xsh, XBT_NULL, "a", "0") &&
+           write_node(xsh, XBT_NULL, "b", "0");
+}
+
+/*
+ * Reads in a transaction see the main database, not a snapshot: after
+ * another connection changed a node the transaction read, later reads
+ * return new data, and the commit must fail without applying anything.
+ */
+static const char *test_read_concurrent_write(void)
+{
+    xs_transaction_t t = xs_transaction_start(xsh);
+
+    if ( t == XBT_NULL )
+        return "transaction_start failed";
+    if ( !check_node(xsh, t, "a", "0") )
+        return "read in transaction";
+
+    if ( !write_node(xsh2, XBT_NULL, "a", "1") ||
+         !write_node(xsh2, XBT_NULL, "b", "1") )
+        return "concurrent write failed";
+
+    if ( !check_node(xsh, t, "b", "1") )
+        return "read after concurrent write";
+    if ( !write_node(xsh, t, "c", "1") || !write_node(xsh, t, "b", "2") )
+        return "write in transaction";
+    if ( !check_node(xsh, t, "c", "1") )
+        return "own write not seen in transaction";
+
+    if ( xs_transaction_end(xsh, t, false) || errno != EAGAIN )
+        return "commit didn't fail with EAGAIN";
+
+    if ( !check_node(xsh, XBT_NULL, "b", "1") ||
+         !check_node(xsh, XBT_NULL, "c", NULL) )
+        return "failed commit was applied";
+
+    return NULL;
+}
+
+/* Concurrent writes of nodes the transaction didn't touch don't conflict. */
+static const char *test_unrelated_write(void)
+{
+    xs_transaction_t t = xs_transaction_start(xsh);
+
+    if ( t == XBT_NULL )
+        return "transaction_start failed";
+    if ( !check_node(xsh, t, "a", "0") || !write_node(xsh, t, "c", "1") )
+        return "access in transaction";
+
+    if ( !write_node(xsh2, XBT_NULL, "b", "1") )
+        return "concurrent write failed";
+    if ( !check_node(xsh2, XBT_NULL, "c", NULL) )
+        return "uncommitted write visible";
+
+    if ( !xs_transaction_end(xsh, t, false) )
+        return "commit failed";
+
+    if ( !check_node(xsh2, XBT_NULL, "c", "1") )
+        return "commit not applied";
+
+    return NULL;
+}
+
+static const char *test_abort(void)
+{
+    xs_transaction_t t = xs_transaction_start(xsh);
+
+    if ( t == XBT_NULL )
+        return "transaction_start failed";
+    if ( !write_node(xsh, t, "a", "1") || !xs_rm(xsh, t, path("b")) )
+        return "access in transaction";
+
+    if ( !xs_transaction_end(xsh, t, true) )
+        return "abort failed";
+
+    if ( !check_node(xsh, XBT_NULL, "a", "0") ||
+         !check_node(xsh, XBT_NULL, "b", "0") )
+        return "aborted transaction was applied";
+
+    return NULL;
+}
+
+static const struct {
+    const char *name;
+    const char *(*fn)(void);
+} tests[] = {
+    { "read-concurrent-write", test_read_concurrent_write },
+    { "unrelated-write", test_unrelated_write },
+    { "abort", test_abort },
+};
+
+int main(int argc, char *argv[])
+{
+    unsigned int i, failed = 0;
+    const char *err;
+
+    xsh = xs_open(0);
+    xsh2 = xs_open(0);
+    if ( !xsh || !xsh2 )
+    {
+        perror("xs_open");
+        return 2;
+    }
+
+    for ( i = 0; i < sizeof(tests) / sizeof(tests[0]); i++ )
+    {
+        err = setup() ? tests[i].fn() : "setup failed";
+        printf("%-24s %s%s%s\n", tests[i].name, err ? "FAIL (" : "PASS",
+               err ?: "", err ? ")" : "");
+        if ( err )
+            failed++;
+    }
+
+    xs_rm(xsh, XBT_NULL, TEST_DIR);
+    xs_close(xsh2);
+    xs_close(xsh);
+
+    return failed ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,557 @@
+/*
+ * xs-bench.c
+ *
+ * Benchmark and load generator for xenstored.
+ *
+ * Simulates a number of backends and guests talking to xenstored via
+ * libxenstore, the way frontend and backend drivers do: guests read,
+ * write and list the nodes of their frontend directory and update them
+ * in transactions, backends watch the frontend directories of their
+ * guests and react to state changes with transactions of their own.
+ *
+ * As only the xenstore socket is needed, this can be run against a local
+ * "xenstored -N -D" without a hypervisor.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 2 of the License only.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include <xenstore.h>
+
+#include "bench.h"
+
+enum bench_op {
+    OP_READ,
+    OP_WRITE,
+    OP_DIRECTORY,
+    OP_TRANSACTION,
+    OP_WATCH,
+    NR_OPS
+};
+
+static const char *op_names[NR_OPS] = {
+    [OP_READ]        = "read",
+    [OP_WRITE]       = "write",
+    [OP_DIRECTORY]   = "directory",
+    [OP_TRANSACTION] = "transaction",
+    [OP_WATCH]       = "watch",
+};
+
+/*
+ * Latencies (in ns) are kept in a log-linear histogram: 2^HIST_SUB_BITS
+ * buckets per power of two, i.e. a resolution of 12.5%.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+struct op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t eagain;
+    uint64_t max_ns;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+struct bench_stats {
+    struct op_stats op[NR_OPS];
+};
+
+static unsigned int nr_backends = 4;
+static unsigned int nr_guests = 16;
+static unsigned int nr_nodes = 8;
+static unsigned int duration = 10;
+static const char *base = "/bench";
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+    unsigned int msb;
+
+    if ( ns < HIST_SUB )
+        return ns;
+
+    msb = 63 - __builtin_clzll(ns);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+           ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Upper bound of the latencies counted in a bucket. */
+static uint64_t hist_value(unsigned int bucket)
+{
+    unsigned int shift;
+
+    if ( bucket < HIST_SUB )
+        return bucket;
+
+    shift = (bucket >> HIST_SUB_BITS) - 1;
+    return (((uint64_t)HIST_SUB + (bucket & (HIST_SUB - 1)) + 1) << shift) - 1;
+}
+
+static void record(struct bench_stats *stats, enum bench_op op, uint64_t ns)
+{
+    struct op_stats *s = &stats->op[op];
+
+    s->count++;
+    s->hist[hist_bucket(ns)]++;
+    if ( ns > s->max_ns )
+        s->max_ns = ns;
+}
+
+static uint64_t percentile(const struct op_stats *s, unsigned int pct)
+{
+    uint64_t want = (s->count * pct + 99) / 100, seen = 0;
+    unsigned int i;
+
+    for ( i = 0; i < HIST_BUCKETS; i++ )
+    {
+        seen += s->hist[i];
+        if ( seen >= want && seen )
+            return hist_value(i) < s->max_ns ? hist_value(i) : s->max_ns;
+    }
+
+    return s->max_ns;
+}
+
+static char *frontend_path(char *buf, size_t len, unsigned int guest,
+                           const char *node)
+{
+    snprintf(buf, len, "%s/frontend/%u%s%s", base, guest,
+             node ? "/" : "", node ? node : "");
+    return buf;
+}
+
+static char *backend_path(char *buf, size_t len, unsigned int guest)
+{
+    snprintf(buf, len, "%s/backend/%u/%u/state", base,
+             guest % nr_backends, guest);
+    return buf;
+}
+
+/* Write the current time, so the backend can measure watch latency. */
+static bool write_stamp(struct xs_handle *xsh, xs_transaction_t t,
+                        const char *path)
+{
+    char val[32];
+
+    snprintf(val, sizeof(val), "%"PRIu64, bench_now_ns());
+    return xs_write(xsh, t, path, val, strlen(val));
+}
+
+/* One frontend update: read both states, write a frontend node. */
+static void guest_transaction(struct xs_handle *xsh, struct bench_stats *stats,
+                              unsigned int guest)
+{
+    struct op_stats *s = &stats->op[OP_TRANSACTION];
+    char path[256];
+    xs_transaction_t t;
+    uint64_t start;
+    unsigned int len;
+    bool ok;
+
+    start = bench_now_ns();
+    t = xs_transaction_start(xsh);
+    if ( t == XBT_NULL )
+    {
+        s->errors++;
+        return;
+    }
+
+    free(xs_read(xsh, t, backend_path(path, sizeof(path), guest), &len));
+    free(xs_read(xsh, t, frontend_path(path, sizeof(path), guest, "state"),
+                 &len));
+    ok = write_stamp(xsh, t, frontend_path(path, sizeof(path), guest,
+                                           "ring-ref"));
+
+    if ( !xs_transaction_end(xsh, t, !ok) )
+    {
+        if ( errno == EAGAIN )
+            s->eagain++;
+        else
+            s->errors++;
+    }
+    else if ( !ok )
+        s->errors++;
+
+    record(stats, OP_TRANSACTION, bench_now_ns() - start);
+}
+
+static void run_guest(struct xs_handle *xsh, struct bench_stats *stats,
+                      unsigned int guest, uint64_t end)
+{
+    unsigned int seed = guest + 1, len, num, r;
+    char path[256], node[16];
+    uint64_t start;
+    void *p;
+
+    while ( bench_now_ns() < end )
+    {
+        r = rand_r(&seed) % 100;
+        start = bench_now_ns();
+
+        if ( r < 50 )
+        {
+            snprintf(node, sizeof(node), "node-%u",
+                     rand_r(&seed) % nr_nodes);
+            p = xs_read(xsh, XBT_NULL,
+                        frontend_path(path, sizeof(path), guest, node), &len);
+            if ( !p )
+                stats->op[OP_READ].errors++;
+            free(p);
+            record(stats, OP_READ, bench_now_ns() - start);
+        }
+        else if ( r < 70 )
+        {
+            if ( !write_stamp(xsh, XBT_NULL,
+                              frontend_path(path, sizeof(path), guest,
+                                            "state")) )
+                stats->op[OP_WRITE].errors++;
+            record(stats, OP_WRITE, bench_now_ns() - start);
+        }
+        else if ( r < 85 )
+        {
+            p = xs_directory(xsh, XBT_NULL,
+                             frontend_path(path, sizeof(path), guest, NULL),
+                             &num);
+            if ( !p )
+                stats->op[OP_DIRECTORY].errors++;
+            free(p);
+            record(stats, OP_DIRECTORY, bench_now_ns() - start);
+        }
+        else
+            guest_transaction(xsh, stats, guest);
+    }
+}
+
+/* React to a frontend state change by updating the backend state. */
+static void backend_event(struct xs_handle *xsh, struct bench_stats *stats,
+                          unsigned int guest, const char *path)
+{
+    struct op_stats *s = &stats->op[OP_TRANSACTION];
+    char bpath[256];
+    xs_transaction_t t;
+    uint64_t start, stamp;
+    unsigned int len;
+    char *val;
+    bool ok;
+
+    start = bench_now_ns();
+    val = xs_read(xsh, XBT_NULL, path, &len);
+    if ( !val )
+    {
+        stats->op[OP_READ].errors++;
+        return;
+    }
+    record(stats, OP_READ, bench_now_ns() - start);
+
+    /* Initial watch events don't carry a timestamp of interest. */
+    stamp = strtoull(val, NULL, 10);
+    free(val);
+    if ( stamp && stamp <= start )
+        record(stats, OP_WATCH, start - stamp);
+
+    start = bench_now_ns();
+    t = xs_transaction_start(xsh);
+    if ( t == XBT_NULL )
+    {
+        s->errors++;
+        return;
+    }
+
+    free(xs_read(xsh, t, path, &len));
+    ok = write_stamp(xsh, t, backend_path(bpath, sizeof(bpath), guest));
+
+    if ( !xs_transaction_end(xsh, t, !ok) )
+    {
+        if ( errno == EAGAIN )
+            s->eagain++;
+        else
+            s->errors++;
+    }
+    else if ( !ok )
+        s->errors++;
+
+    record(stats, OP_TRANSACTION, bench_now_ns() - start);
+}
+
+static void run_backend(struct xs_handle *xsh, struct bench_stats *stats,
+                        unsigned int backend, uint64_t end)
+{
+    struct pollfd pfd = { .fd = xs_fileno(xsh), .events = POLLIN };
+    unsigned int guest, len;
+    char **vec;
+    uint64_t now;
+
+    while ( (now = bench_now_ns()) < end )
+    {
+        vec = xs_check_watch(xsh);
+        if ( !vec )
+        {
+            if ( errno != EAGAIN )
+            {
+                PERROR("Failed to read watch event");
+                return;
+            }
+            poll(&pfd, 1, (end - now) / 1000000 + 1);
+            continue;
+        }
+
+        len = strlen(vec[XS_WATCH_PATH]);
+        guest = strtoul(vec[XS_WATCH_TOKEN], NULL, 10);
+        if ( len > 6 && !strcmp(vec[XS_WATCH_PATH] + len - 6, "/state") )
+            backend_event(xsh, stats, guest, vec[XS_WATCH_PATH]);
+        free(vec);
+    }
+}
+
+/* Workers 0 to nr_backends - 1 are backends, the others guests. */
+static int worker(unsigned int idx, uint64_t start, uint64_t end, void *priv)
+{
+    struct bench_stats *stats = priv;
+    bool backend = idx < nr_backends;
+    struct xs_handle *xsh;
+    unsigned int guest;
+    char path[256], token[16];
+
+    if ( !backend )
+        idx -= nr_backends;
+
+    xsh = xs_open(0);
+    if ( !xsh )
+    {
+        PERROR("Failed to open xenstore");
+        return 1;
+    }
+
+    if ( backend )
+    {
+        for ( guest = idx; guest < nr_guests; guest += nr_backends )
+        {
+            snprintf(token, sizeof(token), "%u", guest);
+            if ( !xs_watch(xsh, frontend_path(path, sizeof(path), guest, NULL),
+                           token) )
+            {
+                PERROR("Failed to watch %s", path);
+                return 1;
+            }
+        }
+    }
+
+    bench_sleep_until(start);
+
+    if ( backend )
+        run_backend(xsh, stats, idx, end);
+    else
+        run_guest(xsh, stats, idx, end);
+
+    xs_close(xsh);
+
+    return 0;
+}
+
+static void add_stats(struct bench_stats *total, const struct bench_stats *s)
+{
+    unsigned int op, i;
+
+    for ( op = 0; op < NR_OPS; op++ )
+    {
+        total->op[op].count += s->op[op].count;
+        total->op[op].errors += s->op[op].errors;
+        total->op[op].eagain += s->op[op].eagain;
+        if ( s->op[op].max_ns > total->op[op].max_ns )
+            total->op[op].max_ns = s->op[op].max_ns;
+        for ( i = 0; i < HIST_BUCKETS; i++ )
+            total->op[op].hist[i] += s->op[op].hist[i];
+    }
+}
+
+static void print_stats(const char *role, const struct bench_stats *stats)
+{
+    const struct op_stats *s;
+    unsigned int op;
+
+    printf("%s:\n", role);
+    printf("  %-12s %10s %10s %9s %9s %9s %9s %7s %7s\n",
+           "op", "count", "ops/s", "p50(us)", "p90(us)", "p99(us)",
+           "max(us)", "errors", "eagain");
+
+    for ( op = 0; op < NR_OPS; op++ )
+    {
+        s = &stats->op[op];
+        if ( !s->count && !s->errors )
+            continue;
+
+        printf("  %-12s %10"PRIu64" %10.0f %9.1f %9.1f %9.1f %9.1f %7"PRIu64,
+               op_names[op], s->count, (double)s->count / duration,
+               percentile(s, 50) / 1000.0, percentile(s, 90) / 1000.0,
+               percentile(s, 99) / 1000.0, s->max_ns / 1000.0, s->errors);
+        if ( op == OP_TRANSACTION && s->count )
+            printf(" %6.2f%%", 100.0 * s->eagain / s->count);
+        printf("\n");
+    }
+}
+
+static bool setup_nodes(struct xs_handle *xsh)
+{
+    char path[256], node[16];
+    unsigned int guest, i;
+
+    xs_rm(xsh, XBT_NULL, base);
+
+    for ( guest = 0; guest < nr_guests; guest++ )
+    {
+        for ( i = 0; i < nr_nodes; i++ )
+        {
+            snprintf(node, sizeof(node), "node-%u", i);
+            if ( !xs_write(xsh, XBT_NULL,
+                           frontend_path(path, sizeof(path), guest, node),
+                           node, strlen(node)) )
+                return false;
+        }
+
+        if ( !xs_write(xsh, XBT_NULL,
+                       frontend_path(path, sizeof(path), guest, "state"),
+                       "0", 1) ||
+             !xs_write(xsh, XBT_NULL,
+                       frontend_path(path, sizeof(path), guest, "ring-ref"),
+                       "0", 1) ||
+             !xs_write(xsh, XBT_NULL,
+                       backend_path(path, sizeof(path), guest), "0", 1) )
+            return false;
+    }
+
+    return true;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+"Usage: %s [options]\n"
+"\n"
+"  -b, --backends <nb>    number of simulated backends (default %u),\n"
+"  -g, --guests <nb>      number of simulated guests (default %u),\n"
+"  -n, --nodes <nb>       nodes per frontend directory (default %u),\n"
+"  -t, --time <secs>      duration of the run (default %u),\n"
+"  -p, --path <path>      base path for the benchmark nodes (default %s),\n"
+"  -h, --help             to output this message.\n",
+            prog, nr_backends, nr_guests, nr_nodes, duration, base);
+}
+
+static struct option options[] = {
+    { "backends", 1, NULL, 'b' },
+    { "guests", 1, NULL, 'g' },
+    { "nodes", 1, NULL, 'n' },
+    { "time", 1, NULL, 't' },
+    { "path", 1, NULL, 'p' },
+    { "help", 0, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+    struct bench_stats *stats, guest_total, backend_total;
+    unsigned int i, nr_workers;
+    struct xs_handle *xsh;
+    int opt, rc;
+
+    while ( (opt = getopt_long(argc, argv, "b:g:n:t:p:h", options,
+                               NULL)) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'b':
+            nr_backends = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            nr_guests = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            nr_nodes = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            duration = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            base = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if ( optind != argc || !nr_backends || !nr_guests || !nr_nodes ||
+         !duration )
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    xsh = xs_open(0);
+    if ( !xsh )
+    {
+        PERROR("Failed to open xenstore");
+        return 1;
+    }
+
+    if ( !setup_nodes(xsh) )
+    {
+        PERROR("Failed to create benchmark nodes below %s", base);
+        xs_close(xsh);
+        return 1;
+    }
+
+    nr_workers = nr_backends + nr_guests;
+    stats = calloc(nr_workers, sizeof(*stats));
+    if ( !stats )
+    {
+        PERROR("Failed to allocate memory");
+        return 1;
+    }
+
+    rc = bench_run(nr_workers, duration, worker, stats, sizeof(*stats)) != 0;
+
+    memset(&guest_total, 0, sizeof(guest_total));
+    memset(&backend_total, 0, sizeof(backend_total));
+    for ( i = 0; i < nr_workers; i++ )
+        add_stats(i < nr_backends ? &backend_total : &guest_total, &stats[i]);
+
+    printf("xs-bench: %u backends, %u guests, %u nodes, %u seconds\n",
+           nr_backends, nr_guests, nr_nodes, duration);
+    print_stats("guests", &guest_total);
+    print_stats("backends", &backend_total);
+    add_stats(&guest_total, &backend_total);
+    print_stats("total", &guest_total);
+
+    xs_rm(xsh, XBT_NULL, base);
+    xs_close(xsh);
+    free(stats);
+
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -50,6 +50,7 @@
 #include "xenstored_watch.h"
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "tdb.h"
 
 #include "hashtable.h"
@@ -72,57 +73,28 @@ static unsigned int nr_fds;
 
 #define ROUNDUP(_x, _w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
 
+/* Maximum number of requests or responses per domain and loop iteration. */
+#define DOMAIN_BATCH_SIZE 32
+
 static bool verbose = false;
 LIST_HEAD(connections);
+static LIST_HEAD(active_conns);
 static int tracefd = -1;
 static bool recovery = true;
 static bool remove_local = true;
 static int reopen_log_pipe[2];
 static int reopen_log_pipe0_pollfd_idx = -1;
 static char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
 static bool trigger_talloc_report = false;
 
-static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
 
-#define log(...)							\
-	do {								\
-		char *s = talloc_asprintf(NULL, __VA_ARGS__);		\
-		if (s) {						\
-			trace("%s\n", s);				\
-			syslog(LOG_ERR, "%s",  s);			\
-			talloc_free(s);					\
-		} else {						\
-			trace("talloc failure during logging\n");	\
-			syslog(LOG_ERR, "talloc failure during logging\n"); \
-		}							\
-	} while (0)
-
 
 int quota_nb_entry_per_domain = 1000;
 int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
-{
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
-}
-
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
-{
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
-}
-
 static char *sockmsg_string(enum xsd_sockmsg_type type)
 {
 	switch (type) {
@@ -315,6 +287,7 @@ static int destroy_conn(void *_conn)
         if (conn->target)
                 talloc_unlink(conn, conn->target);
 	list_del(&conn->list);
+	list_del(&conn->active_list);
 	trace_destroy(conn, "connection");
 	return 0;
 }
@@ -358,12 +331,19 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 			   int *ptimeout)
 {
 	struct connection *conn;
+	int msecs;
 
 	if (fds)
 		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
 	nr_fds = 0;
 
-	*ptimeout = -1;
+	/* Don't block while domains have pending ring work. */
+	*ptimeout = list_empty(&active_conns) ? -1 : 0;
+
+	/* Wake up in time for the next snapshot of the store. */
+	msecs = store_snapshot_timeout();
+	if (msecs >= 0 && (*ptimeout < 0 || msecs < *ptimeout))
+		*ptimeout = msecs;
 
 	if (sock != -1)
 		*p_sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
@@ -378,12 +358,7 @@ static void initialize_fds(int sock, int *p_sock_pollfd_idx,
 					POLLIN|POLLPRI);
 
 	list_for_each_entry(conn, &connections, list) {
-		if (conn->domain) {
-			if (domain_can_read(conn) ||
-			    (domain_can_write(conn) &&
-			     !list_empty(&conn->out_list)))
-				*ptimeout = 0;
-		} else {
+		if (!conn->domain) {
 			short events = POLLIN|POLLPRI;
 			if (!list_empty(&conn->out_list))
 				events |= POLLOUT;
@@ -415,39 +390,47 @@ bool is_child(const char *child, const char *parent)
 static struct node *read_node(struct connection *conn, const void *ctx,
 			      const char *name)
 {
-	TDB_DATA key, data;
-	uint32_t *p;
+	TDB_DATA data;
+	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
+	struct transaction *trans = conn ? conn->transaction : NULL;
 
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
+	if (trans && transaction_fetch(trans, ctx, name, &data)) {
+		/* Node was modified in the transaction: use private copy. */
+		if (data.dptr == NULL)
+			return NULL;
+	} else {
+		if (!store_fetch(ctx, name, &data)) {
+			/* Absence of the node is relevant, too. */
+			if (errno == ENOENT && trans &&
+			    transaction_note_read(trans, name, NO_GENERATION))
+				errno = ENOENT;
+			return NULL;
+		}
 
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
+		hdr = (void *)data.dptr;
+		if (trans && !transaction_note_read(trans, name,
+						    hdr->generation)) {
+			talloc_free(data.dptr);
+			return NULL;
 		}
-		return NULL;
 	}
 
 	node = talloc(ctx, struct node);
 	node->name = talloc_strdup(node, name);
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
+	node->trans = trans;
 	talloc_steal(node, data.dptr);
 
-	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
+	/* Generation, datalen, childlen, number of permissions */
+	hdr = (void *)data.dptr;
+	node->generation = hdr->generation;
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
 
 	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
+	node->perms = hdr->perms;
 	/* Data is binary blob (usually ascii, no nul). */
 	node->data = node->perms + node->num_perms;
 	/* Children is strings, nul separated. */
@@ -456,31 +439,34 @@ static struct node *read_node(struct connection *conn, const void *ctx,
 	return node;
 }
 
-static bool write_node(struct connection *conn, const struct node *node)
+static bool write_node(struct connection *conn, struct node *node)
 {
-	/*
-	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
-	 */
+	/* conn will be null when this is called from manual_node. */
 
-	TDB_DATA key, data;
+	TDB_DATA data;
+	struct xs_tdb_record_hdr *hdr;
 	void *p;
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	data.dsize = 3*sizeof(uint32_t)
+	data.dsize = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
 	if (domain_is_unprivileged(conn) && data.dsize >= quota_max_entry_size)
 		goto error;
 
+	/* Nodes written in a transaction get their generation on commit. */
+	if (conn && conn->transaction)
+		node->generation = NO_GENERATION;
+	else
+		node->generation = store_next_generation();
+
 	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
+	hdr = (void *)data.dptr;
+	hdr->generation = node->generation;
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
 
 	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
 	p += node->num_perms*sizeof(node->perms[0]);
@@ -488,9 +474,11 @@ static bool write_node(struct connection *conn, const struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
-	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
-		corrupt(conn, "Write of %s failed", key.dptr);
+	if (conn && conn->transaction)
+		return transaction_store(conn->transaction, node->name, data);
+
+	if (!store_write(node->name, data)) {
+		corrupt(conn, "Write of %s failed", node->name);
 		goto error;
 	}
 	return true;
@@ -689,6 +677,8 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	if (conn->domain)
+		set_conn_active(conn);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -822,14 +812,18 @@ static void do_read(struct connection *conn, struct buffered_data *in)
 	send_reply(conn, XS_READ, node->data, node->datalen);
 }
 
-static void delete_node_single(struct connection *conn, struct node *node)
+/* Remove a node record from the transaction, or the main database. */
+static bool remove_node_data(struct transaction *trans, const char *name)
 {
-	TDB_DATA key;
+	if (trans)
+		return transaction_delete(trans, name);
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
+	return store_delete(name);
+}
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+static void delete_node_single(struct connection *conn, struct node *node)
+{
+	if (!remove_node_data(conn ? conn->transaction : NULL, node->name)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -870,7 +864,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->trans = conn ? conn->transaction : NULL;
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -891,15 +885,11 @@ static struct node *construct_node(struct connection *conn, const char *name)
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
+	remove_node_data(node->trans, node->name);
 	return 0;
 }
 
@@ -1231,6 +1221,13 @@ static void do_debug(struct connection *conn, struct buffered_data *in)
 	if (streq(in->buffer, "check"))
 		check_store();
 
+	if (streq(in->buffer, "transactions")) {
+		char *stats = transaction_stats(in);
+
+		send_reply(conn, XS_DEBUG, stats, strlen(stats) + 1);
+		return;
+	}
+
 	send_ack(conn, XS_DEBUG);
 }
 
@@ -1403,6 +1400,69 @@ static void handle_output(struct connection *conn)
 		talloc_free(conn);
 }
 
+void set_conn_active(struct connection *conn)
+{
+	if (list_empty(&conn->active_list))
+		list_add_tail(&conn->active_list, &active_conns);
+}
+
+static bool domain_has_work(struct connection *conn)
+{
+	return domain_can_read(conn) ||
+	       (domain_can_write(conn) && !list_empty(&conn->out_list));
+}
+
+/*
+ * Handle a batch of requests and responses of a domain connection, and
+ * send a single event for all of them.  Connections with work left are
+ * handled again in the next main loop iteration, so one busy domain can't
+ * starve the others.  Returns false if the connection was freed.
+ */
+static bool handle_domain_conn(struct connection *conn)
+{
+	unsigned int i;
+
+	for (i = 0; i < DOMAIN_BATCH_SIZE && domain_can_read(conn); i++) {
+		talloc_increase_ref_count(conn);
+		handle_input(conn);
+		if (talloc_free(conn) == 0)
+			return false;
+	}
+
+	for (i = 0; i < DOMAIN_BATCH_SIZE && domain_can_write(conn) &&
+		    !list_empty(&conn->out_list); i++) {
+		talloc_increase_ref_count(conn);
+		handle_output(conn);
+		if (talloc_free(conn) == 0)
+			return false;
+	}
+
+	domain_notify(conn);
+
+	/* Replies queued above might have been sent already. */
+	if (domain_has_work(conn))
+		set_conn_active(conn);
+	else
+		list_del_init(&conn->active_list);
+
+	return true;
+}
+
+static void handle_active_conns(void)
+{
+	struct connection *conn;
+	LIST_HEAD(batch);
+
+	/* Connections becoming active from now on are for the next round. */
+	list_splice_init(&active_conns, &batch);
+
+	while (!list_empty(&batch)) {
+		conn = list_entry(batch.next, struct connection, active_list);
+		list_del_init(&conn->active_list);
+		handle_domain_conn(conn);
+	}
+}
+
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 {
 	struct connection *new;
@@ -1413,6 +1473,7 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 
 	new->fd = -1;
 	new->pollfd_idx = -1;
+	INIT_LIST_HEAD(&new->active_list);
 	new->write = write;
 	new->read = read;
 	new->can_write = true;
@@ -1494,7 +1555,8 @@ static void accept_connection(int sock, bool canwrite)
 }
 #endif
 
-static int tdb_flags;
+static bool internal_db = false;
+static unsigned int snapshot_interval = STORE_SNAPSHOT_INTERVAL;
 
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
@@ -1541,11 +1603,8 @@ static void setup_structure(void)
 	char *tdbname;
 	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
 
-	if (!(tdb_flags & TDB_INTERNAL))
-		tdb_ctx = tdb_open_ex(tdbname, 0, tdb_flags, O_RDWR, 0,
-				      &tdb_logger, NULL);
-
-	if (tdb_ctx) {
+	if (store_init(tdbname, !internal_db, snapshot_interval,
+		       &tdb_logger)) {
 		/* XXX When we make xenstored able to restart, this will have
 		   to become cleverer, checking for existing domains and not
 		   removing the corresponding entries, but for now xenstored
@@ -1574,11 +1633,6 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open_ex(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
-				      0640, &tdb_logger, NULL);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
-
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
 		manual_node("/tool/xenstored", NULL);
@@ -1588,7 +1642,7 @@ static void setup_structure(void)
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1601,7 +1655,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1706,22 +1760,16 @@ static void check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static void clean_store_(const char *name, void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
 
-	if (!hashtable_search(reachable, name)) {
+	if (!hashtable_search(reachable, (void *)name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			store_delete(name);
 		}
 	}
-
-	talloc_free(name);
-
-	return 0;
 }
 
 
@@ -1731,7 +1779,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	store_traverse(&clean_store_, reachable);
 }
 
 
@@ -1753,7 +1801,7 @@ static void check_store(void)
 
 
 /* Something is horribly wrong: check the store. */
-static void corrupt(struct connection *conn, const char *fmt, ...)
+void corrupt(struct connection *conn, const char *fmt, ...)
 {
 	va_list arglist;
 	char *str;
@@ -1864,6 +1912,8 @@ static void usage(void)
 "  -R, --no-recovery       to request that no recovery should be attempted when\n"
 "                          the store is corrupted (debug only),\n"
 "  -I, --internal-db       store database in memory, not on disk\n"
+"  -s, --snapshot-interval <secs>  write changes to disk at most every\n"
+"                          <secs> seconds (default 5),\n"
 "  -L, --preserve-local    to request that /local is preserved on start-up,\n"
 "  -M, --memory-debug <file>  support memory debugging to file,\n"
 "  -V, --verbose           to request verbose execution.\n");
@@ -1886,6 +1936,7 @@ static struct option options[] = {
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "preserve-local", 0, NULL, 'L' },
 	{ "internal-db", 0, NULL, 'I' },
+	{ "snapshot-interval", 1, NULL, 's' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
 	{ "memory-debug", 1, NULL, 'M' },
@@ -1908,7 +1959,7 @@ int main(int argc, char *argv[])
 	int timeout;
 
 
-	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:M:", options,
+	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLIs:VW:M:", options,
 				  NULL)) != -1) {
 		switch (opt) {
 		case 'D':
@@ -1945,7 +1996,10 @@ int main(int argc, char *argv[])
 			tracefile = optarg;
 			break;
 		case 'I':
-			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
+			internal_db = true;
+			break;
+		case 's':
+			snapshot_interval = strtoul(optarg, NULL, 10);
 			break;
 		case 'V':
 			verbose = true;
@@ -2055,6 +2109,8 @@ int main(int argc, char *argv[])
 			barf_perror("Poll failed");
 		}
 
+		store_snapshot_check();
+
 		if (reopen_log_pipe0_pollfd_idx != -1) {
 			if (fds[reopen_log_pipe0_pollfd_idx].revents
 			    & ~POLLIN) {
@@ -2101,6 +2157,8 @@ int main(int argc, char *argv[])
 			}
 		}
 
+		handle_active_conns();
+
 		next = list_entry(connections.next, typeof(*conn), list);
 		if (&next->list != &connections)
 			talloc_increase_ref_count(next);
@@ -2113,17 +2171,9 @@ int main(int argc, char *argv[])
 				talloc_increase_ref_count(next);
 
 			if (conn->domain) {
-				if (domain_can_read(conn))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (domain_can_write(conn) &&
-				    !list_empty(&conn->out_list))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
-					continue;
+				/* Handled via handle_active_conns(). */
+				talloc_free(conn);
+				continue;
 			} else {
 				if (conn->pollfd_idx != -1) {
 					if (fds[conn->pollfd_idx].revents
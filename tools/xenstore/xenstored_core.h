@@ -28,8 +28,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <errno.h>
+#include <syslog.h>
 
 #include "xenstore_lib.h"
+#include "xenstored_tdb.h"
 #include "list.h"
 #include "tdb.h"
 
@@ -60,6 +62,9 @@ struct connection
 {
 	struct list_head list;
 
+	/* Domain connections with pending ring work (see set_conn_active). */
+	struct list_head active_list;
+
 	/* The file descriptor we came in on. */
 	int fd;
 	/* The index of pollfd in global pollfd array */
@@ -103,8 +108,12 @@ extern struct list_head connections;
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Transaction I came from (NULL if none) */
+	struct transaction *trans;
+
+	/* Generation count of the last write, NO_GENERATION if not stored */
+	uint64_t generation;
+#define NO_GENERATION ~((uint64_t)0)
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -153,17 +162,18 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
-
-/* Destructor for tdbs: required for transaction code */
-int destroy_tdb(void *_tdb);
+/* Something is horribly wrong: check the store. */
+void corrupt(struct connection *conn, const char *fmt, ...);
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
+/* Hashtable helpers for string keys. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
 
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
+/* Have the main loop look at the ring of this domain connection. */
+void set_conn_active(struct connection *conn);
+
 
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
@@ -175,6 +185,19 @@ void trace_watch_timeout(const struct connection *conn, const char *node, const
 void trace(const char *fmt, ...);
 void dtrace_io(const struct connection *conn, const struct buffered_data *data, int out);
 
+#define log(...)							\
+	do {								\
+		char *s = talloc_asprintf(NULL, __VA_ARGS__);		\
+		if (s) {						\
+			trace("%s\n", s);				\
+			syslog(LOG_ERR, "%s",  s);			\
+			talloc_free(s);					\
+		} else {						\
+			trace("talloc failure during logging\n");	\
+			syslog(LOG_ERR, "talloc failure during logging\n"); \
+		}							\
+	} while (0)
+
 extern int event_fd;
 extern int dom0_domid;
 extern int dom0_event;
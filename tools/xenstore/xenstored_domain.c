@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <fcntl.h>
 
 #include "utils.h"
 #include "talloc.h"
@@ -69,6 +70,9 @@ struct domain
 	/* Have we noticed that this domain is shutdown? */
 	int shutdown;
 
+	/* Did we update the ring indexes since the last notification? */
+	bool notify;
+
 	/* number of entry from this domain in the store */
 	int nbentry;
 
@@ -78,6 +82,40 @@ struct domain
 
 static LIST_HEAD(domains);
 
+/* Domains indexed by local event channel port. */
+static struct domain **port_domains;
+static unsigned int nr_port_domains;
+
+/* Can we read all pending events at once? */
+static bool xce_nonblock;
+
+static void set_port_domain(evtchn_port_t port, struct domain *domain)
+{
+	struct domain **new;
+	unsigned int nr;
+
+	if (port >= nr_port_domains) {
+		if (!domain)
+			return;
+		nr = (port + 64) & ~63;
+		new = talloc_realloc(talloc_autofree_context(), port_domains,
+				     struct domain *, nr);
+		if (!new)
+			barf_perror("Failed to allocate port table");
+		memset(new + nr_port_domains, 0,
+		       (nr - nr_port_domains) * sizeof(*new));
+		port_domains = new;
+		nr_port_domains = nr;
+	}
+
+	port_domains[port] = domain;
+}
+
+static struct domain *find_domain_by_port(evtchn_port_t port)
+{
+	return port < nr_port_domains ? port_domains[port] : NULL;
+}
+
 static bool check_indexes(XENSTORE_RING_IDX cons, XENSTORE_RING_IDX prod)
 {
 	return ((prod - cons) <= XENSTORE_RING_SIZE);
@@ -129,7 +167,7 @@ static int writechn(struct connection *conn,
 	xen_mb();
 	intf->rsp_prod += len;
 
-	xenevtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -159,7 +197,7 @@ static int readchn(struct connection *conn, void *data, unsigned int len)
 	xen_mb();
 	intf->req_cons += len;
 
-	xenevtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -191,6 +229,7 @@ static int destroy_domain(void *_domain)
 	list_del(&domain->list);
 
 	if (domain->port) {
+		set_port_domain(domain->port, NULL);
 		if (xenevtchn_unbind(xce_handle, domain->port) == -1)
 			eprintf("> Unbinding port %i failed!\n", domain->port);
 	}
@@ -235,19 +274,27 @@ static void domain_cleanup(void)
 		fire_watches(NULL, NULL, "@releaseDomain", false);
 }
 
-/* We scan all domains rather than use the information given here. */
+/*
+ * Handle all pending events: a domain sending an event has its ring looked
+ * at by the main loop, so rings of idle domains aren't polled.
+ */
 void handle_event(void)
 {
 	evtchn_port_t port;
+	struct domain *domain;
 
 	if ((port = xenevtchn_pending(xce_handle)) == -1)
 		barf_perror("Failed to read from event fd");
 
-	if (port == virq_port)
-		domain_cleanup();
+	do {
+		if (port == virq_port)
+			domain_cleanup();
+		else if ((domain = find_domain_by_port(port)) && domain->conn)
+			set_conn_active(domain->conn);
 
-	if (xenevtchn_unmask(xce_handle, port) == -1)
-		barf_perror("Failed to write to event fd");
+		if (xenevtchn_unmask(xce_handle, port) == -1)
+			barf_perror("Failed to write to event fd");
+	} while (xce_nonblock && (port = xenevtchn_pending(xce_handle)) != -1);
 }
 
 bool domain_can_read(struct connection *conn)
@@ -267,6 +314,15 @@ bool domain_can_write(struct connection *conn)
 	return ((intf->rsp_prod - intf->rsp_cons) != XENSTORE_RING_SIZE);
 }
 
+void domain_notify(struct connection *conn)
+{
+	if (!conn->domain->notify)
+		return;
+
+	conn->domain->notify = false;
+	xenevtchn_notify(xce_handle, conn->domain->port);
+}
+
 static char *talloc_domain_path(void *context, unsigned int domid)
 {
 	return talloc_asprintf(context, "/local/domain/%u", domid);
@@ -281,6 +337,7 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	domain = talloc(context, struct domain);
 	domain->port = 0;
 	domain->shutdown = 0;
+	domain->notify = false;
 	domain->domid = domid;
 	domain->path = talloc_domain_path(domain, domid);
 
@@ -292,10 +349,12 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	if (rc == -1)
 	    return NULL;
 	domain->port = rc;
+	set_port_domain(domain->port, domain);
 
 	domain->conn = new_connection(writechn, readchn);
 	domain->conn->domain = domain;
 	domain->conn->id = domid;
+	set_conn_active(domain->conn);
 
 	domain->remote_port = port;
 	domain->nbentry = 0;
@@ -392,10 +451,14 @@ void do_introduce(struct connection *conn, struct buffered_data *in)
 		fire_watches(NULL, in, "@introduceDomain", false);
 	} else if ((domain->mfn == mfn) && (domain->conn != conn)) {
 		/* Use XS_INTRODUCE for recreating the xenbus event-channel. */
-		if (domain->port)
+		if (domain->port) {
+			set_port_domain(domain->port, NULL);
 			xenevtchn_unbind(xce_handle, domain->port);
+		}
 		rc = xenevtchn_bind_interdomain(xce_handle, domid, port);
 		domain->port = (rc == -1) ? 0 : rc;
+		if (domain->port)
+			set_port_domain(domain->port, domain);
 		domain->remote_port = port;
 	} else {
 		send_error(conn, EINVAL);
@@ -653,6 +716,10 @@ void domain_init(void)
 	if (xce_handle == NULL)
 		barf_perror("Failed to open evtchn device");
 
+	rc = fcntl(xenevtchn_fd(xce_handle), F_GETFL);
+	xce_nonblock = rc != -1 &&
+		fcntl(xenevtchn_fd(xce_handle), F_SETFL, rc | O_NONBLOCK) != -1;
+
 	if (dom0_init() != 0) 
 		barf_perror("Failed to initialize dom0 state"); 
 
@@ -54,6 +54,9 @@ void restore_existing_connections(void);
 bool domain_can_read(struct connection *conn);
 bool domain_can_write(struct connection *conn);
 
+/* Send one event for all ring updates since the last notification. */
+void domain_notify(struct connection *conn);
+
 bool domain_is_unprivileged(struct connection *conn);
 
 /* Quota manipulation */
@@ -0,0 +1,323 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "talloc.h"
+#include "list.h"
+#include "xenstored_store.h"
+#include "xenstored_transaction.h"
+#include "xenstore_lib.h"
+#include "hashtable.h"
+#include "utils.h"
+
+/*
+ * All nodes live in memory, indexed by their full path.  The tdb file is
+ * only used to persist the store: it is read once at startup, and the
+ * nodes changed since are written back to it at most every
+ * snapshot_interval seconds.  A deleted node keeps its entry, without
+ * data, until its deletion has been written.
+ */
+struct store_node
+{
+	/* All nodes, for traversal. */
+	struct list_head list;
+
+	/* Changed since the last snapshot, on store_dirty. */
+	struct list_head dirty;
+
+	/* Full path of the node, key in store_nodes. */
+	char *name;
+
+	/* Node record in tdb format (struct xs_tdb_record_hdr). */
+	TDB_DATA data;
+};
+
+static struct hashtable *store_nodes;
+static LIST_HEAD(store_list);
+
+static TDB_CONTEXT *store_tdb;
+static bool store_persistent;
+static unsigned int snapshot_interval;
+static LIST_HEAD(store_dirty);
+static time_t last_snapshot;
+
+/* Generation count for the next node write. */
+static uint64_t store_generation_next;
+
+static struct store_node *store_lookup(const char *name)
+{
+	return hashtable_search(store_nodes, (void *)name);
+}
+
+static void store_modified(struct store_node *sn)
+{
+	if (!store_persistent)
+		return;
+
+	/* Don't delay the first change after a quiet period. */
+	if (list_empty(&store_dirty) &&
+	    time(NULL) - last_snapshot >= snapshot_interval)
+		last_snapshot = 0;
+
+	if (list_empty(&sn->dirty))
+		list_add_tail(&sn->dirty, &store_dirty);
+}
+
+static void store_free(struct store_node *sn)
+{
+	list_del(&sn->list);
+	list_del(&sn->dirty);
+	/* Frees the key, which is sn->name. */
+	hashtable_remove(store_nodes, sn->name);
+	talloc_free(sn);
+}
+
+/* Find the entry for name, adding one without data if there is none. */
+static struct store_node *store_get(const char *name)
+{
+	struct store_node *sn;
+	char *key;
+
+	sn = store_lookup(name);
+	if (sn)
+		return sn;
+
+	sn = talloc_zero(NULL, struct store_node);
+	key = strdup(name);
+	if (!sn || !key || !hashtable_insert(store_nodes, key, sn)) {
+		free(key);
+		talloc_free(sn);
+		errno = ENOMEM;
+		return NULL;
+	}
+	sn->name = key;
+	list_add_tail(&sn->list, &store_list);
+	INIT_LIST_HEAD(&sn->dirty);
+
+	return sn;
+}
+
+bool store_reserve(const char *name)
+{
+	return store_get(name) != NULL;
+}
+
+void store_unreserve(const char *name)
+{
+	struct store_node *sn = store_lookup(name);
+
+	/* A deleted node still to be removed from disk must stay. */
+	if (sn && !sn->data.dptr && list_empty(&sn->dirty))
+		store_free(sn);
+}
+
+bool store_write(const char *name, TDB_DATA data)
+{
+	struct store_node *sn;
+
+	sn = store_get(name);
+	if (!sn)
+		return false;
+
+	talloc_free(sn->data.dptr);
+	sn->data = data;
+	talloc_steal(sn, data.dptr);
+	store_modified(sn);
+
+	return true;
+}
+
+bool store_fetch(const void *ctx, const char *name, TDB_DATA *data)
+{
+	struct store_node *sn = store_lookup(name);
+
+	if (!sn || !sn->data.dptr) {
+		errno = ENOENT;
+		return false;
+	}
+
+	data->dsize = sn->data.dsize;
+	data->dptr = talloc_memdup(ctx, sn->data.dptr, sn->data.dsize);
+	if (!data->dptr) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	return true;
+}
+
+uint64_t store_generation(const char *name)
+{
+	struct store_node *sn = store_lookup(name);
+	struct xs_tdb_record_hdr *hdr;
+
+	if (!sn || !sn->data.dptr)
+		return NO_GENERATION;
+
+	hdr = (void *)sn->data.dptr;
+	return hdr->generation;
+}
+
+uint64_t store_next_generation(void)
+{
+	return store_generation_next++;
+}
+
+bool store_delete(const char *name)
+{
+	struct store_node *sn = store_lookup(name);
+
+	if (!sn || !sn->data.dptr)
+		return false;
+
+	talloc_free(sn->data.dptr);
+	sn->data.dptr = NULL;
+	sn->data.dsize = 0;
+
+	store_modified(sn);
+	if (list_empty(&sn->dirty))
+		store_free(sn);
+
+	return true;
+}
+
+void store_traverse(void (*fn)(const char *name, void *priv), void *priv)
+{
+	struct store_node *sn, *tmp;
+
+	list_for_each_entry_safe(sn, tmp, &store_list, list)
+		if (sn->data.dptr)
+			fn(sn->name, priv);
+}
+
+static int store_load_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+		       void *private)
+{
+	char *name = talloc_strndup(NULL, (char *)key.dptr, key.dsize);
+	struct xs_tdb_record_hdr *hdr = (void *)val.dptr;
+	TDB_DATA data;
+
+	/* New generations must not collide with loaded ones. */
+	if (hdr->generation >= store_generation_next)
+		store_generation_next = hdr->generation + 1;
+
+	data.dsize = val.dsize;
+	data.dptr = talloc_memdup(name, val.dptr, val.dsize);
+	if (!name || !data.dptr || !store_write(name, data))
+		barf("Could not load node from tdb");
+
+	talloc_free(name);
+
+	return 0;
+}
+
+/* Write the nodes changed since the last snapshot to disk. */
+static void store_snapshot(void)
+{
+	struct store_node *sn, *tmp;
+	TDB_DATA key;
+	int ret;
+
+	list_for_each_entry_safe(sn, tmp, &store_dirty, dirty) {
+		key.dptr = (void *)sn->name;
+		key.dsize = strlen(sn->name);
+
+		if (sn->data.dptr)
+			ret = tdb_store(store_tdb, key, sn->data, TDB_REPLACE);
+		else if ((ret = tdb_delete(store_tdb, key)) &&
+			 tdb_error(store_tdb) == TDB_ERR_NOEXIST)
+			ret = 0;
+
+		/* Keep the rest dirty and try again next time. */
+		if (ret) {
+			log("Could not write %s to tdb: %s", sn->name,
+			    tdb_errorstr(store_tdb));
+			break;
+		}
+
+		list_del_init(&sn->dirty);
+		if (!sn->data.dptr)
+			store_free(sn);
+	}
+
+	last_snapshot = time(NULL);
+}
+
+int store_snapshot_timeout(void)
+{
+	time_t now;
+
+	if (list_empty(&store_dirty))
+		return -1;
+
+	now = time(NULL);
+	if (now - last_snapshot >= snapshot_interval)
+		return 0;
+
+	return (last_snapshot + snapshot_interval - now) * 1000;
+}
+
+void store_snapshot_check(void)
+{
+	if (store_snapshot_timeout() == 0)
+		store_snapshot();
+}
+
+bool store_init(const char *tdbname, bool persistent, unsigned int interval,
+		tdb_log_func logger)
+{
+	store_nodes = create_hashtable(7919, hash_from_key_fn, keys_equal_fn);
+	if (!store_nodes)
+		barf_perror("Could not create node store");
+
+	snapshot_interval = interval;
+
+	if (!persistent)
+		return false;
+
+	store_tdb = tdb_open_ex(tdbname, 0, 0, O_RDWR, 0, logger, NULL);
+	if (store_tdb) {
+		/* Contents are on disk already, nothing is dirty. */
+		tdb_traverse(store_tdb, &store_load_, NULL);
+		store_persistent = true;
+		return true;
+	}
+
+	store_tdb = tdb_open_ex(tdbname, 7919, 0, O_RDWR|O_CREAT, 0640,
+				logger, NULL);
+	if (!store_tdb)
+		barf_perror("Could not create tdb file %s", tdbname);
+	store_persistent = true;
+
+	return false;
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
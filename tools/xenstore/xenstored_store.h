@@ -0,0 +1,67 @@
+/*
+    Node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _XENSTORED_STORE_H
+#define _XENSTORED_STORE_H
+
+#include "xenstored_core.h"
+
+/* Default interval in seconds between snapshots of the store to disk. */
+#define STORE_SNAPSHOT_INTERVAL 5
+
+/*
+ * Set up the store.  If persistent, the contents of tdbname are loaded and
+ * changed nodes are written back there every interval seconds.  Returns
+ * true if nodes were loaded.
+ */
+bool store_init(const char *tdbname, bool persistent, unsigned int interval,
+		tdb_log_func logger);
+
+/* Get a copy of a node record allocated with ctx.  Sets errno on failure. */
+bool store_fetch(const void *ctx, const char *name, TDB_DATA *data);
+
+/* Generation count of a node, NO_GENERATION if it doesn't exist. */
+uint64_t store_generation(const char *name);
+
+/* Allocate the generation count for a node being written. */
+uint64_t store_next_generation(void);
+
+/* Write a node record: the store takes over data.dptr. */
+bool store_write(const char *name, TDB_DATA data);
+
+/*
+ * Make sure a later store_write() of name can't fail, by adding an entry
+ * without data for it.  Such entries are invisible to all readers.
+ */
+bool store_reserve(const char *name);
+
+/* Remove the entry for name again if it was reserved but not written. */
+void store_unreserve(const char *name);
+
+/* Delete a node record.  Returns false if there was none. */
+bool store_delete(const char *name);
+
+/* Call fn for all nodes: fn may delete the node it is passed. */
+void store_traverse(void (*fn)(const char *name, void *priv), void *priv);
+
+/* Milliseconds until the next snapshot is due, -1 if none is pending. */
+int store_snapshot_timeout(void);
+
+/* Write a snapshot to disk if one is due. */
+void store_snapshot_check(void);
+
+#endif /* _XENSTORED_STORE_H */
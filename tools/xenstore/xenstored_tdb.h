@@ -0,0 +1,36 @@
+/*
+    Node record format of the Xen Store Daemon database.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _XENSTORED_TDB_H
+#define _XENSTORED_TDB_H
+
+#include <stdint.h>
+#include "xenstore_lib.h"
+
+/*
+ * Header of the node record in tdb.  Only xenstored and xs_tdb_dump know
+ * this format, it is not part of the libxenstore interface.
+ */
+struct xs_tdb_record_hdr {
+	uint64_t generation;
+	uint32_t num_perms;
+	uint32_t datalen;
+	uint32_t childlen;
+	struct xs_permissions perms[0];
+};
+
+#endif /* _XENSTORED_TDB_H */
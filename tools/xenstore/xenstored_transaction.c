@@ -32,7 +32,9 @@
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
 #include "xenstore_lib.h"
+#include "hashtable.h"
 #include "utils.h"
 
 struct changed_node
@@ -47,6 +49,38 @@ struct changed_node
 	bool recurse;
 };
 
+/*
+ * A node accessed by a transaction.  The generation count of the node in
+ * the main database is recorded on first access: when committing, any node
+ * whose generation count changed in between makes the transaction fail.
+ * Only nodes written or deleted by the transaction carry a private copy,
+ * everything else is read from the main database.  On commit the modified
+ * records are copied to the main database.
+ *
+ * So reads don't see a snapshot taken when the transaction started, but
+ * the current contents of the main database: a transaction may see one
+ * node before and another after a concurrent change.  Every node it read
+ * is recorded though, and any such change makes the commit fail, so a
+ * transaction which commits successfully saw a consistent state.
+ */
+struct trans_node
+{
+	/* List of all nodes accessed by this transaction, in order. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *name;
+
+	/* Generation count on first access, NO_GENERATION if not existing. */
+	uint64_t generation;
+
+	/* Was the node written or deleted in this transaction? */
+	bool modified;
+
+	/* Node record as stored in the tdb, dptr is NULL if deleted. */
+	TDB_DATA data;
+};
+
 struct changed_domain
 {
 	/* List of all changed domains in the context of this transaction. */
@@ -67,12 +101,9 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
-	unsigned int generation;
-
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* Nodes accessed by this transaction, indexed by name. */
+	struct hashtable *nodes;
+	struct list_head node_list;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -82,12 +113,183 @@ struct transaction
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+/* Statistics, see transaction_stats(). */
+static unsigned int stat_started, stat_committed, stat_aborted;
+static unsigned int stat_conflicts;
+
+/*
+ * Look up the private copy of a node.  Returns false if the transaction
+ * didn't modify the node, so the caller should use the main database.
+ * Otherwise data is set to a copy allocated with ctx, or to a NULL dptr
+ * with errno set if the node was deleted in this transaction.
+ */
+bool transaction_fetch(struct transaction *trans, const void *ctx,
+		       const char *name, TDB_DATA *data)
+{
+	struct trans_node *tn = hashtable_search(trans->nodes, (void *)name);
+
+	if (!tn || !tn->modified)
+		return false;
+
+	data->dsize = tn->data.dsize;
+	if (!tn->data.dptr) {
+		data->dptr = NULL;
+		errno = ENOENT;
+	} else {
+		data->dptr = talloc_memdup(ctx, tn->data.dptr, tn->data.dsize);
+		if (!data->dptr)
+			errno = ENOMEM;
+	}
+
+	return true;
+}
+
+/*
+ * Nodes are always read before being written, so a node not yet known
+ * here is assumed to be absent from the main database.  Should that be
+ * wrong the commit fails with EAGAIN, which is safe.
+ */
+static struct trans_node *get_trans_node(struct transaction *trans,
+					 const char *name)
+{
+	struct trans_node *tn;
+	char *key;
+
+	tn = hashtable_search(trans->nodes, (void *)name);
+	if (tn)
+		return tn;
+
+	tn = talloc_zero(trans, struct trans_node);
+	if (!tn)
+		return NULL;
+	tn->generation = NO_GENERATION;
+	tn->name = talloc_strdup(tn, name);
+	key = strdup(name);
+	if (!tn->name || !key || !hashtable_insert(trans->nodes, key, tn)) {
+		free(key);
+		talloc_free(tn);
+		return NULL;
+	}
+	list_add_tail(&tn->list, &trans->node_list);
+
+	return tn;
+}
+
+/* Record the generation count of a node read from the main database. */
+bool transaction_note_read(struct transaction *trans, const char *name,
+			   uint64_t gen)
+{
+	struct trans_node *tn;
+
+	if (hashtable_search(trans->nodes, (void *)name))
+		return true;
+
+	tn = get_trans_node(trans, name);
+	if (!tn) {
+		errno = ENOMEM;
+		return false;
+	}
+	tn->generation = gen;
+
+	return true;
+}
+
+/* Record a node write: the transaction takes over data.dptr. */
+bool transaction_store(struct transaction *trans, const char *name,
+		       TDB_DATA data)
+{
+	struct trans_node *tn = get_trans_node(trans, name);
+
+	if (!tn) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	talloc_free(tn->data.dptr);
+	tn->modified = true;
+	tn->data.dptr = talloc_steal(tn, data.dptr);
+	tn->data.dsize = data.dsize;
+
+	return true;
+}
+
+/* Record a node deletion. */
+bool transaction_delete(struct transaction *trans, const char *name)
+{
+	struct trans_node *tn = get_trans_node(trans, name);
+
+	if (!tn) {
+		errno = ENOMEM;
+		return false;
+	}
+
+	talloc_free(tn->data.dptr);
+	tn->modified = true;
+	tn->data.dptr = NULL;
+	tn->data.dsize = 0;
+
+	return true;
+}
+
+/* Has any node accessed by the transaction been modified meanwhile? */
+static bool transaction_conflict(struct transaction *trans)
 {
-	return trans->tdb;
+	struct trans_node *tn;
+
+	list_for_each_entry(tn, &trans->node_list, list) {
+		if (store_generation(tn->name) != tn->generation) {
+			trace("TRANSACTION %p conflict on %s\n",
+			      trans, tn->name);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Copy all nodes modified by the transaction to the main database.  All
+ * store entries needed are allocated first, so either the complete
+ * transaction is applied or, on failure, nothing is.
+ */
+static bool transaction_commit(struct transaction *trans)
+{
+	struct trans_node *tn, *undo;
+	struct xs_tdb_record_hdr *hdr;
+	int saved_errno;
+
+	list_for_each_entry(tn, &trans->node_list, list) {
+		if (tn->modified && tn->data.dptr && !store_reserve(tn->name))
+			goto fail;
+	}
+
+	/* Nothing from here on can fail. */
+	list_for_each_entry(tn, &trans->node_list, list) {
+		if (!tn->modified)
+			continue;
+
+		if (tn->data.dptr) {
+			hdr = (void *)tn->data.dptr;
+			hdr->generation = store_next_generation();
+			/* The store takes over the record. */
+			store_write(tn->name, tn->data);
+		} else
+			store_delete(tn->name);
+	}
+
+	return true;
+
+ fail:
+	saved_errno = errno;
+	list_for_each_entry(undo, &trans->node_list, list) {
+		if (undo == tn)
+			break;
+		store_unreserve(undo->name);
+	}
+	errno = saved_errno;
+
+	return false;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -96,11 +298,9 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	/* Changes to the global database are tracked via node generations. */
+	if (!trans)
 		return;
-	}
 
 	list_for_each_entry(i, &trans->changes, list)
 		if (streq(i->node, node))
@@ -117,9 +317,7 @@ static int destroy_transaction(void *_transaction)
 	struct transaction *trans = _transaction;
 
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
+	hashtable_destroy(trans->nodes, 0);
 	return 0;
 }
 
@@ -155,18 +353,18 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 
 	/* Attach transaction to input for autofree until it's complete */
 	trans = talloc(in, struct transaction);
+	if (!trans) {
+		send_error(conn, ENOMEM);
+		return;
+	}
 	INIT_LIST_HEAD(&trans->changes);
 	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	INIT_LIST_HEAD(&trans->node_list);
+	trans->nodes = create_hashtable(16, hash_from_key_fn, keys_equal_fn);
+	if (!trans->nodes) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -179,6 +377,7 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	talloc_steal(conn, trans);
 	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
+	stat_started++;
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
 	send_reply(conn, XS_TRANSACTION_START, id_str, strlen(id_str)+1);
@@ -209,17 +408,15 @@ void do_transaction_end(struct connection *conn, struct buffered_data *in)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
+		if (transaction_conflict(trans)) {
+			stat_conflicts++;
 			send_error(conn, EAGAIN);
 			return;
 		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
+		if (!transaction_commit(trans)) {
 			send_error(conn, errno);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -228,8 +425,9 @@ void do_transaction_end(struct connection *conn, struct buffered_data *in)
 		/* Fire off the watches for everything that changed. */
 		list_for_each_entry(i, &trans->changes, list)
 			fire_watches(conn, in, i->node, i->recurse);
-		generation++;
-	}
+		stat_committed++;
+	} else
+		stat_aborted++;
 	send_ack(conn, XS_TRANSACTION_END);
 }
 
@@ -265,6 +463,16 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid)
 	list_add_tail(&d->list, &trans->changed_domains);
 }
 
+/* Report transaction statistics, allocated with ctx. */
+char *transaction_stats(const void *ctx)
+{
+	return talloc_asprintf(ctx,
+			       "started %u committed %u aborted %u "
+			       "conflicts %u\n",
+			       stat_started, stat_committed, stat_aborted,
+			       stat_conflicts);
+}
+
 void conn_delete_all_transactions(struct connection *conn)
 {
 	struct transaction *trans;
@@ -34,9 +34,18 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/* Access the nodes modified in the transaction. */
+bool transaction_fetch(struct transaction *trans, const void *ctx,
+		       const char *name, TDB_DATA *data);
+bool transaction_note_read(struct transaction *trans, const char *name,
+			   uint64_t gen);
+bool transaction_store(struct transaction *trans, const char *name,
+		       TDB_DATA data);
+bool transaction_delete(struct transaction *trans, const char *name);
 
 void conn_delete_all_transactions(struct connection *conn);
 
+/* Report transaction statistics. */
+char *transaction_stats(const void *ctx);
+
 #endif /* _XENSTORED_TRANSACTION_H */
@@ -27,35 +27,145 @@
 #include "list.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
+#include "hashtable.h"
 #include "utils.h"
 #include "xenstored_domain.h"
 
 extern int quota_nb_watch_per_domain;
 
+/*
+ * All watches are kept in a trie of watched paths, so finding the watches
+ * affected by a change only needs to look at the path and its parents (and
+ * the children in case of a recursive change), independent of the total
+ * number of watches.  Each path in the trie is indexed by a hashtable, too.
+ * Special (@...) watches have their own trie nodes without any parent.
+ */
+struct watch_node
+{
+	/* Siblings in the trie. */
+	struct list_head list;
+
+	/* Trie nodes of direct children of this path. */
+	struct list_head children;
+
+	/* Parent in the trie (NULL for "/" and special watches). */
+	struct watch_node *parent;
+
+	/* The watched path, key in watch_nodes. */
+	char *path;
+
+	/* Watches on exactly this path. */
+	struct list_head watches;
+};
+
+static struct hashtable *watch_nodes;
+
 struct watch
 {
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path */
+	struct list_head node_list;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
 	/* Is this relative to connnection's implicit path? */
 	const char *relative_path;
 
+	/* Connection owning this watch and its node in the watch trie. */
+	struct connection *conn;
+	struct watch_node *wnode;
+
 	char *token;
 	char *node;
 };
 
+static struct watch_node *find_watch_node(const char *path)
+{
+	if (!watch_nodes)
+		return NULL;
+	return hashtable_search(watch_nodes, (void *)path);
+}
+
+/* Find or create the trie node of a path, including all its parents. */
+static struct watch_node *get_watch_node(const char *path)
+{
+	struct watch_node *wnode, *parent = NULL;
+	char *key, *slash;
+
+	wnode = find_watch_node(path);
+	if (wnode)
+		return wnode;
+
+	if (!watch_nodes) {
+		watch_nodes = create_hashtable(16, hash_from_key_fn,
+					       keys_equal_fn);
+		if (!watch_nodes)
+			return NULL;
+	}
+
+	if (path[0] == '/' && path[1]) {
+		char *pname;
+
+		slash = strrchr(path, '/');
+		if (slash == path)
+			pname = talloc_strdup(NULL, "/");
+		else
+			pname = talloc_strndup(NULL, path, slash - path);
+		if (!pname)
+			return NULL;
+		parent = get_watch_node(pname);
+		talloc_free(pname);
+		if (!parent)
+			return NULL;
+	}
+
+	wnode = talloc_zero(talloc_autofree_context(), struct watch_node);
+	if (!wnode)
+		return NULL;
+	wnode->path = talloc_strdup(wnode, path);
+	key = strdup(path);
+	if (!wnode->path || !key || !hashtable_insert(watch_nodes, key, wnode)) {
+		free(key);
+		talloc_free(wnode);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&wnode->children);
+	INIT_LIST_HEAD(&wnode->watches);
+	wnode->parent = parent;
+	if (parent)
+		list_add_tail(&wnode->list, &parent->children);
+	else
+		INIT_LIST_HEAD(&wnode->list);
+
+	return wnode;
+}
+
+/* Remove unused trie nodes, starting at wnode and going up. */
+static void put_watch_node(struct watch_node *wnode)
+{
+	struct watch_node *parent;
+
+	while (wnode && list_empty(&wnode->watches) &&
+	       list_empty(&wnode->children)) {
+		parent = wnode->parent;
+		list_del(&wnode->list);
+		hashtable_remove(watch_nodes, wnode->path);
+		talloc_free(wnode);
+		wnode = parent;
+	}
+}
+
 /*
  * Send a watch event.
  * Temporary memory allocations are done with ctx.
  */
-static void add_event(struct connection *conn,
-		      void *ctx,
-		      struct watch *watch,
-		      const char *name)
+static void add_event(void *ctx, struct watch *watch, const char *name)
 {
+	struct connection *conn = watch->conn;
 	/* Data to send (node\0token\0). */
 	unsigned int len;
 	char *data;
@@ -90,6 +200,26 @@ static void add_event(struct connection *conn,
 	talloc_free(data);
 }
 
+static void fire_node_watches(void *ctx, struct watch_node *wnode,
+			      const char *name)
+{
+	struct watch *watch;
+
+	list_for_each_entry(watch, &wnode->watches, node_list)
+		add_event(ctx, watch, name);
+}
+
+/* Fire all watches below wnode, each for its own path. */
+static void fire_children_watches(void *ctx, struct watch_node *wnode)
+{
+	struct watch_node *child;
+
+	list_for_each_entry(child, &wnode->children, list) {
+		fire_node_watches(ctx, child, child->path);
+		fire_children_watches(ctx, child);
+	}
+}
+
 /*
  * Check whether any watch events are to be sent.
  * Temporary memory allocations are done with ctx.
@@ -97,26 +227,58 @@ static void add_event(struct connection *conn,
 void fire_watches(struct connection *conn, void *ctx, const char *name,
 		  bool recurse)
 {
-	struct connection *i;
-	struct watch *watch;
+	struct watch_node *root, *wnode = NULL;
+	char *path, *p, c;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, ctx, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, ctx, watch, watch->node);
+	/* A watch on / matches everything, including special nodes. */
+	root = find_watch_node("/");
+	if (root)
+		fire_node_watches(ctx, root, name);
+
+	if (name[0] != '/') {
+		wnode = find_watch_node(name);
+		if (wnode)
+			fire_node_watches(ctx, wnode, name);
+		return;
+	}
+
+	if (!name[1]) {
+		wnode = root;
+	} else if (root) {
+		/* Walk down the trie along name, as long as there are nodes. */
+		path = talloc_strdup(ctx, name);
+		if (!path)
+			return;
+		for (p = path + 1; ; p++) {
+			if (*p != '/' && *p)
+				continue;
+			c = *p;
+			*p = '\0';
+			wnode = find_watch_node(path);
+			*p = c;
+			if (!wnode)
+				break;
+			fire_node_watches(ctx, wnode, name);
+			if (!c)
+				break;
 		}
+		talloc_free(path);
 	}
+
+	if (recurse && wnode)
+		fire_children_watches(ctx, wnode);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+
+	list_del(&watch->node_list);
+	put_watch_node(watch->wnode);
 	trace_destroy(_watch, "watch");
 	return 0;
 }
@@ -170,16 +332,25 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 	else
 		watch->relative_path = NULL;
 
+	watch->wnode = get_watch_node(watch->node);
+	if (!watch->wnode) {
+		talloc_free(watch);
+		send_error(conn, ENOMEM);
+		return;
+	}
+	watch->conn = conn;
+
 	INIT_LIST_HEAD(&watch->events);
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->node_list, &watch->wnode->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
 
 	/* We fire once up front: simplifies clients and restart. */
-	add_event(conn, in, watch, watch->node);
+	add_event(in, watch, watch->node);
 }
 
 void do_unwatch(struct connection *conn, struct buffered_data *in)
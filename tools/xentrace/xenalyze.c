@@ -28,6 +28,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
+#include <time.h>
 #include <xen/trace.h>
 #include "analyze.h"
 #include "mread.h"
@@ -47,6 +49,9 @@ struct mread_ctrl;
 #define DEFAULT_SAMPLE_SIZE 1024
 #define DEFAULT_SAMPLE_MAX  1024*1024*32
 #define DEFAULT_INTERVAL_LENGTH 1000
+/* Sample limit when summaries are printed per window, to bound memory */
+#define DEFAULT_WINDOW_SAMPLE_MAX  1024*64
+#define FOLLOW_POLL_MS 100
 
 struct array_struct {
     unsigned long long *values;
@@ -77,6 +82,11 @@ struct {
         FILE* out;
         int pid;
     } progress;
+    struct {
+        /* Spooler copying a piped trace into fd, 0 once it exited */
+        pid_t spool_pid;
+        volatile sig_atomic_t stop;
+    } follow;
 } G = {
     .fd=-1,
     .symbols = NULL,
@@ -179,6 +189,7 @@ struct {
         summary:1,
         report_pcpu:1,
         tsc_loop_fatal:1,
+        follow:1,
         summary_info;
     long long cpu_qhz, cpu_hz;
     int scatterplot_interrupt_vector;
@@ -221,6 +232,10 @@ struct {
         };
         int count;
     } interval;
+    struct {
+        tsc_t cycles;
+        unsigned msec;
+    } summary_interval;
 } opt = {
     .scatterplot_interrupt_eip=0,
     .scatterplot_unpin_promote=0,
@@ -252,6 +267,7 @@ struct {
     .summary = 0,
     .report_pcpu = 0,
     .tsc_loop_fatal = 0,
+    .follow = 0,
     .cpu_hz = DEFAULT_CPU_HZ,
     /* Pre-calculate a multiplier that makes the rest of the
      * calculations easier */
@@ -278,6 +294,7 @@ struct interval_element {
 
 struct cycle_summary {
     int event_count, count, sample_size;
+    int epoch; /* Summary window the counts belong to */
     unsigned long long cycles;
     long long *sample;
     struct interval_element interval;
@@ -1892,6 +1909,12 @@ struct {
             } domain;
         };
     } interval;
+
+    /* Current window for --summary-interval */
+    struct {
+        tsc_t start_tsc;
+        int epoch;
+    } window;
 } P = { 0 };
 
 /* Function prototypes */
@@ -1900,6 +1923,8 @@ void pcpu_string_draw(struct pcpu_info *p);
 void process_generic(struct record_info *ri);
 void dump_generic(FILE *f, struct record_info *ri);
 ssize_t __read_record(struct trace_record *rec, off_t offset);
+off_t follow_file_size(off_t size);
+void window_summary(tsc_t end_tsc);
 void error(enum error_level l, struct record_info *ri);
 void update_io_address(struct io_address ** list, unsigned int pa, int dir,
                        tsc_t arc_cycles, unsigned int va);
@@ -2204,7 +2229,24 @@ static inline double summary_percent_global(struct cycle_summary *s) {
     return __summary_percent(s, &P.f);
 }
 
+/*
+ * With --summary-interval, each summary only covers the current window.
+ * Rather than walking every summary at the end of a window, counts left
+ * over from an earlier window are dropped the next time the summary is
+ * updated or printed.  The sample buffer is kept for reuse.
+ */
+static inline void cycle_summary_sync(struct cycle_summary *s) {
+    if ( s->epoch != P.window.epoch ) {
+        s->event_count = 0;
+        s->count = 0;
+        s->cycles = 0;
+        s->epoch = P.window.epoch;
+    }
+}
+
 static inline void update_cycles(struct cycle_summary *s, long long c) {
+    cycle_summary_sync(s);
+
     s->event_count++;
 
     if (!c)
@@ -2263,6 +2305,8 @@ static inline void clear_interval_cycles(struct interval_element *e) {
 }
 
 static inline void print_cpu_affinity(struct cycle_summary *s, char *p) {
+    cycle_summary_sync(s);
+
     if(s->count) {
         long long avg;
 
@@ -2289,6 +2333,8 @@ static inline void print_cpu_affinity(struct cycle_summary *s, char *p) {
 
 static inline void print_cycle_percent_summary(struct cycle_summary *s,
                                                tsc_t total, char *p) {
+    cycle_summary_sync(s);
+
     if(s->count) {
         long long avg;
         double percent, seconds;
@@ -2326,6 +2372,8 @@ static inline void print_cycle_percent_summary(struct cycle_summary *s,
 }
 
 static inline void print_cycle_summary(struct cycle_summary *s, char *p) {
+    cycle_summary_sync(s);
+
     if(s->count) {
         long long avg;
 
@@ -2354,6 +2402,7 @@ static inline void print_cycle_summary(struct cycle_summary *s, char *p) {
 
 #define PRINT_SUMMARY(_s, _p...)                                        \
     do {                                                                \
+        cycle_summary_sync(&(_s));                                      \
         if((_s).event_count) {                                          \
             if ( opt.sample_size ) {                                    \
                 unsigned long long p5, p50, p95;                        \
@@ -7370,6 +7419,9 @@ void sched_summary_vcpu(struct vcpu_data *v)
     {
         update_cycles(&v->cpu_affinity_all, P.f.last_tsc - v->pcpu_tsc);
         update_cycles(&v->cpu_affinity_pcpu[v->p->pid], P.f.last_tsc - v->pcpu_tsc);
+        /* Don't count this stretch again in the next window */
+        if ( opt.summary_interval.cycles )
+            v->pcpu_tsc = P.f.last_tsc;
     }
 
     printf(" Runstates:\n");
@@ -7864,6 +7916,22 @@ void sched_process(struct pcpu_info *p)
                        r->runtime / 1000, r->runtime % 1000);
             }
             break;
+        case TRC_SCHED_CLASS_EVT(CSCHED2, 23): /* MIGRATE_COST     */
+            if (opt.dump_all) {
+                struct {
+                    unsigned vcpuid:16, domid:16;
+                    unsigned rqi:16, trqi:16;
+                    unsigned hotness:16, cross_llc:16;
+                    unsigned load_delta, cost;
+                } *r = (typeof(r))ri->d;
+
+                printf(" %s csched2:migrate_cost d%uv%u rq# %u --> rq# %u, "
+                       "%s, hotness = %u/1024, cost = %u, delta = %u\n",
+                       ri->dump_header, r->domid, r->vcpuid, r->rqi, r->trqi,
+                       r->cross_llc ? "cross LLC" : "same LLC",
+                       r->hotness, r->cost, r->load_delta);
+            }
+            break;
         /* RTDS (TRC_RTDS_xxx) */
         case TRC_SCHED_CLASS_EVT(RTDS, 1): /* TICKLE           */
             if(opt.dump_all) {
@@ -9008,6 +9076,7 @@ void process_record_tsc(tsc_t order_tsc, struct record_info *ri)
 
         if(P.f.first_tsc == 0) {
             P.f.first_tsc = tsc;
+            P.window.start_tsc = tsc;
             if ( opt.interval_mode ) {
                 P.interval.start_tsc = tsc;
             }
@@ -9024,11 +9093,27 @@ void process_record_tsc(tsc_t order_tsc, struct record_info *ri)
                     }
                 }
             }
+            if ( opt.summary_interval.cycles ) {
+                if ( P.window.start_tsc > tsc ) {
+                    fprintf(warn, "WARNING: order_tsc %lld < window.start_tsc %lld!\n",
+                            tsc, P.window.start_tsc);
+                } else {
+                    while ( tsc - P.window.start_tsc
+                            > opt.summary_interval.cycles ) {
+                        P.window.start_tsc += opt.summary_interval.cycles;
+                        P.f.last_tsc = P.window.start_tsc;
+                        P.f.total_cycles = opt.summary_interval.cycles;
+                        window_summary(P.window.start_tsc);
+                    }
+                }
+            }
         }
 
         P.f.last_tsc=tsc;
 
-        P.f.total_cycles = P.f.last_tsc - P.f.first_tsc;
+        /* Without --summary-interval, the window is the whole trace */
+        if ( P.f.last_tsc >= P.window.start_tsc )
+            P.f.total_cycles = P.f.last_tsc - P.window.start_tsc;
 
         P.now = tsc;
     }
@@ -9168,7 +9253,7 @@ void process_cpu_change(struct pcpu_info *p) {
         p->file_offset += ri->size + r->window_size;
         p->next_cpu_change_offset = p->file_offset;
 
-        if(p->file_offset > G.file_size) {
+        if(p->file_offset > follow_file_size(p->file_offset)) {
             activate_early_eof();
         } else if(P.early_eof && p->file_offset > P.last_epoch_offset) {
             fprintf(warn, "%s: early_eof activated, pcpu %d past last_epoch_offset %llx, deactivating.\n",
@@ -9229,9 +9314,13 @@ void process_cpu_change(struct pcpu_info *p) {
         p->file_offset += ri->size;
         p->next_cpu_change_offset = p->file_offset + r->window_size;
 
-        if(p->next_cpu_change_offset > G.file_size)
+        if(p->next_cpu_change_offset
+           > follow_file_size(p->next_cpu_change_offset))
             activate_early_eof();
-        else if(p->pid == P.max_active_pcpu)
+        /* When following, don't wait for the next window just to look
+         * ahead; new pcpus will be found when we get there. */
+        else if(p->pid == P.max_active_pcpu
+                && (!opt.follow || p->next_cpu_change_offset < G.file_size))
             scan_for_new_pcpu(p->next_cpu_change_offset);
 
     }
@@ -9460,10 +9549,108 @@ void progress_finish(void) {
     }
 }
 
+/*
+ * With --follow, the trace is still being written: wait for the file to
+ * grow to at least size bytes.  Returns the file size, which is only
+ * short of size once the writer went away or we were interrupted.
+ */
+off_t follow_file_size(off_t size)
+{
+    struct timespec poll = { .tv_nsec = FOLLOW_POLL_MS * 1000000L };
+    struct stat s;
+
+    while ( opt.follow && G.file_size < size ) {
+        if ( fstat(G.fd, &s) < 0 ) {
+            perror("fstat");
+            error(ERR_SYSTEM, NULL);
+        }
+
+        if ( s.st_size > G.file_size ) {
+            G.file_size = G.mh->file_size = s.st_size;
+            continue;
+        }
+
+        if ( G.follow.stop )
+            break;
+
+        /* The pipe was closed: pick up the last writes, then stop. */
+        if ( G.follow.spool_pid
+             && waitpid(G.follow.spool_pid, NULL, WNOHANG)
+                == G.follow.spool_pid ) {
+            G.follow.spool_pid = 0;
+            G.follow.stop = 1;
+            continue;
+        }
+
+        nanosleep(&poll, NULL);
+    }
+
+    return G.file_size;
+}
+
+void follow_sigint(int sig)
+{
+    G.follow.stop = 1;
+}
+
+void follow_init(void)
+{
+    struct sigaction sa = {
+        .sa_handler = follow_sigint,
+        /* A second ^C gets the default action */
+        .sa_flags = SA_RESETHAND,
+    };
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+
+    fprintf(warn, "Following %s, ^C to stop and print the summary\n",
+            G.trace_file);
+}
+
+/*
+ * Pipes can't be mapped, so copy the trace from a child into an unlinked
+ * temporary file and follow that.  Returns the fd of the copy.
+ */
+int follow_spool(int in)
+{
+    char name[] = "/tmp/xenalyze.XXXXXX";
+    char buf[65536];
+    ssize_t r, w, done;
+    pid_t pid;
+    int fd;
+
+    if ( (fd = mkstemp(name)) < 0 ) {
+        perror("mkstemp");
+        error(ERR_SYSTEM, NULL);
+    }
+    unlink(name);
+
+    if ( (pid = fork()) < 0 ) {
+        perror("fork");
+        error(ERR_SYSTEM, NULL);
+    }
+
+    if ( pid == 0 ) {
+        while ( (r = read(in, buf, sizeof(buf))) > 0 )
+            for ( done = 0; done < r; done += w )
+                if ( (w = write(fd, buf + done, r - done)) < 0 )
+                    _exit(1);
+        _exit(r < 0);
+    }
+
+    close(in);
+    G.follow.spool_pid = pid;
+
+    return fd;
+}
+
 ssize_t __read_record(struct trace_record *rec, off_t offset)
 {
     ssize_t r, rsize;
 
+    follow_file_size(offset + sizeof(uint32_t));
+
     r=mread64(G.mh, rec, sizeof(*rec), offset);
 
     if(r < 0) {
@@ -9483,6 +9670,9 @@ ssize_t __read_record(struct trace_record *rec, off_t offset)
 
     rsize=get_rec_size(rec);
 
+    if(r < rsize && follow_file_size(offset + rsize) >= offset + rsize)
+        r=mread64(G.mh, rec, rsize, offset);
+
     if(r < rsize) {
         /* Full record not read */
         fprintf(stderr, "%s: short read (%zd, expected %zd)\n",
@@ -9837,6 +10027,17 @@ void summary(void) {
     domain_summary();
 }
 
+void window_summary(tsc_t end_tsc) {
+    struct time_struct t;
+
+    cycles_to_time(end_tsc, &t);
+    printf("=== Summary of window ending at %u.%09u ===\n", t.s, t.ns);
+    summary();
+    fflush(stdout);
+
+    P.window.epoch++;
+}
+
 void report_pcpu(void) {
     int i, active=0;
 
@@ -9927,6 +10128,7 @@ enum {
     OPT_MMIO_ENUMERATION_SKIP_VGA,
     OPT_SAMPLE_SIZE,
     OPT_SAMPLE_MAX,
+    OPT_SUMMARY_INTERVAL,
     OPT_REPORT_PCPU,
     /* Guest info */
     OPT_DEFAULT_GUEST_PAGING_LEVELS,
@@ -9938,6 +10140,7 @@ enum {
     OPT_PROGRESS,
     OPT_TOLERANCE,
     OPT_TSC_LOOP_FATAL,
+    OPT_FOLLOW,
     /* Specific letters */
     OPT_DUMP_ALL='a',
     OPT_INTERVAL_LENGTH='i',
@@ -10117,6 +10320,19 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
             argp_usage(state);
         break;
     }
+    case OPT_SUMMARY_INTERVAL:
+    {
+        char * inval;
+
+        opt.summary_interval.msec = (unsigned) (strtof(arg, &inval) * 1000);
+
+        if ( inval == arg || !opt.summary_interval.msec )
+            argp_usage(state);
+
+        opt.summary = 1;
+        G.output_defined = 1;
+        break;
+    }
     case OPT_MMIO_ENUMERATION_SKIP_VGA:
     {
         char * inval;
@@ -10418,6 +10634,10 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.tsc_loop_fatal = 1;
         break;
 
+    case OPT_FOLLOW:
+        opt.follow = 1;
+        break;
+
     case ARGP_KEY_ARG:
     {
         /* FIXME - strcpy */
@@ -10434,6 +10654,14 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
             interval_header();
         }
 
+        if(opt.summary_interval.msec) {
+            opt.summary_interval.cycles =
+                ( opt.summary_interval.msec * opt.cpu_hz ) / 1000;
+            /* Unless asked otherwise, keep the per-window samples small */
+            if(opt.sample_max == DEFAULT_SAMPLE_MAX)
+                opt.sample_max = DEFAULT_WINDOW_SAMPLE_MAX;
+        }
+
         if(!G.output_defined)
         {
             fprintf(stderr, "No output defined, using summary.\n");
@@ -10664,6 +10892,14 @@ const struct argp_option cmd_opts[] =  {
       .doc = "Do not allow sample to grow beyond [size] samples for percentile"\
       " purposes.  Enter 0 for no limit.", },
 
+    { .name = "summary-interval",
+      .key = OPT_SUMMARY_INTERVAL,
+      .arg = "sec",
+      .group = OPT_GROUP_SUMMARY,
+      .doc = "Output a summary every [sec] seconds of trace time, covering"\
+      " only that window.  Log volume and enumerations stay cumulative."\
+      "  Implies --summary; sample-max defaults to 65536.", },
+
     { .name = "summary",
       .key = OPT_SUMMARY,
       .group = OPT_GROUP_SUMMARY,
@@ -10707,6 +10943,11 @@ const struct argp_option cmd_opts[] =  {
       .key = OPT_TSC_LOOP_FATAL,
       .doc = "Stop processing and exit if tsc skew tracking detects a dependency loop.", },
 
+    { .name = "follow",
+      .key = OPT_FOLLOW,
+      .doc = "Keep reading as the trace file grows, until ^C.  Implied when"\
+      " the trace is a pipe; use - to read from stdin.", },
+
     { .name = "tolerance",
       .key = OPT_TOLERANCE,
       .arg = "errlevel",
@@ -10735,13 +10976,29 @@ int main(int argc, char *argv[]) {
     if (G.trace_file == NULL)
         exit(1);
 
-    if ( (G.fd = open(G.trace_file, O_RDONLY)) < 0) {
+    if ( !strcmp(G.trace_file, "-") )
+        G.fd = dup(STDIN_FILENO);
+    else
+        G.fd = open(G.trace_file, O_RDONLY);
+
+    if ( G.fd < 0) {
         perror("open");
         error(ERR_SYSTEM, NULL);
     } else {
         struct stat s;
         fstat(G.fd, &s);
-        G.file_size = s.st_size;
+        if ( S_ISFIFO(s.st_mode) ) {
+            opt.follow = 1;
+            G.fd = follow_spool(G.fd);
+            G.file_size = 0;
+        } else
+            G.file_size = s.st_size;
+    }
+
+    if ( opt.follow ) {
+        /* There's no end to measure progress against */
+        opt.progress = 0;
+        follow_init();
     }
 
     if ( (G.mh = mread_init(G.fd)) == NULL )
@@ -10763,7 +11020,9 @@ int main(int argc, char *argv[]) {
     if(opt.interval_mode)
         interval_tail();
 
-    if(opt.summary)
+    if(opt.summary_interval.cycles)
+        window_summary(P.f.last_tsc);
+    else if(opt.summary)
         summary();
 
     if(opt.report_pcpu)
@@ -10772,6 +11031,9 @@ int main(int argc, char *argv[]) {
     if(opt.progress)
         progress_finish();
 
+    if(G.follow.spool_pid)
+        kill(G.follow.spool_pid, SIGTERM);
+
     return 0;
 }
 /*
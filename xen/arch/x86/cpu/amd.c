@@ -522,6 +522,27 @@ static void early_init_amd(struct cpuinfo_x86 *c)
 	amd_ctxt_switch_levelling(NULL);
 }
 
+/* Find out which cpus share our last level cache, if the CPU tells. */
+static void amd_get_llc_id(struct cpuinfo_x86 *c)
+{
+	u32 eax, ebx, ecx, edx, sharing = 0;
+	unsigned int i;
+
+	if (!cpu_has(c, X86_FEATURE_TOPOEXT))
+		return;
+
+	/* Cache properties leaves come in increasing cache level order. */
+	for (i = 0; i < 8; i++) {
+		cpuid_count(0x8000001d, i, &eax, &ebx, &ecx, &edx);
+		if (!(eax & 0x1f))
+			break;
+		sharing = ((eax >> 14) & 0xfff) + 1;
+	}
+
+	if (sharing)
+		c->cpu_llc_id = c->apicid >> get_count_order(sharing);
+}
+
 static void init_amd(struct cpuinfo_x86 *c)
 {
 	u32 l, h;
@@ -611,6 +632,7 @@ static void init_amd(struct cpuinfo_x86 *c)
 		wrmsr_safe(MSR_AMD64_IC_CFG, value | 0x1e);
 
         amd_get_topology(c);
+	amd_get_llc_id(c);
 
 	/* Pointless to use MWAIT on Family10 as it does not deep sleep. */
 	if (c->x86 == 0x10)
@@ -347,6 +347,7 @@ void identify_cpu(struct cpuinfo_x86 *c)
 	c->phys_proc_id = XEN_INVALID_SOCKET_ID;
 	c->cpu_core_id = XEN_INVALID_CORE_ID;
 	c->compute_unit_id = INVALID_CUID;
+	c->cpu_llc_id = INVALID_LLC_ID;
 	memset(&c->x86_capability, 0, sizeof c->x86_capability);
 
 	generic_identify(c);
@@ -371,6 +372,10 @@ void identify_cpu(struct cpuinfo_x86 *c)
 	if (this_cpu->c_init)
 		this_cpu->c_init(c);
 
+	/* Without better information, assume one last level cache per socket. */
+	if (c->cpu_llc_id == INVALID_LLC_ID)
+		c->cpu_llc_id = c->phys_proc_id;
+
 
    	if ( !opt_pku )
 		setup_clear_cpu_cap(X86_FEATURE_PKU);
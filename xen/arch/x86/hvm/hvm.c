@@ -5185,6 +5185,10 @@ static int hvmop_set_param(
         }
         d->arch.x87_fip_width = a.value;
         break;
+    case HVM_PARAM_POD_LAZY:
+        if ( a.value > 1 )
+            rc = -EINVAL;
+        break;
     }
 
     if ( rc != 0 )
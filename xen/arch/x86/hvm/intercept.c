@@ -212,11 +212,36 @@ int hvm_process_io_intercept(const struct hvm_io_handler *handler,
 
 const struct hvm_io_handler *hvm_find_io_handler(ioreq_t *p)
 {
-    struct domain *curr_d = current->domain;
+    struct vcpu *curr = current;
+    struct domain *curr_d = curr->domain;
+    const struct hvm_io_handler **last =
+        &curr->arch.hvm_vcpu.hvm_io.io_handler[p->type];
     unsigned int i;
 
     BUG_ON((p->type != IOREQ_TYPE_PIO) &&
            (p->type != IOREQ_TYPE_COPY));
+    BUILD_BUG_ON((IOREQ_TYPE_PIO | IOREQ_TYPE_COPY) >=
+                 ARRAY_SIZE(curr->arch.hvm_vcpu.hvm_io.io_handler));
+
+    /*
+     * Accesses come in runs to the same device, so try the handler of the
+     * last access of this type first.  Only exclusive handlers are
+     * remembered, but handlers registered before it which aren't still
+     * take precedence.
+     */
+    if ( *last != NULL && (*last)->exclusive &&
+         (*last)->ops->accept(*last, p) )
+    {
+        const struct hvm_io_handler *handler;
+
+        for ( handler = curr_d->arch.hvm_domain.io_handler;
+              handler != *last; handler++ )
+            if ( handler->type == p->type && !handler->exclusive &&
+                 handler->ops->accept(handler, p) )
+                return handler;
+
+        return *last;
+    }
 
     for ( i = 0; i < curr_d->arch.hvm_domain.io_handler_count; i++ )
     {
@@ -228,7 +253,11 @@ const struct hvm_io_handler *hvm_find_io_handler(ioreq_t *p)
             continue;
 
         if ( ops->accept(handler, p) )
+        {
+            if ( handler->exclusive )
+                *last = handler;
             return handler;
+        }
     }
 
     return NULL;
@@ -282,6 +311,32 @@ void register_mmio_handler(struct domain *d,
     handler->mmio.ops = ops;
 }
 
+/*
+ * Port ranges of handlers are exclusive unless they overlap, like the
+ * catch-all range of PVH domains does.
+ */
+static void portio_update_exclusive(struct domain *d,
+                                    struct hvm_io_handler *handler)
+{
+    unsigned int i;
+
+    handler->exclusive = 1;
+
+    for ( i = 0; i < d->arch.hvm_domain.io_handler_count; i++ )
+    {
+        struct hvm_io_handler *other = &d->arch.hvm_domain.io_handler[i];
+
+        if ( other == handler || other->ops != &portio_ops )
+            continue;
+
+        if ( (other->portio.port <
+              handler->portio.port + handler->portio.size) &&
+             (handler->portio.port <
+              other->portio.port + other->portio.size) )
+            other->exclusive = handler->exclusive = 0;
+    }
+}
+
 void register_portio_handler(struct domain *d, unsigned int port,
                              unsigned int size, portio_action_t action)
 {
@@ -295,6 +350,7 @@ void register_portio_handler(struct domain *d, unsigned int port,
     handler->portio.port = port;
     handler->portio.size = size;
     handler->portio.action = action;
+    portio_update_exclusive(d, handler);
 }
 
 void relocate_portio_handler(struct domain *d, unsigned int old_port,
@@ -314,6 +370,7 @@ void relocate_portio_handler(struct domain *d, unsigned int old_port,
              (handler->portio.size = size) )
         {
             handler->portio.port = new_port;
+            portio_update_exclusive(d, handler);
             break;
         }
     }
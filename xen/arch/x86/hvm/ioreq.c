@@ -27,6 +27,8 @@
 #include <xen/domain.h>
 #include <xen/event.h>
 #include <xen/paging.h>
+#include <xen/rcupdate.h>
+#include <xen/sort.h>
 
 #include <asm/hvm/hvm.h>
 #include <asm/hvm/ioreq.h>
@@ -597,6 +599,184 @@ static void hvm_ioreq_server_disable(struct hvm_ioreq_server *s,
     spin_unlock(&s->lock);
 }
 
+/*
+ * Index of the ranges claimed by enabled non-default servers, sorted by
+ * start address.  Ranges of one server never overlap, but ranges of
+ * different servers may.  A type for which they do isn't indexed, and the
+ * servers are searched in order instead.
+ */
+struct hvm_ioreq_range {
+    uint64_t start, end;
+    struct hvm_ioreq_server *s;
+};
+
+struct hvm_ioreq_index {
+    struct rcu_head rcu;
+    struct hvm_ioreq_range *range[NR_IO_RANGE_TYPES];
+    int nr[NR_IO_RANGE_TYPES]; /* -1 if the type isn't indexed */
+    struct hvm_ioreq_range entries[];
+};
+
+static DEFINE_RCU_READ_LOCK(ioreq_index_rcu_lock);
+
+struct hvm_ioreq_index_fill {
+    struct hvm_ioreq_range *range;
+    struct hvm_ioreq_server *s;
+};
+
+static int hvm_ioreq_index_count(unsigned long start, unsigned long end,
+                                 void *arg)
+{
+    ++*(unsigned int *)arg;
+
+    return 0;
+}
+
+static int hvm_ioreq_index_fill(unsigned long start, unsigned long end,
+                                void *arg)
+{
+    struct hvm_ioreq_index_fill *fill = arg;
+
+    fill->range->start = start;
+    fill->range->end = end;
+    fill->range->s = fill->s;
+    fill->range++;
+
+    return 0;
+}
+
+static int cmp_ioreq_range(const void *a, const void *b)
+{
+    const struct hvm_ioreq_range *ra = a, *rb = b;
+
+    if ( ra->start < rb->start )
+        return -1;
+
+    return ra->start > rb->start;
+}
+
+static void swap_ioreq_range(void *a, void *b, int size)
+{
+    struct hvm_ioreq_range t = *(struct hvm_ioreq_range *)a;
+
+    *(struct hvm_ioreq_range *)a = *(struct hvm_ioreq_range *)b;
+    *(struct hvm_ioreq_range *)b = t;
+}
+
+static void hvm_free_ioreq_index(struct rcu_head *rcu)
+{
+    xfree(container_of(rcu, struct hvm_ioreq_index, rcu));
+}
+
+/*
+ * Rebuild the index after the servers or their ranges changed.  If this
+ * fails, no index is used until the next successful rebuild.
+ */
+static void hvm_update_ioreq_index(struct domain *d)
+{
+    struct hvm_ioreq_index *old = d->arch.hvm_domain.ioreq_server.index;
+    struct hvm_ioreq_index *index;
+    struct hvm_ioreq_index_fill fill;
+    struct hvm_ioreq_server *s;
+    unsigned int type, nr = 0;
+    int i;
+
+    ASSERT(spin_is_locked(&d->arch.hvm_domain.ioreq_server.lock));
+
+    list_for_each_entry ( s,
+                          &d->arch.hvm_domain.ioreq_server.list,
+                          list_entry )
+    {
+        if ( s == d->arch.hvm_domain.default_ioreq_server || !s->enabled )
+            continue;
+
+        for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+            rangeset_report_ranges(s->range[type], 0, ~0UL,
+                                   hvm_ioreq_index_count, &nr);
+    }
+
+    index = _xmalloc(offsetof(struct hvm_ioreq_index, entries[nr]),
+                     __alignof__(struct hvm_ioreq_index));
+    if ( index )
+    {
+        fill.range = index->entries;
+
+        for ( type = 0; type < NR_IO_RANGE_TYPES; type++ )
+        {
+            struct hvm_ioreq_range *range = fill.range;
+
+            list_for_each_entry ( s,
+                                  &d->arch.hvm_domain.ioreq_server.list,
+                                  list_entry )
+            {
+                if ( s == d->arch.hvm_domain.default_ioreq_server ||
+                     !s->enabled )
+                    continue;
+
+                fill.s = s;
+                rangeset_report_ranges(s->range[type], 0, ~0UL,
+                                       hvm_ioreq_index_fill, &fill);
+            }
+
+            index->range[type] = range;
+            index->nr[type] = fill.range - range;
+
+            sort(range, index->nr[type], sizeof(*range), cmp_ioreq_range,
+                 swap_ioreq_range);
+
+            for ( i = 1; i < index->nr[type]; i++ )
+                if ( range[i].start <= range[i - 1].end )
+                {
+                    index->nr[type] = -1;
+                    break;
+                }
+        }
+    }
+
+    rcu_assign_pointer(d->arch.hvm_domain.ioreq_server.index, index);
+
+    if ( old )
+        call_rcu(&old->rcu, hvm_free_ioreq_index);
+}
+
+/*
+ * Look up the server a range of the given type goes to: NULL for the
+ * default server.  Returns false if the index can't tell.
+ */
+static bool_t hvm_lookup_ioreq_index(struct domain *d, unsigned int type,
+                                     uint64_t start, uint64_t end,
+                                     struct hvm_ioreq_server **s)
+{
+    const struct hvm_ioreq_index *index;
+    const struct hvm_ioreq_range *range;
+    int lo, hi, mid;
+    bool_t found = 0;
+
+    rcu_read_lock(&ioreq_index_rcu_lock);
+
+    index = rcu_dereference(d->arch.hvm_domain.ioreq_server.index);
+    if ( index && index->nr[type] >= 0 )
+    {
+        /* Find the last range starting at or below start. */
+        range = index->range[type];
+        for ( lo = 0, hi = index->nr[type]; lo < hi; )
+        {
+            mid = lo + (hi - lo) / 2;
+            if ( range[mid].start <= start )
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        *s = (lo > 0 && range[lo - 1].end >= end) ? range[lo - 1].s : NULL;
+        found = 1;
+    }
+
+    rcu_read_unlock(&ioreq_index_rcu_lock);
+
+    return found;
+}
+
 static int hvm_ioreq_server_init(struct hvm_ioreq_server *s,
                                  struct domain *d, domid_t domid,
                                  bool_t is_default, int bufioreq_handling,
@@ -757,6 +937,8 @@ int hvm_destroy_ioreq_server(struct domain *d, ioservid_t id)
 
         list_del(&s->list_entry);
 
+        hvm_update_ioreq_index(d);
+
         hvm_ioreq_server_deinit(s, 0);
 
         domain_unpause(d);
@@ -853,6 +1035,8 @@ int hvm_map_io_range_to_ioreq_server(struct domain *d, ioservid_t id,
                 break;
 
             rc = rangeset_add_range(r, start, end);
+            if ( rc == 0 && s->enabled )
+                hvm_update_ioreq_index(d);
             break;
         }
     }
@@ -905,6 +1089,8 @@ int hvm_unmap_io_range_from_ioreq_server(struct domain *d, ioservid_t id,
                 break;
 
             rc = rangeset_remove_range(r, start, end);
+            if ( rc == 0 && s->enabled )
+                hvm_update_ioreq_index(d);
             break;
         }
     }
@@ -943,6 +1129,8 @@ int hvm_set_ioreq_server_state(struct domain *d, ioservid_t id,
         else
             hvm_ioreq_server_disable(s, 0);
 
+        hvm_update_ioreq_index(d);
+
         domain_unpause(d);
 
         rc = 0;
@@ -1027,6 +1215,10 @@ void hvm_destroy_all_ioreq_servers(struct domain *d)
         xfree(s);
     }
 
+    /* No readers are left either. */
+    xfree(d->arch.hvm_domain.ioreq_server.index);
+    d->arch.hvm_domain.ioreq_server.index = NULL;
+
     spin_unlock_recursive(&d->arch.hvm_domain.ioreq_server.lock);
 }
 
@@ -1110,7 +1302,7 @@ struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
     struct hvm_ioreq_server *s;
     uint32_t cf8;
     uint8_t type;
-    uint64_t addr;
+    uint64_t addr, start, end;
 
     if ( list_empty(&d->arch.hvm_domain.ioreq_server.list) )
         return NULL;
@@ -1156,49 +1348,51 @@ struct hvm_ioreq_server *hvm_select_ioreq_server(struct domain *d,
         addr = p->addr;
     }
 
-    list_for_each_entry ( s,
-                          &d->arch.hvm_domain.ioreq_server.list,
-                          list_entry )
+    switch ( type )
     {
-        struct rangeset *r;
-
-        if ( s == d->arch.hvm_domain.default_ioreq_server )
-            continue;
-
-        if ( !s->enabled )
-            continue;
-
-        r = s->range[type];
+    case HVMOP_IO_RANGE_PORT:
+        start = addr;
+        end = addr + p->size - 1;
+        break;
+    case HVMOP_IO_RANGE_MEMORY:
+        start = addr;
+        end = addr + (p->size * p->count) - 1;
+        break;
+    case HVMOP_IO_RANGE_PCI:
+        start = end = addr >> 32;
+        break;
+    }
 
-        switch ( type )
+    if ( !hvm_lookup_ioreq_index(d, type, start, end, &s) )
+    {
+        list_for_each_entry ( s,
+                              &d->arch.hvm_domain.ioreq_server.list,
+                              list_entry )
         {
-            unsigned long end;
+            if ( s == d->arch.hvm_domain.default_ioreq_server )
+                continue;
 
-        case HVMOP_IO_RANGE_PORT:
-            end = addr + p->size - 1;
-            if ( rangeset_contains_range(r, addr, end) )
-                return s;
+            if ( !s->enabled )
+                continue;
 
-            break;
-        case HVMOP_IO_RANGE_MEMORY:
-            end = addr + (p->size * p->count) - 1;
-            if ( rangeset_contains_range(r, addr, end) )
-                return s;
+            if ( rangeset_contains_range(s->range[type], start, end) )
+                break;
+        }
 
-            break;
-        case HVMOP_IO_RANGE_PCI:
-            if ( rangeset_contains_singleton(r, addr >> 32) )
-            {
-                p->type = IOREQ_TYPE_PCI_CONFIG;
-                p->addr = addr;
-                return s;
-            }
+        if ( &s->list_entry == &d->arch.hvm_domain.ioreq_server.list )
+            s = NULL;
+    }
 
-            break;
-        }
+    if ( s == NULL )
+        return d->arch.hvm_domain.default_ioreq_server;
+
+    if ( type == HVMOP_IO_RANGE_PCI )
+    {
+        p->type = IOREQ_TYPE_PCI_CONFIG;
+        p->addr = addr;
     }
 
-    return d->arch.hvm_domain.default_ioreq_server;
+    return s;
 }
 
 static int hvm_send_buffered_ioreq(struct hvm_ioreq_server *s, ioreq_t *p)
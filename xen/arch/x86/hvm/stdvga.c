@@ -611,6 +611,7 @@ void stdvga_init(struct domain *d)
 
         handler->type = IOREQ_TYPE_COPY;
         handler->ops = &stdvga_mem_ops;
+        handler->exclusive = 1;
     }
 }
 
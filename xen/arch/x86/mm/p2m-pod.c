@@ -659,9 +659,22 @@ out_unlock:
 void p2m_pod_dump_data(struct domain *d)
 {
     struct p2m_domain *p2m = p2m_get_hostp2m(d);
-
-    printk("    PoD entries=%ld cachesize=%ld\n",
-           p2m->pod.entry_count, p2m->pod.count);
+    unsigned long faults = p2m->pod.faults, rate = 0;
+    s_time_t now = NOW();
+
+    /* Fault rate since the previous dump. */
+    if ( p2m->pod.dump_time && now > p2m->pod.dump_time )
+        rate = (faults - p2m->pod.dump_faults) * SECONDS(1) /
+               (now - p2m->pod.dump_time);
+    p2m->pod.dump_faults = faults;
+    p2m->pod.dump_time = now;
+
+    printk("    PoD entries=%ld cachesize=%ld%s\n",
+           p2m->pod.entry_count, p2m->pod.count,
+           d->arch.hvm_domain.params[HVM_PARAM_POD_LAZY] ? " (lazy)" : "");
+    printk("    PoD faults=%lu (%lu/s) sweeps=%lu reclaimed=%lu allocated=%lu\n",
+           faults, rate, p2m->pod.sweeps, p2m->pod.reclaimed,
+           p2m->pod.allocated);
 }
 
 
@@ -808,6 +821,7 @@ p2m_pod_zero_check_superpage(struct p2m_domain *p2m, unsigned long gfn)
      * back on the PoD cache, and account for the new p2m PoD entries */
     p2m_pod_cache_add(p2m, mfn_to_page(mfn0), PAGE_ORDER_2M);
     p2m->pod.entry_count += SUPERPAGE_PAGES;
+    p2m->pod.reclaimed += SUPERPAGE_PAGES;
 
     ret = SUPERPAGE_PAGES;
 
@@ -929,6 +943,7 @@ p2m_pod_zero_check(struct p2m_domain *p2m, unsigned long *gfns, int count)
             /* Add to cache, and account for the new p2m PoD entry */
             p2m_pod_cache_add(p2m, mfn_to_page(mfns[i]), PAGE_ORDER_4K);
             p2m->pod.entry_count++;
+            p2m->pod.reclaimed++;
         }
     }
     
@@ -943,6 +958,7 @@ p2m_pod_emergency_sweep(struct p2m_domain *p2m)
     unsigned long i, j=0, start, limit;
     p2m_type_t t;
 
+    p2m->pod.sweeps++;
 
     if ( p2m->pod.reclaim_single == 0 )
         p2m->pod.reclaim_single = p2m->pod.max_guest;
@@ -1038,6 +1054,31 @@ static void pod_eager_record(struct p2m_domain *p2m,
     mrp->idx %= ARRAY_SIZE(mrp->list);
 }
 
+/*
+ * In lazy mode, refill an empty cache with memory newly allocated for the
+ * domain rather than by looking for zero pages.
+ */
+static void pod_lazy_allocate(struct p2m_domain *p2m, unsigned int order)
+{
+    struct page_info *page = NULL;
+
+    ASSERT(pod_locked_by_me(p2m));
+
+    if ( order == PAGE_ORDER_2M )
+        page = alloc_domheap_pages(p2m->domain, PAGE_ORDER_2M, 0);
+    if ( page == NULL )
+    {
+        /* The fault will be retried on a splintered superpage. */
+        order = PAGE_ORDER_4K;
+        page = alloc_domheap_pages(p2m->domain, PAGE_ORDER_4K, 0);
+    }
+    if ( page == NULL )
+        return;
+
+    p2m_pod_cache_add(p2m, page, order);
+    p2m->pod.allocated += 1UL << order;
+}
+
 int
 p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
                         unsigned int order,
@@ -1048,6 +1089,7 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
     unsigned long gfn_aligned;
     mfn_t mfn;
     int i;
+    bool_t lazy = !!d->arch.hvm_domain.params[HVM_PARAM_POD_LAZY];
 
     ASSERT(gfn_locked_by_me(p2m, gfn));
     pod_lock(p2m);
@@ -1078,16 +1120,28 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
         return 0;
     }
 
-    /* Only reclaim if we're in actual need of more cache. */
-    if ( p2m->pod.entry_count > p2m->pod.count )
-        pod_eager_reclaim(p2m);
+    p2m->pod.faults++;
 
-    /* Only sweep if we're actually out of memory.  Doing anything else
-     * causes unnecessary time and fragmentation of superpages in the p2m. */
-    if ( p2m->pod.count == 0 )
-        p2m_pod_emergency_sweep(p2m);
+    if ( lazy )
+    {
+        /* Never sweep: back the entry with new memory if need be. */
+        if ( p2m->pod.count == 0 )
+            pod_lazy_allocate(p2m, order);
+    }
+    else
+    {
+        /* Only reclaim if we're in actual need of more cache. */
+        if ( p2m->pod.entry_count > p2m->pod.count )
+            pod_eager_reclaim(p2m);
+
+        /* Only sweep if we're actually out of memory.  Doing anything else
+         * causes unnecessary time and fragmentation of superpages in the
+         * p2m. */
+        if ( p2m->pod.count == 0 )
+            p2m_pod_emergency_sweep(p2m);
+    }
 
-    /* If the sweep failed, give up. */
+    /* If the sweep or allocation failed, give up. */
     if ( p2m->pod.count == 0 )
         goto out_of_memory;
 
@@ -1118,7 +1172,9 @@ p2m_pod_demand_populate(struct p2m_domain *p2m, unsigned long gfn,
     p2m->pod.entry_count -= (1 << order);
     BUG_ON(p2m->pod.entry_count < 0);
 
-    pod_eager_record(p2m, gfn_aligned, order);
+    /* Nothing will be reclaimed in lazy mode. */
+    if ( !lazy )
+        pod_eager_record(p2m, gfn_aligned, order);
 
     if ( tb_init_done )
     {
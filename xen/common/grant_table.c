@@ -186,6 +186,33 @@ static inline void gnttab_flush_tlb(const struct domain *d)
         flush_tlb_mask(d->domain_dirty_cpumask);
 }
 
+/*
+ * IOMMU mappings changed by a batch of operations are flushed from the
+ * IOTLB once, rather than after every page.  Returns whether flushes are
+ * deferred, in which case gnttab_flush_iotlb() has to be called before
+ * the batch completes, and gnttab_iotlb_end() at the end.
+ */
+static inline bool_t gnttab_defer_iotlb(const struct domain *d)
+{
+    if ( !gnttab_need_iommu_mapping(d) || this_cpu(iommu_dont_flush_iotlb) )
+        return 0;
+
+    this_cpu(iommu_dont_flush_iotlb) = 1;
+
+    return 1;
+}
+
+static inline int gnttab_flush_iotlb(struct domain *d, bool_t deferred)
+{
+    return deferred ? iommu_iotlb_flush_all(d) : 0;
+}
+
+static inline void gnttab_iotlb_end(bool_t deferred)
+{
+    if ( deferred )
+        this_cpu(iommu_dont_flush_iotlb) = 0;
+}
+
 static inline unsigned int
 num_act_frames_from_sha_frames(const unsigned int num)
 {
@@ -335,12 +362,17 @@ __get_maptrack_handle(
  * each VCPU and to avoid two VCPU repeatedly stealing entries from
  * each other, the initial victim VCPU is selected randomly.
  */
+static void maptrack_cache_drain(struct grant_table *t,
+                                 const struct vcpu *curr);
+
 static int steal_maptrack_handle(struct grant_table *t,
                                  const struct vcpu *curr)
 {
     const struct domain *currd = curr->domain;
     unsigned int first, i;
+    bool_t drained = 0;
 
+ retry:
     /* Find an initial victim. */
     first = i = get_random() % currd->max_vcpus;
 
@@ -362,32 +394,111 @@ static int steal_maptrack_handle(struct grant_table *t,
             i = 0;
     } while ( i != first );
 
+    /* Free handles may still sit in the caches of other VCPUs. */
+    if ( !drained )
+    {
+        maptrack_cache_drain(t, curr);
+        drained = 1;
+        goto retry;
+    }
+
     /* No free handles on any VCPU. */
     return -1;
 }
 
-static inline void
-put_maptrack_handle(
-    struct grant_table *t, int handle)
+/*
+ * Append the chain of free entries first ... last (whose last entry must
+ * already be marked as the tail) to the free list of VCPU v.
+ */
+static void maptrack_append(struct grant_table *t, struct vcpu *v,
+                            unsigned int first, unsigned int last)
 {
-    struct domain *currd = current->domain;
-    struct vcpu *v;
     unsigned int prev_tail, cur_tail;
 
-    /* 1. Set entry to be a tail. */
-    maptrack_entry(t, handle).ref = MAPTRACK_TAIL;
-
-    /* 2. Add entry to the tail of the list on the original VCPU. */
-    v = currd->vcpu[maptrack_entry(t, handle).vcpu];
-
+    /* 1. Make the last entry of the chain the new tail. */
     cur_tail = read_atomic(&v->maptrack_tail);
     do {
         prev_tail = cur_tail;
-        cur_tail = cmpxchg(&v->maptrack_tail, prev_tail, handle);
+        cur_tail = cmpxchg(&v->maptrack_tail, prev_tail, last);
     } while ( cur_tail != prev_tail );
 
-    /* 3. Update the old tail entry to point to the new entry. */
-    write_atomic(&maptrack_entry(t, prev_tail).ref, handle);
+    /* 2. Update the old tail entry to point to the chain. */
+    write_atomic(&maptrack_entry(t, prev_tail).ref, first);
+}
+
+/*
+ * Move the nr oldest entries of the VCPU's handle cache back to its free
+ * list, so that other VCPUs can steal those entries if need be.  The
+ * cache lock must be held.
+ */
+static void maptrack_cache_spill(struct grant_table *t, struct vcpu *v,
+                                 unsigned int nr)
+{
+    unsigned int i;
+
+    ASSERT(spin_is_locked(&v->maptrack_cache_lock));
+
+    for ( i = 0; i < nr - 1; i++ )
+        maptrack_entry(t, v->maptrack_cache[i]).ref = v->maptrack_cache[i + 1];
+    maptrack_entry(t, v->maptrack_cache[nr - 1]).ref = MAPTRACK_TAIL;
+
+    maptrack_append(t, v, v->maptrack_cache[0], v->maptrack_cache[nr - 1]);
+
+    v->maptrack_cached -= nr;
+    memmove(&v->maptrack_cache[0], &v->maptrack_cache[nr],
+            v->maptrack_cached * sizeof(v->maptrack_cache[0]));
+}
+
+/*
+ * Once the domain is out of maptrack frames, give the handles cached by
+ * other VCPUs back to their free lists, where they can be stolen.
+ */
+static void maptrack_cache_drain(struct grant_table *t,
+                                 const struct vcpu *curr)
+{
+    struct vcpu *v;
+
+    spin_lock(&t->maptrack_lock);
+
+    for_each_vcpu ( curr->domain, v )
+    {
+        if ( v == curr || !read_atomic(&v->maptrack_cached) )
+            continue;
+
+        spin_lock(&v->maptrack_cache_lock);
+        if ( v->maptrack_cached )
+            maptrack_cache_spill(t, v, v->maptrack_cached);
+        spin_unlock(&v->maptrack_cache_lock);
+    }
+
+    spin_unlock(&t->maptrack_lock);
+}
+
+static inline void
+put_maptrack_handle(
+    struct grant_table *t, int handle)
+{
+    struct vcpu *curr = current;
+
+    /*
+     * Handles owned by the freeing VCPU go to its private cache, where
+     * the next map on this VCPU will find them without going through the
+     * free list other VCPUs steal from.
+     */
+    if ( likely(maptrack_entry(t, handle).vcpu == curr->vcpu_id) )
+    {
+        spin_lock(&curr->maptrack_cache_lock);
+        if ( unlikely(curr->maptrack_cached == MAPTRACK_CACHE_SIZE) )
+            maptrack_cache_spill(t, curr, MAPTRACK_CACHE_SIZE / 2);
+        curr->maptrack_cache[curr->maptrack_cached++] = handle;
+        spin_unlock(&curr->maptrack_cache_lock);
+        return;
+    }
+
+    /* Otherwise add the entry to the tail of the list on its VCPU. */
+    maptrack_entry(t, handle).ref = MAPTRACK_TAIL;
+    maptrack_append(t, curr->domain->vcpu[maptrack_entry(t, handle).vcpu],
+                    handle, handle);
 }
 
 static inline int
@@ -395,13 +506,30 @@ get_maptrack_handle(
     struct grant_table *lgt)
 {
     struct vcpu          *curr = current;
-    int                   i;
+    int                   i, nr;
     grant_handle_t        handle;
     struct grant_mapping *new_mt;
 
-    handle = __get_maptrack_handle(lgt, curr);
-    if ( likely(handle != -1) )
+    spin_lock(&curr->maptrack_cache_lock);
+
+    /* Refill half of an empty cache from this VCPU's free list. */
+    if ( unlikely(!curr->maptrack_cached) )
+        while ( curr->maptrack_cached < MAPTRACK_CACHE_SIZE / 2 )
+        {
+            handle = __get_maptrack_handle(lgt, curr);
+            if ( handle == -1 )
+                break;
+            curr->maptrack_cache[curr->maptrack_cached++] = handle;
+        }
+
+    if ( likely(curr->maptrack_cached) )
+    {
+        handle = curr->maptrack_cache[--curr->maptrack_cached];
+        spin_unlock(&curr->maptrack_cache_lock);
         return handle;
+    }
+
+    spin_unlock(&curr->maptrack_cache_lock);
 
     spin_lock(&lgt->maptrack_lock);
 
@@ -441,10 +569,12 @@ get_maptrack_handle(
     clear_page(new_mt);
 
     /*
-     * Use the first new entry and add the remaining entries to the
-     * head of the free list.
+     * Use the first new entry, put the next few into the (empty) cache
+     * and add the remaining entries to the head of the free list.
      */
     handle = lgt->maptrack_limit;
+    nr = MAPTRACK_CACHE_SIZE / 2;
+    BUILD_BUG_ON(MAPTRACK_CACHE_SIZE / 2 + 2 > MAPTRACK_PER_PAGE);
 
     for ( i = 0; i < MAPTRACK_PER_PAGE; i++ )
     {
@@ -453,11 +583,16 @@ get_maptrack_handle(
     }
     new_mt[i - 1].ref = curr->maptrack_head;
 
+    spin_lock(&curr->maptrack_cache_lock);
+    for ( i = 1; i <= nr; i++ )
+        curr->maptrack_cache[curr->maptrack_cached++] = handle + i;
+    spin_unlock(&curr->maptrack_cache_lock);
+
     /* Set tail directly if this is the first page for this VCPU. */
     if ( curr->maptrack_tail == MAPTRACK_TAIL )
         curr->maptrack_tail = handle + MAPTRACK_PER_PAGE - 1;
 
-    write_atomic(&curr->maptrack_head, handle + 1);
+    write_atomic(&curr->maptrack_head, handle + nr + 1);
 
     lgt->maptrack[nr_maptrack_frames(lgt)] = new_mt;
     lgt->maptrack_limit += MAPTRACK_PER_PAGE;
@@ -1055,19 +1190,34 @@ gnttab_map_grant_ref(
 {
     int i;
     struct gnttab_map_grant_ref op;
+    bool_t deferred = gnttab_defer_iotlb(current->domain);
+    long rc = 0;
+    int err;
 
     for ( i = 0; i < count; i++ )
     {
         if (i && hypercall_preempt_check())
-            return i;
+        {
+            rc = i;
+            break;
+        }
         if ( unlikely(__copy_from_guest_offset(&op, uop, i, 1)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
         __gnttab_map_grant_ref(&op);
         if ( unlikely(__copy_to_guest_offset(uop, i, &op, 1)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
     }
 
-    return 0;
+    err = gnttab_flush_iotlb(current->domain, deferred);
+    gnttab_iotlb_end(deferred);
+
+    return (err && rc >= 0) ? err : rc;
 }
 
 static void
@@ -1332,9 +1482,10 @@ static long
 gnttab_unmap_grant_ref(
     XEN_GUEST_HANDLE_PARAM(gnttab_unmap_grant_ref_t) uop, unsigned int count)
 {
-    int i, c, partial_done, done = 0;
+    int i, c, partial_done, done = 0, rc = 0;
     struct gnttab_unmap_grant_ref op;
     struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
+    bool_t deferred = gnttab_defer_iotlb(current->domain);
 
     while ( count != 0 )
     {
@@ -1353,6 +1504,7 @@ gnttab_unmap_grant_ref(
         }
 
         gnttab_flush_tlb(current->domain);
+        rc = gnttab_flush_iotlb(current->domain, deferred);
 
         for ( i = 0; i < partial_done; i++ )
             __gnttab_unmap_common_complete(&(common[i]));
@@ -1360,14 +1512,25 @@ gnttab_unmap_grant_ref(
         count -= c;
         done += c;
 
+        if ( rc )
+            break;
+
         if (count && hypercall_preempt_check())
-            return done;
+        {
+            rc = done;
+            break;
+        }
     }
      
-    return 0;
+    gnttab_iotlb_end(deferred);
+
+    return rc;
 
 fault:
     gnttab_flush_tlb(current->domain);
+    /* Errors crash the domain, and -EFAULT is returned anyway. */
+    gnttab_flush_iotlb(current->domain, deferred);
+    gnttab_iotlb_end(deferred);
 
     for ( i = 0; i < partial_done; i++ )
         __gnttab_unmap_common_complete(&(common[i]));
@@ -1395,9 +1558,10 @@ static long
 gnttab_unmap_and_replace(
     XEN_GUEST_HANDLE_PARAM(gnttab_unmap_and_replace_t) uop, unsigned int count)
 {
-    int i, c, partial_done, done = 0;
+    int i, c, partial_done, done = 0, rc = 0;
     struct gnttab_unmap_and_replace op;
     struct gnttab_unmap_common common[GNTTAB_UNMAP_BATCH_SIZE];
+    bool_t deferred = gnttab_defer_iotlb(current->domain);
 
     while ( count != 0 )
     {
@@ -1416,6 +1580,7 @@ gnttab_unmap_and_replace(
         }
         
         gnttab_flush_tlb(current->domain);
+        rc = gnttab_flush_iotlb(current->domain, deferred);
         
         for ( i = 0; i < partial_done; i++ )
             __gnttab_unmap_common_complete(&(common[i]));
@@ -1423,14 +1588,25 @@ gnttab_unmap_and_replace(
         count -= c;
         done += c;
 
+        if ( rc )
+            break;
+
         if (count && hypercall_preempt_check())
-            return done;
+        {
+            rc = done;
+            break;
+        }
     }
 
-    return 0;
+    gnttab_iotlb_end(deferred);
+
+    return rc;
 
 fault:
     gnttab_flush_tlb(current->domain);
+    /* Errors crash the domain, and -EFAULT is returned anyway. */
+    gnttab_flush_iotlb(current->domain, deferred);
+    gnttab_iotlb_end(deferred);
 
     for ( i = 0; i < partial_done; i++ )
         __gnttab_unmap_common_complete(&(common[i]));
@@ -2308,15 +2484,10 @@ struct gnttab_copy_buf {
     bool_t have_type;
 };
 
-static int gnttab_copy_lock_domain(domid_t domid, unsigned int gref_flag,
-                                   struct gnttab_copy_buf *buf)
+static int gnttab_copy_lock_domain(domid_t domid, struct gnttab_copy_buf *buf)
 {
     int rc;
 
-    if ( domid != DOMID_SELF && !gref_flag )
-        PIN_FAIL(out, GNTST_permission_denied,
-                 "only allow copy-by-mfn for DOMID_SELF.\n");
-
     if ( domid == DOMID_SELF )
         buf->domain = rcu_lock_current_domain();
     else
@@ -2332,47 +2503,20 @@ static int gnttab_copy_lock_domain(domid_t domid, unsigned int gref_flag,
     return rc;
 }
 
-static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
-                                       struct gnttab_copy_buf *dest)
+static void gnttab_copy_unlock_domain(struct gnttab_copy_buf *buf)
 {
-    if ( src->domain )
-    {
-        rcu_unlock_domain(src->domain);
-        src->domain = NULL;
-    }
-    if ( dest->domain )
+    if ( buf->domain )
     {
-        rcu_unlock_domain(dest->domain);
-        dest->domain = NULL;
+        rcu_unlock_domain(buf->domain);
+        buf->domain = NULL;
     }
 }
 
-static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
-                                    struct gnttab_copy_buf *src,
-                                    struct gnttab_copy_buf *dest)
+static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
+                                       struct gnttab_copy_buf *dest)
 {
-    int rc;
-
-    rc = gnttab_copy_lock_domain(op->source.domid,
-                                 op->flags & GNTCOPY_source_gref, src);
-    if ( rc < 0 )
-        goto error;
-    rc = gnttab_copy_lock_domain(op->dest.domid,
-                                 op->flags & GNTCOPY_dest_gref, dest);
-    if ( rc < 0 )
-        goto error;
-
-    rc = xsm_grant_copy(XSM_HOOK, src->domain, dest->domain);
-    if ( rc < 0 )
-    {
-        rc = GNTST_permission_denied;
-        goto error;
-    }
-    return 0;
-
- error:
-    gnttab_copy_unlock_domains(src, dest);
-    return rc;
+    gnttab_copy_unlock_domain(src);
+    gnttab_copy_unlock_domain(dest);
 }
 
 static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
@@ -2460,7 +2604,7 @@ static bool_t gnttab_copy_buf_valid(const struct gnttab_copy_ptr *p,
         return 0;
     if ( has_gref )
         return b->have_grant && p->u.ref == b->ptr.u.ref;
-    return p->u.gmfn == b->ptr.u.gmfn;
+    return !b->have_grant && p->u.gmfn == b->ptr.u.gmfn;
 }
 
 static int gnttab_copy_buf(const struct gnttab_copy *op,
@@ -2487,8 +2631,11 @@ static int gnttab_copy_buf(const struct gnttab_copy *op,
                  op->dest.offset, dest->ptr.offset,
                  op->len, dest->len);
 
-    memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
-           op->len);
+    if ( op->len == PAGE_SIZE )
+        copy_page(dest->virt, src->virt);
+    else
+        memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
+               op->len);
     gnttab_mark_dirty(dest->domain, dest->frame);
     rc = GNTST_okay;
  out:
@@ -2499,18 +2646,48 @@ static int gnttab_copy_one(const struct gnttab_copy *op,
                            struct gnttab_copy_buf *dest,
                            struct gnttab_copy_buf *src)
 {
+    bool_t relocked = 0;
     int rc;
 
-    if ( !src->domain || op->source.domid != src->ptr.domid ||
-         !dest->domain || op->dest.domid != dest->ptr.domid )
+    if ( (op->source.domid != DOMID_SELF &&
+          !(op->flags & GNTCOPY_source_gref)) ||
+         (op->dest.domid != DOMID_SELF &&
+          !(op->flags & GNTCOPY_dest_gref)) )
+        PIN_FAIL(out, GNTST_permission_denied,
+                 "only allow copy-by-mfn for DOMID_SELF.\n");
+
+    /*
+     * Source and destination domain are tracked separately, so that e.g.
+     * a backend copying from its own pages to several guests in turn
+     * doesn't lose its source mapping whenever the destination changes.
+     */
+    if ( !src->domain || op->source.domid != src->ptr.domid )
     {
         gnttab_copy_release_buf(src);
-        gnttab_copy_release_buf(dest);
-        gnttab_copy_unlock_domains(src, dest);
+        gnttab_copy_unlock_domain(src);
+        rc = gnttab_copy_lock_domain(op->source.domid, src);
+        if ( rc < 0 )
+            goto out;
+        relocked = 1;
+    }
 
-        rc = gnttab_copy_lock_domains(op, src, dest);
+    if ( !dest->domain || op->dest.domid != dest->ptr.domid )
+    {
+        gnttab_copy_release_buf(dest);
+        gnttab_copy_unlock_domain(dest);
+        rc = gnttab_copy_lock_domain(op->dest.domid, dest);
         if ( rc < 0 )
             goto out;
+        relocked = 1;
+    }
+
+    if ( relocked && xsm_grant_copy(XSM_HOOK, src->domain, dest->domain) )
+    {
+        gnttab_copy_release_buf(src);
+        gnttab_copy_release_buf(dest);
+        gnttab_copy_unlock_domains(src, dest);
+        rc = GNTST_permission_denied;
+        goto out;
     }
 
     /* Different source? */
@@ -3436,6 +3613,8 @@ void grant_table_init_vcpu(struct vcpu *v)
 {
     v->maptrack_head = MAPTRACK_TAIL;
     v->maptrack_tail = MAPTRACK_TAIL;
+    spin_lock_init(&v->maptrack_cache_lock);
+    v->maptrack_cached = 0;
 }
 
 static void gnttab_usage_print(struct domain *rd)
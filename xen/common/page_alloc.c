@@ -121,6 +121,7 @@
  */
 
 #include <xen/config.h>
+#include <xen/cpu.h>
 #include <xen/init.h>
 #include <xen/types.h>
 #include <xen/lib.h>
@@ -393,6 +394,72 @@ static long midsize_alloc_zone_pages;
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+/*
+ * Freed pages aren't scrubbed right away, but marked PGC_need_scrub and
+ * scrubbed by idle vcpus (see scrub_free_pages()), or by the allocator if
+ * they're handed out before that.  Counts per node, under heap_lock.
+ */
+static unsigned long node_need_scrub[MAX_NUMNODES];
+
+/* first_dirty of a free buddy which needs no scrubbing. */
+#define INVALID_DIRTY_IDX (~0U)
+
+/* Size of the chunks taken off the free lists by the idle scrubber. */
+#define SCRUB_CHUNK_ORDER 9
+
+/*
+ * Put a free buddy on its free list.  Clean buddies go at the head, where
+ * the allocator looks, and dirty ones at the tail, where the scrubber looks.
+ */
+static void page_list_add_scrub(struct page_info *pg, unsigned int node,
+                                unsigned int zone, unsigned int order,
+                                unsigned int first_dirty)
+{
+    PFN_ORDER(pg) = order;
+    pg->u.free.first_dirty = first_dirty;
+
+    if ( first_dirty != INVALID_DIRTY_IDX )
+        page_list_add_tail(pg, &heap(node, zone, order));
+    else
+        page_list_add(pg, &heap(node, zone, order));
+}
+
+/*
+ * Per-cpu caches of free single pages of the cpu's node, so that most
+ * order-0 allocations and frees don't need heap_lock.  A cache is refilled
+ * with a 2^PAGE_CACHE_BATCH_ORDER chunk from the heap when it runs empty,
+ * and gives back its coldest PAGE_CACHE_BATCH pages when it grows beyond
+ * PAGE_CACHE_HIGH.  Cached pages are in use as far as the heap is
+ * concerned, with u.free and tlbflush_timestamp valid.
+ */
+#define PAGE_CACHE_BATCH_ORDER 4
+#define PAGE_CACHE_BATCH       (1U << PAGE_CACHE_BATCH_ORDER)
+#define PAGE_CACHE_HIGH        (4 * PAGE_CACHE_BATCH)
+
+struct page_cache {
+    spinlock_t lock;
+    struct page_list_head list;
+    unsigned int count;
+};
+
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+static bool_t __read_mostly page_cache_enabled;
+
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int memflags);
+
+static unsigned long page_cache_pages(void)
+{
+    unsigned long pages = 0;
+    unsigned int cpu;
+
+    if ( page_cache_enabled )
+        for_each_online_cpu ( cpu )
+            pages += per_cpu(page_cache, cpu).count;
+
+    return pages;
+}
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -500,7 +567,7 @@ void get_outstanding_claims(uint64_t *free_pages, uint64_t *outstanding_pages)
 {
     spin_lock(&heap_lock);
     *outstanding_pages = outstanding_claims;
-    *free_pages =  avail_domheap_pages();
+    *free_pages =  avail_domheap_pages() + page_cache_pages();
     spin_unlock(&heap_lock);
 }
 
@@ -649,10 +716,14 @@ static void __init setup_low_mem_virq(void)
             low_mem_virq_th);
 }
 
+static unsigned long low_mem_avail_pages(void)
+{
+    return total_avail_pages + tmem_freeable_pages() - outstanding_claims;
+}
+
 static void check_low_mem_virq(void)
 {
-    unsigned long avail_pages = total_avail_pages +
-        tmem_freeable_pages() - outstanding_claims;
+    unsigned long avail_pages = low_mem_avail_pages();
 
     if ( unlikely(avail_pages <= low_mem_virq_th) )
     {
@@ -683,15 +754,41 @@ static void check_low_mem_virq(void)
     }
 }
 
+/*
+ * Claimed memory is considered unavailable unless the request
+ * is made by a domain with sufficient unclaimed pages.
+ */
+static bool_t claims_exceeded(unsigned long request, unsigned int memflags,
+                              const struct domain *d)
+{
+    return (outstanding_claims + request >
+            total_avail_pages + tmem_freeable_pages()) &&
+           ((memflags & MEMF_no_refcount) ||
+            !d || d->outstanding_pages < request);
+}
+
+/*
+ * TMEM: When available memory is scarce due to tmem absorbing it, allow
+ * only mid-size allocations to avoid worst of fragmentation issues.
+ * Others try tmem pools then fail.  This is a workaround until all
+ * post-dom0-creation-multi-page allocations can be eliminated.
+ */
+static bool_t tmem_only(unsigned int order)
+{
+    return ((order == 0) || (order >= 9)) &&
+           (total_avail_pages <= midsize_alloc_zone_pages) &&
+           tmem_freeable_pages();
+}
+
 /* Allocate 2^@order contiguous pages. */
-static struct page_info *alloc_heap_pages(
+static struct page_info *__alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int order, unsigned int memflags,
     struct domain *d)
 {
-    unsigned int i, j, zone = 0, nodemask_retry = 0;
+    unsigned int i, j, zone = 0, nodemask_retry = 0, first_dirty;
     nodeid_t first_node, node = MEMF_get_node(memflags), req_node = node;
-    unsigned long request = 1UL << order;
+    unsigned long request = 1UL << order, dirty_cnt = 0;
     struct page_info *pg;
     nodemask_t nodemask = (d != NULL ) ? d->node_affinity : node_online_map;
     bool_t need_tlbflush = 0;
@@ -720,27 +817,34 @@ static struct page_info *alloc_heap_pages(
     if ( unlikely(order > MAX_ORDER) )
         return NULL;
 
-    spin_lock(&heap_lock);
-
     /*
-     * Claimed memory is considered unavailable unless the request
-     * is made by a domain with sufficient unclaimed pages.
+     * Cached pages are already accounted as allocated, so the page cache
+     * is subject to the same checks as the heap, done without heap_lock.
+     * Refilling the cache from the heap checks again under the lock.
      */
-    if ( (outstanding_claims + request >
-          total_avail_pages + tmem_freeable_pages()) &&
-          ((memflags & MEMF_no_refcount) ||
-           !d || d->outstanding_pages < request) )
+    if ( order == 0 && zone_lo > MEMZONE_XEN && page_cache_enabled &&
+         node == cpu_to_node(smp_processor_id()) &&
+         !claims_exceeded(request, memflags, d) && !tmem_only(order) &&
+         (pg = page_cache_alloc(zone_lo, zone_hi, memflags)) != NULL )
+    {
+        if ( unlikely(low_mem_avail_pages() <= low_mem_virq_th) )
+        {
+            spin_lock(&heap_lock);
+            check_low_mem_virq();
+            spin_unlock(&heap_lock);
+        }
+
+        if ( d != NULL )
+            d->last_alloc_node = node;
+        return pg;
+    }
+
+    spin_lock(&heap_lock);
+
+    if ( claims_exceeded(request, memflags, d) )
         goto not_found;
 
-    /*
-     * TMEM: When available memory is scarce due to tmem absorbing it, allow
-     * only mid-size allocations to avoid worst of fragmentation issues.
-     * Others try tmem pools then fail.  This is a workaround until all
-     * post-dom0-creation-multi-page allocations can be eliminated.
-     */
-    if ( ((order == 0) || (order >= 9)) &&
-         (total_avail_pages <= midsize_alloc_zone_pages) &&
-         tmem_freeable_pages() )
+    if ( tmem_only(order) )
         goto try_tmem;
 
     /*
@@ -803,12 +907,21 @@ static struct page_info *alloc_heap_pages(
     return NULL;
 
  found: 
+    first_dirty = pg->u.free.first_dirty;
+
     /* We may have to halve the chunk a number of times. */
     while ( j != order )
     {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
+        j--;
+        page_list_add_scrub(pg, node, zone, j,
+                            (first_dirty < (1U << j)) ? first_dirty
+                                                      : INVALID_DIRTY_IDX);
         pg += 1 << j;
+
+        /* Unless it is past the lower half, assume all of the rest dirty. */
+        if ( first_dirty != INVALID_DIRTY_IDX )
+            first_dirty = (first_dirty >= (1U << j)) ? first_dirty - (1U << j)
+                                                     : 0;
     }
 
     ASSERT(avail[node][zone] >= request);
@@ -824,8 +937,13 @@ static struct page_info *alloc_heap_pages(
     for ( i = 0; i < (1 << order); i++ )
     {
         /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
+        BUG_ON((pg[i].count_info & ~PGC_need_scrub) != PGC_state_free);
+
+        /* Dirty pages keep their flag until they're scrubbed below. */
+        if ( pg[i].count_info & PGC_need_scrub )
+            dirty_cnt++;
+        pg[i].count_info = PGC_state_inuse |
+                           (pg[i].count_info & PGC_need_scrub);
 
         if ( !(memflags & MEMF_no_tlbflush) )
             accumulate_tlbflush(&need_tlbflush, &pg[i],
@@ -834,6 +952,19 @@ static struct page_info *alloc_heap_pages(
         /* Initialise fields which have other uses for free pages. */
         pg[i].u.inuse.type_info = 0;
         page_set_owner(&pg[i], NULL);
+    }
+
+    ASSERT(node_need_scrub[node] >= dirty_cnt);
+    node_need_scrub[node] -= dirty_cnt;
+
+    spin_unlock(&heap_lock);
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        /* Scrub whatever the idle scrubber didn't get to yet. */
+        if ( dirty_cnt &&
+             test_and_clear_bit(_PGC_need_scrub, &pg[i].count_info) )
+            scrub_one_page(&pg[i]);
 
         /* Ensure cache and RAM are consistent for platforms where the
          * guest can control its own visibility of/through the cache.
@@ -841,8 +972,6 @@ static struct page_info *alloc_heap_pages(
         flush_page_to_ram(page_to_mfn(&pg[i]));
     }
 
-    spin_unlock(&heap_lock);
-
     if ( need_tlbflush )
         filtered_flush_tlb_mask(tlbflush_timestamp);
 
@@ -856,6 +985,9 @@ static int reserve_offlined_page(struct page_info *head)
     int zone = page_to_zone(head), i, head_order = PFN_ORDER(head), count = 0;
     struct page_info *cur_head;
     int cur_order;
+    /* Conservatively, all parts of a dirty buddy are dirty. */
+    unsigned int first_dirty = (head->u.free.first_dirty != INVALID_DIRTY_IDX)
+                               ? 0 : INVALID_DIRTY_IDX;
 
     ASSERT(spin_is_locked(&heap_lock));
 
@@ -897,8 +1029,8 @@ static int reserve_offlined_page(struct page_info *head)
             {
             merge:
                 /* We don't consider merging outside the head_order. */
-                page_list_add_tail(cur_head, &heap(node, zone, cur_order));
-                PFN_ORDER(cur_head) = cur_order;
+                page_list_add_scrub(cur_head, node, zone, cur_order,
+                                    first_dirty);
                 cur_head += (1 << cur_order);
                 break;
             }
@@ -914,6 +1046,13 @@ static int reserve_offlined_page(struct page_info *head)
         total_avail_pages--;
         ASSERT(total_avail_pages >= 0);
 
+        /* Offlined pages keep the flag for when they're onlined again. */
+        if ( test_bit(_PGC_need_scrub, &cur_head->count_info) )
+        {
+            ASSERT(node_need_scrub[node]);
+            node_need_scrub[node]--;
+        }
+
         page_list_add_tail(cur_head,
                            test_bit(_PGC_broken, &cur_head->count_info) ?
                            &page_broken_list : &page_offlined_list);
@@ -924,18 +1063,70 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
-    struct page_info *pg, unsigned int order)
+/*
+ * Merge a free buddy with its free neighbours as far as possible, and put
+ * the result on the free lists.  Returns the head of the merged buddy.
+ */
+static struct page_info *merge_free_buddy(
+    struct page_info *pg, unsigned int node, unsigned int zone,
+    unsigned int order, unsigned int first_dirty)
 {
-    unsigned long mask, mfn = page_to_mfn(pg);
+    unsigned long mask;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    while ( order < MAX_ORDER )
+    {
+        mask = 1UL << order;
+
+        if ( (page_to_mfn(pg) & mask) )
+        {
+            /* Merge with predecessor block? */
+            if ( !mfn_valid(page_to_mfn(pg-mask)) ||
+                 !page_state_is(pg-mask, free) ||
+                 (PFN_ORDER(pg-mask) != order) ||
+                 (phys_to_nid(page_to_maddr(pg-mask)) != node) )
+                break;
+            pg -= mask;
+            page_list_del(pg, &heap(node, zone, order));
+            if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = pg->u.free.first_dirty;
+            else if ( first_dirty != INVALID_DIRTY_IDX )
+                first_dirty += mask;
+        }
+        else
+        {
+            /* Merge with successor block? */
+            if ( !mfn_valid(page_to_mfn(pg+mask)) ||
+                 !page_state_is(pg+mask, free) ||
+                 (PFN_ORDER(pg+mask) != order) ||
+                 (phys_to_nid(page_to_maddr(pg+mask)) != node) )
+                break;
+            page_list_del(pg + mask, &heap(node, zone, order));
+            if ( first_dirty == INVALID_DIRTY_IDX &&
+                 (pg + mask)->u.free.first_dirty != INVALID_DIRTY_IDX )
+                first_dirty = mask + (pg + mask)->u.free.first_dirty;
+        }
+
+        order++;
+    }
+
+    page_list_add_scrub(pg, node, zone, order, first_dirty);
+
+    return pg;
+}
+
+/* Free 2^@order set of pages, to be scrubbed later if need_scrub. */
+static void __free_heap_pages(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
+{
+    unsigned long mfn = page_to_mfn(pg);
     unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
     unsigned int zone = page_to_zone(pg);
 
     ASSERT(order <= MAX_ORDER);
     ASSERT(node >= 0);
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -957,6 +1148,8 @@ static void free_heap_pages(
               ? PGC_state_offlined : PGC_state_free));
         if ( page_state_is(&pg[i], offlined) )
             tainted = 1;
+        if ( need_scrub )
+            pg[i].count_info |= PGC_need_scrub;
 
         /* If a page has no owner it will need no safety TLB flush. */
         pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
@@ -970,47 +1163,252 @@ static void free_heap_pages(
 
     avail[node][zone] += 1 << order;
     total_avail_pages += 1 << order;
+    if ( need_scrub )
+        node_need_scrub[node] += 1 << order;
 
     if ( tmem_enabled() )
         midsize_alloc_zone_pages = max(
             midsize_alloc_zone_pages, total_avail_pages / MIDSIZE_ALLOC_FRAC);
 
-    /* Merge chunks as far as possible. */
-    while ( order < MAX_ORDER )
+    pg = merge_free_buddy(pg, node, zone, order,
+                          need_scrub ? 0 : INVALID_DIRTY_IDX);
+
+    if ( tainted )
+        reserve_offlined_page(pg);
+}
+
+/* Give back up to nr of the coldest pages of a page cache to the heap. */
+static unsigned int page_cache_drain(struct page_cache *pc, unsigned int nr)
+{
+    PAGE_LIST_HEAD(list);
+    struct page_info *pg;
+    unsigned int n;
+    bool need_tlbflush = false;
+    uint32_t tlbflush_timestamp = 0;
+
+    spin_lock(&pc->lock);
+    for ( n = 0; n < nr && !page_list_empty(&pc->list); n++ )
     {
-        mask = 1UL << order;
+        pg = page_list_last(&pc->list);
+        page_list_del(pg, &pc->list);
+        accumulate_tlbflush(&need_tlbflush, pg, &tlbflush_timestamp);
+        page_list_add(pg, &list);
+    }
+    pc->count -= n;
+    spin_unlock(&pc->lock);
 
-        if ( (page_to_mfn(pg) & mask) )
+    if ( !n )
+        return 0;
+
+    /* The heap won't know these pages may still need flushing. */
+    if ( need_tlbflush )
+        filtered_flush_tlb_mask(tlbflush_timestamp);
+
+    spin_lock(&heap_lock);
+    while ( (pg = page_list_remove_head(&list)) != NULL )
+        __free_heap_pages(pg, 0, 0);
+    spin_unlock(&heap_lock);
+
+    return n;
+}
+
+/* Give back all cached pages to the heap.  Returns whether there were any. */
+static bool_t page_cache_drain_all(void)
+{
+    unsigned int cpu, n = 0;
+
+    if ( !page_cache_enabled )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        n += page_cache_drain(&per_cpu(page_cache, cpu), UINT_MAX);
+
+    return n != 0;
+}
+
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int memflags)
+{
+    unsigned int cpu = smp_processor_id(), i;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    struct page_info *pg;
+    bool need_tlbflush = false;
+    uint32_t tlbflush_timestamp = 0;
+
+    for ( ; ; )
+    {
+        spin_lock(&pc->lock);
+        pg = page_list_remove_head(&pc->list);
+        if ( pg != NULL )
         {
-            /* Merge with predecessor block? */
-            if ( !mfn_valid(page_to_mfn(pg-mask)) ||
-                 !page_state_is(pg-mask, free) ||
-                 (PFN_ORDER(pg-mask) != order) ||
-                 (phys_to_nid(page_to_maddr(pg-mask)) != node) )
-                break;
-            pg -= mask;
-            page_list_del(pg, &heap(node, zone, order));
+            /* Leave requests for other zones to the heap. */
+            if ( page_to_zone(pg) < zone_lo || page_to_zone(pg) > zone_hi )
+            {
+                page_list_add(pg, &pc->list);
+                spin_unlock(&pc->lock);
+                return NULL;
+            }
+            pc->count--;
         }
-        else
+        spin_unlock(&pc->lock);
+
+        if ( pg == NULL )
+            break;
+
+        /* Pages being offlined meanwhile go back to the heap. */
+        if ( page_state_is(pg, inuse) )
         {
-            /* Merge with successor block? */
-            if ( !mfn_valid(page_to_mfn(pg+mask)) ||
-                 !page_state_is(pg+mask, free) ||
-                 (PFN_ORDER(pg+mask) != order) ||
-                 (phys_to_nid(page_to_maddr(pg+mask)) != node) )
-                break;
-            page_list_del(pg + mask, &heap(node, zone, order));
+            if ( !(memflags & MEMF_no_tlbflush) )
+                accumulate_tlbflush(&need_tlbflush, pg, &tlbflush_timestamp);
+            pg->u.inuse.type_info = 0;
+
+            if ( need_tlbflush )
+                filtered_flush_tlb_mask(tlbflush_timestamp);
+
+            /* As for heap pages, make cache and RAM consistent. */
+            flush_page_to_ram(page_to_mfn(pg));
+
+            return pg;
         }
 
-        order++;
+        spin_lock(&heap_lock);
+        __free_heap_pages(pg, 0, 0);
+        spin_unlock(&heap_lock);
     }
 
-    PFN_ORDER(pg) = order;
-    page_list_add_tail(pg, &heap(node, zone, order));
+    /* Refill with a chunk of clean, flushed pages at once. */
+    pg = __alloc_heap_pages(zone_lo, zone_hi, PAGE_CACHE_BATCH_ORDER,
+                            MEMF_node(cpu_to_node(cpu)) | MEMF_exact_node,
+                            NULL);
+    if ( pg == NULL )
+        return NULL;
 
-    if ( tainted )
-        reserve_offlined_page(pg);
+    spin_lock(&pc->lock);
+    for ( i = 1; i < PAGE_CACHE_BATCH; i++ )
+    {
+        pg[i].u.free.need_tlbflush = 0;
+        page_list_add_tail(&pg[i], &pc->list);
+    }
+    pc->count += PAGE_CACHE_BATCH - 1;
+    spin_unlock(&pc->lock);
 
+    return pg;
+}
+
+/* Put a single page into the local page cache, if it belongs there. */
+static bool_t page_cache_free(struct page_info *pg)
+{
+    unsigned int cpu = smp_processor_id();
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    unsigned long x, y = pg->count_info;
+    bool_t drain;
+
+    if ( !page_cache_enabled || is_xen_heap_page(pg) ||
+         phys_to_nid(page_to_maddr(pg)) != cpu_to_node(cpu) )
+        return 0;
+
+    /*
+     * As in free_heap_pages(), count_info may be left non-zero.  Pages being
+     * offlined have to go back to the heap to be offlined.
+     */
+    do {
+        x = y;
+        if ( (x & PGC_state) != PGC_state_inuse )
+            return 0;
+    } while ( (y = cmpxchg(&pg->count_info, x, PGC_state_inuse)) != x );
+
+    /* If a page has no owner it will need no safety TLB flush. */
+    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+    if ( pg->u.free.need_tlbflush )
+        pg->tlbflush_timestamp = tlbflush_current_time();
+
+    /* This page is not a guest frame any more. */
+    page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
+    set_gpfn_from_mfn(page_to_mfn(pg), INVALID_M2P_ENTRY);
+
+    spin_lock(&pc->lock);
+    page_list_add(pg, &pc->list);
+    drain = (++pc->count > PAGE_CACHE_HIGH);
+    spin_unlock(&pc->lock);
+
+    if ( drain )
+        page_cache_drain(pc, PAGE_CACHE_BATCH);
+
+    return 1;
+}
+
+static int cpu_page_cache_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        spin_lock_init(&pc->lock);
+        INIT_PAGE_LIST_HEAD(&pc->list);
+        pc->count = 0;
+        break;
+    case CPU_DEAD:
+        page_cache_drain(pc, UINT_MAX);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_page_cache_nfb = {
+    .notifier_call = cpu_page_cache_callback
+};
+
+static int __init page_cache_init(void)
+{
+    void *hcpu = (void *)(long)smp_processor_id();
+
+    cpu_page_cache_callback(&cpu_page_cache_nfb, CPU_UP_PREPARE, hcpu);
+    register_cpu_notifier(&cpu_page_cache_nfb);
+    page_cache_enabled = 1;
+
+    return 0;
+}
+presmp_initcall(page_cache_init);
+
+static struct page_info *alloc_heap_pages(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    struct domain *d)
+{
+    struct page_info *pg = __alloc_heap_pages(zone_lo, zone_hi, order,
+                                              memflags, d);
+
+    /*
+     * Memory sitting in page caches may satisfy the request.  Draining
+     * them is costly, and can only form blocks larger than a cache refill
+     * if most free memory is cached, so leave them alone for higher order
+     * requests (which callers like populate_physmap expect to fail cheaply)
+     * unless memory is low.
+     */
+    if ( pg == NULL &&
+         (order <= PAGE_CACHE_BATCH_ORDER ||
+          total_avail_pages < page_cache_pages()) &&
+         page_cache_drain_all() )
+        pg = __alloc_heap_pages(zone_lo, zone_hi, order, memflags, d);
+
+    return pg;
+}
+
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order, bool_t need_scrub)
+{
+    /* Pages to scrub go to the heap, for the idle scrubber to find them. */
+    if ( order == 0 && !need_scrub && page_cache_free(pg) )
+        return;
+
+    spin_lock(&heap_lock);
+    __free_heap_pages(pg, order, need_scrub);
     spin_unlock(&heap_lock);
 }
 
@@ -1120,6 +1518,9 @@ int offline_page(unsigned long mfn, int broken, uint32_t *status)
         return 0;
     }
 
+    /* A free page can only be offlined right away from the heap. */
+    page_cache_drain_all();
+
     spin_lock(&heap_lock);
 
     old_info = mark_page_offline(pg, broken);
@@ -1231,7 +1632,7 @@ unsigned int online_page(unsigned long mfn, uint32_t *status)
     spin_unlock(&heap_lock);
 
     if ( (y & PGC_state) == PGC_state_offlined )
-        free_heap_pages(pg, 0);
+        free_heap_pages(pg, 0, !!(y & PGC_need_scrub));
 
     return ret;
 }
@@ -1300,7 +1701,7 @@ static void init_heap_pages(
             nr_pages -= n;
         }
 
-        free_heap_pages(pg+i, 0);
+        free_heap_pages(pg+i, 0, 0);
     }
 }
 
@@ -1327,7 +1728,18 @@ static unsigned long avail_heap_pages(
 
 unsigned long total_free_pages(void)
 {
-    return total_avail_pages - midsize_alloc_zone_pages;
+    return total_avail_pages + page_cache_pages() - midsize_alloc_zone_pages;
+}
+
+unsigned long total_scrub_pages(void)
+{
+    unsigned long pages = 0;
+    unsigned int node;
+
+    for_each_online_node ( node )
+        pages += node_need_scrub[node];
+
+    return pages;
 }
 
 void __init end_boot_allocator(void)
@@ -1450,6 +1862,9 @@ void __init scrub_heap_pages(void)
     if ( !opt_bootscrub )
         return;
 
+    /* Cached pages came from the heap unscrubbed. */
+    page_cache_drain_all();
+
     cpumask_clear(&all_worker_cpus);
     /* Scrub block size. */
     chunk_size = opt_bootscrub_chunk >> PAGE_SHIFT;
@@ -1570,6 +1985,138 @@ void __init scrub_heap_pages(void)
     setup_low_mem_virq();
 }
 
+/*
+ * Take a dirty buddy off the free lists of node, and split it down to at
+ * most 2^SCRUB_CHUNK_ORDER pages around its first dirty page.  The pages of
+ * the chunk are marked in use while they're scrubbed: this keeps the
+ * allocator and merges away, and makes offline_page() leave them offlining
+ * for scrub_free_pages() to offline when it frees them again.  They're also
+ * taken out of the avail counts meanwhile, so that the allocator doesn't
+ * count on pages it can't find.
+ */
+static struct page_info *get_dirty_chunk(
+    unsigned int node, unsigned int *pzone, unsigned int *porder)
+{
+    unsigned int zone, order, first_dirty, i;
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    for ( zone = 0; zone < NR_ZONES; zone++ )
+        for ( order = 0; order <= MAX_ORDER; order++ )
+        {
+            if ( page_list_empty(&heap(node, zone, order)) )
+                continue;
+            /* Dirty buddies are at the tail. */
+            pg = page_list_last(&heap(node, zone, order));
+            if ( pg->u.free.first_dirty != INVALID_DIRTY_IDX )
+                goto found;
+        }
+
+    return NULL;
+
+ found:
+    page_list_del(pg, &heap(node, zone, order));
+    first_dirty = pg->u.free.first_dirty;
+
+    while ( order > SCRUB_CHUNK_ORDER )
+    {
+        order--;
+        if ( first_dirty >= (1U << order) )
+        {
+            page_list_add_scrub(pg, node, zone, order, INVALID_DIRTY_IDX);
+            pg += 1 << order;
+            first_dirty -= 1 << order;
+        }
+        else
+            page_list_add_scrub(pg + (1 << order), node, zone, order, 0);
+    }
+
+    for ( i = 0; i < (1U << order); i++ )
+        pg[i].count_info = (pg[i].count_info & ~PGC_state) | PGC_state_inuse;
+
+    ASSERT(avail[node][zone] >= (1UL << order));
+    avail[node][zone] -= 1UL << order;
+    total_avail_pages -= 1UL << order;
+    ASSERT(total_avail_pages >= 0);
+
+    *pzone = zone;
+    *porder = order;
+
+    return pg;
+}
+
+/*
+ * Scrub free pages of the local node, or of a node without cpus of its own,
+ * a chunk at a time until there's other work to do.  Called by idle vcpus:
+ * returns true if there may be more to scrub.
+ */
+bool scrub_free_pages(void)
+{
+    unsigned int cpu = smp_processor_id();
+    unsigned int node = cpu_to_node(cpu), zone, order, i;
+    unsigned long cnt;
+    struct page_info *pg;
+    bool_t tainted;
+
+    if ( !node_need_scrub[node] )
+    {
+        for_each_online_node ( node )
+            if ( node_need_scrub[node] &&
+                 cpumask_empty(&node_to_cpumask(node)) )
+                break;
+        if ( node >= MAX_NUMNODES )
+            return false;
+    }
+
+    do {
+        spin_lock(&heap_lock);
+        pg = get_dirty_chunk(node, &zone, &order);
+        spin_unlock(&heap_lock);
+
+        /* Other cpus have the rest in hand. */
+        if ( !pg )
+            return false;
+
+        for ( i = cnt = 0; i < (1U << order); i++ )
+            if ( test_and_clear_bit(_PGC_need_scrub, &pg[i].count_info) )
+            {
+                scrub_one_page(&pg[i]);
+                cnt++;
+            }
+
+        spin_lock(&heap_lock);
+
+        ASSERT(node_need_scrub[node] >= cnt);
+        node_need_scrub[node] -= cnt;
+
+        for ( i = 0, tainted = 0; i < (1U << order); i++ )
+        {
+            if ( page_state_is(&pg[i], offlining) )
+            {
+                pg[i].count_info = (pg[i].count_info & ~PGC_state) |
+                                   PGC_state_offlined;
+                tainted = 1;
+            }
+            else
+                pg[i].count_info = (pg[i].count_info & ~PGC_state) |
+                                   PGC_state_free;
+        }
+
+        /* Before reserve_offlined_page() takes offlined pages out again. */
+        avail[node][zone] += 1UL << order;
+        total_avail_pages += 1UL << order;
+
+        pg = merge_free_buddy(pg, node, zone, order, INVALID_DIRTY_IDX);
+        if ( tainted )
+            reserve_offlined_page(pg);
+
+        spin_unlock(&heap_lock);
+    } while ( node_need_scrub[node] && !softirq_pending(cpu) );
+
+    return node_need_scrub[node] != 0;
+}
+
 
 
 /*************************
@@ -1626,7 +2173,7 @@ void free_xenheap_pages(void *v, unsigned int order)
 
     memguard_guard_range(v, 1 << (order + PAGE_SHIFT));
 
-    free_heap_pages(virt_to_page(v), order);
+    free_heap_pages(virt_to_page(v), order, 0);
 }
 
 #else
@@ -1685,7 +2232,7 @@ void free_xenheap_pages(void *v, unsigned int order)
         pg[i].count_info &= ~PGC_xen_heap;
     }
 
-    free_heap_pages(pg, order);
+    free_heap_pages(pg, order, 0);
 }
 
 #endif
@@ -1794,7 +2341,7 @@ struct page_info *alloc_domheap_pages(
     if ( d && !(memflags & MEMF_no_owner) &&
          assign_pages(d, pg, order, memflags) )
     {
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, 0);
         return NULL;
     }
     
@@ -1862,11 +2409,7 @@ void free_domheap_pages(struct page_info *pg, unsigned int order)
             scrub = 1;
         }
 
-        if ( unlikely(scrub) )
-            for ( i = 0; i < (1 << order); i++ )
-                scrub_one_page(&pg[i]);
-
-        free_heap_pages(pg, order);
+        free_heap_pages(pg, order, scrub);
     }
 
     if ( drop_dom_ref )
@@ -1925,6 +2468,10 @@ static void pagealloc_info(unsigned char key)
     }
 
     printk("    Dom heap: %lukB free\n", total << (PAGE_SHIFT-10));
+    printk("    Page caches: %lukB free\n",
+           page_cache_pages() << (PAGE_SHIFT-10));
+    printk("    Dirty: %lukB free, waiting to be scrubbed\n",
+           total_scrub_pages() << (PAGE_SHIFT-10));
 }
 
 static __init int pagealloc_keyhandler_init(void)
@@ -1964,6 +2511,8 @@ static void dump_heap(unsigned char key)
         for ( j = 0; j < NR_ZONES; j++ )
             printk("heap[node=%d][zone=%d] -> %lu pages\n",
                    i, j, avail[i][j]);
+        printk("heap[node=%d] -> %lu pages need scrubbing\n",
+               i, node_need_scrub[i]);
     }
 }
 
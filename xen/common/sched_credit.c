@@ -715,7 +715,8 @@ __csched_vcpu_is_migrateable(struct vcpu *vc, int dest_cpu, cpumask_t *mask)
      */
     return !vc->is_running &&
            !__csched_vcpu_is_cache_hot(vc) &&
-           cpumask_test_cpu(dest_cpu, mask);
+           cpumask_test_cpu(dest_cpu, mask) &&
+           sched_core_allowed(dest_cpu, vc);
 }
 
 static int
@@ -1834,6 +1835,7 @@ csched_schedule(
          && prv->ratelimit_us
          && vcpu_runnable(current)
          && !is_idle_vcpu(current)
+         && sched_core_allowed(cpu, current)
          && runtime < MICROSECS(prv->ratelimit_us) )
     {
         snext = scurr;
@@ -1877,6 +1879,13 @@ csched_schedule(
     snext = __runq_elem(runq->next);
     ret.migrated = 0;
 
+    /*
+     * Skip what our sibling threads won't let us run.  The idle vcpu is
+     * always on the runq when not running, and is always allowed.
+     */
+    while ( !sched_core_allowed(cpu, snext->vcpu) )
+        snext = __runq_elem(snext->runq_elem.next);
+
     /* Tasklet work (which runs in idle VCPU context) overrides all else. */
     if ( tasklet_work_scheduled )
     {
@@ -2173,6 +2182,7 @@ static const struct scheduler sched_credit_def = {
     .opt_name       = "credit",
     .sched_id       = XEN_SCHEDULER_CREDIT,
     .sched_data     = NULL,
+    .cosched        = 1,
 
     .init_domain    = csched_dom_init,
     .destroy_domain = csched_dom_destroy,
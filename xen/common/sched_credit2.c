@@ -57,6 +57,7 @@
 #define TRC_CSCHED2_RUNQ_CANDIDATE   TRC_SCHED_CLASS_EVT(CSCHED2, 20)
 #define TRC_CSCHED2_SCHEDULE         TRC_SCHED_CLASS_EVT(CSCHED2, 21)
 #define TRC_CSCHED2_RATELIMIT        TRC_SCHED_CLASS_EVT(CSCHED2, 22)
+#define TRC_CSCHED2_MIGRATE_COST     TRC_SCHED_CLASS_EVT(CSCHED2, 23)
 
 /*
  * WARNING: This is still in an experimental phase.  Status and work can be found at the
@@ -194,6 +195,27 @@
 static unsigned int __read_mostly opt_migrate_resist = 500;
 integer_param("sched_credit2_migrate_resist", opt_migrate_resist);
 
+/*
+ * Cache hotness: for how long (in microseconds) after it last ran a vcpu is
+ * assumed to still have (part of) its working set in the cache it ran on.
+ * We can't measure that, so hotness is taken to decay linearly over this
+ * period, from CSCHED2_HOT_MAX down to 0.
+ */
+static unsigned int __read_mostly opt_cache_hot_us = 1000;
+integer_param("sched_credit2_cache_hot_us", opt_cache_hot_us);
+#define CSCHED2_CACHE_HOT            ((opt_cache_hot_us)*MICROSECS(1))
+#define CSCHED2_HOT_SHIFT            10
+#define CSCHED2_HOT_MAX              (1U << CSCHED2_HOT_SHIFT)
+
+/*
+ * Cost of moving a fully cache hot vcpu to a runqueue with a different last
+ * level cache, as a percentage of the load of one always running vcpu. The
+ * load balancer only moves vcpus across LLCs if that improves the balance
+ * by more than the (hotness scaled) cost.
+ */
+static unsigned int __read_mostly opt_llc_migrate_cost = 25;
+integer_param("sched_credit2_llc_migrate_cost", opt_llc_migrate_cost);
+
 /*
  * Useful macros
  */
@@ -303,6 +325,11 @@ integer_param("credit2_balance_over", opt_overload_balance_tolerance);
  *             core of the host. This will happen if the opt_runqueue
  *             parameter is set to 'core';
  *
+ * - per-LLC: meaning that there will be one runqueue per each last level
+ *            cache of the host (which may be shared by all the cores of a
+ *            socket, or only by some of them). This will happen if the
+ *            opt_runqueue parameter is set to 'llc';
+ *
  * - per-socket: meaning that there will be one runqueue per each physical
  *               socket (AKA package, which often, but not always, also
  *               matches a NUMA node) of the host; This will happen if
@@ -317,15 +344,18 @@ integer_param("credit2_balance_over", opt_overload_balance_tolerance);
  *           the opt_runqueue parameter is set to 'all'.
  *
  * Depending on the value of opt_runqueue, therefore, cpus that are part of
- * either the same physical core, the same physical socket, the same NUMA
- * node, or just all of them, will be put together to form runqueues.
+ * either the same physical core, the same last level cache, the same
+ * physical socket, the same NUMA node, or just all of them, will be put
+ * together to form runqueues.
  */
 #define OPT_RUNQUEUE_CORE   0
-#define OPT_RUNQUEUE_SOCKET 1
-#define OPT_RUNQUEUE_NODE   2
-#define OPT_RUNQUEUE_ALL    3
+#define OPT_RUNQUEUE_LLC    1
+#define OPT_RUNQUEUE_SOCKET 2
+#define OPT_RUNQUEUE_NODE   3
+#define OPT_RUNQUEUE_ALL    4
 static const char *const opt_runqueue_str[] = {
     [OPT_RUNQUEUE_CORE] = "core",
+    [OPT_RUNQUEUE_LLC] = "llc",
     [OPT_RUNQUEUE_SOCKET] = "socket",
     [OPT_RUNQUEUE_NODE] = "node",
     [OPT_RUNQUEUE_ALL] = "all"
@@ -357,6 +387,7 @@ struct csched2_runqueue_data {
 
     spinlock_t lock;      /* Lock for this runqueue. */
     cpumask_t active;      /* CPUs enabled for this runqueue */
+    unsigned int llc;      /* LLC of all the CPUs, or CSCHED2_LLC_MIXED */
 
     struct list_head runq; /* Ordered list of runnable vms */
     struct list_head svc;  /* List of all vcpus assigned to this runqueue */
@@ -371,6 +402,9 @@ struct csched2_runqueue_data {
     s_time_t b_avgload;         /* Decaying queue load modified by balancing */
 };
 
+/* The CPUs of a runqueue don't all share the same last level cache. */
+#define CSCHED2_LLC_MIXED (~0U)
+
 /*
  * System-wide private data
  */
@@ -1481,6 +1515,40 @@ csched2_context_saved(const struct scheduler *ops, struct vcpu *vc)
     vcpu_schedule_unlock_irq(lock, vc);
 }
 
+/*
+ * How hot svc's cache footprint is likely to still be, on the pcpu where it
+ * last ran: CSCHED2_HOT_MAX if it is running, down to 0 once it has not run
+ * for CSCHED2_CACHE_HOT.
+ */
+static unsigned int vcpu_hotness(const struct csched2_vcpu *svc, s_time_t now)
+{
+    s_time_t idle;
+
+    if ( svc->flags & CSFLAG_scheduled )
+        return CSCHED2_HOT_MAX;
+
+    idle = now - (s_time_t)svc->vcpu->last_run_time;
+    if ( idle >= CSCHED2_CACHE_HOT )
+        return 0;
+    if ( idle <= 0 )
+        return CSCHED2_HOT_MAX;
+
+    return CSCHED2_HOT_MAX -
+           ((idle << CSCHED2_HOT_SHIFT) / CSCHED2_CACHE_HOT);
+}
+
+static inline bool_t same_llc(const struct csched2_runqueue_data *a,
+                              const struct csched2_runqueue_data *b)
+{
+    return a->llc == b->llc && a->llc != CSCHED2_LLC_MIXED;
+}
+
+/* Cost, in load units, of moving a fully hot vcpu to a different LLC. */
+static inline s_time_t llc_migrate_cost(const struct csched2_private *prv)
+{
+    return ((s_time_t)opt_llc_migrate_cost << prv->load_precision_shift) / 100;
+}
+
 #define MAX_LOAD (STIME_MAX);
 static int
 csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
@@ -1488,6 +1556,7 @@ csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
     struct csched2_private *prv = CSCHED2_PRIV(ops);
     int i, min_rqi = -1, new_cpu;
     struct csched2_vcpu *svc = CSCHED2_VCPU(vc);
+    s_time_t cost = 0;
     s_time_t min_avgload = MAX_LOAD;
 
     ASSERT(!cpumask_empty(&prv->active_queues));
@@ -1542,6 +1611,14 @@ csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
         /* Fall-through to normal cpu pick */
     }
 
+    /*
+     * Going to a runqueue with a different LLC means refilling the cache
+     * there, so account for that as extra load on such runqueues.
+     */
+    if ( svc->rqd != NULL )
+        cost = (llc_migrate_cost(prv) * vcpu_hotness(svc, NOW())) >>
+               CSCHED2_HOT_SHIFT;
+
     /* Find the runqueue with the lowest average load. */
     for_each_cpu(i, &prv->active_queues)
     {
@@ -1571,7 +1648,11 @@ csched2_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
         else if ( spin_trylock(&rqd->lock) )
         {
             if ( cpumask_intersects(vc->cpu_hard_affinity, &rqd->active) )
+            {
                 rqd_avgload = rqd->b_avgload;
+                if ( svc->rqd != NULL && !same_llc(rqd, svc->rqd) )
+                    rqd_avgload += cost;
+            }
 
             spin_unlock(&rqd->lock);
         }
@@ -1628,13 +1709,21 @@ typedef struct {
     /* NB: Read by consider() */
     struct csched2_runqueue_data *lrqd;
     struct csched2_runqueue_data *orqd;                  
+    s_time_t now;
+    s_time_t llc_cost;  /* Cost of moving a hot vcpu, 0 if same LLC */
 } balance_state_t;
 
+static inline s_time_t svc_migrate_cost(const balance_state_t *st,
+                                        const struct csched2_vcpu *svc)
+{
+    return (st->llc_cost * vcpu_hotness(svc, st->now)) >> CSCHED2_HOT_SHIFT;
+}
+
 static void consider(balance_state_t *st, 
                      struct csched2_vcpu *push_svc,
                      struct csched2_vcpu *pull_svc)
 {
-    s_time_t l_load, o_load, delta;
+    s_time_t l_load, o_load, delta, cost = 0;
 
     l_load = st->lrqd->b_avgload;
     o_load = st->orqd->b_avgload;
@@ -1643,18 +1732,23 @@ static void consider(balance_state_t *st,
         /* What happens to the load on both if we push? */
         l_load -= push_svc->avgload;
         o_load += push_svc->avgload;
+        cost += svc_migrate_cost(st, push_svc);
     }
     if ( pull_svc )
     {
         /* What happens to the load on both if we pull? */
         l_load += pull_svc->avgload;
         o_load -= pull_svc->avgload;
+        cost += svc_migrate_cost(st, pull_svc);
     }
 
     delta = l_load - o_load;
     if ( delta < 0 )
         delta = -delta;
 
+    /* Moving across LLCs must improve the balance by more than it costs. */
+    delta += cost;
+
     if ( delta < st->load_delta )
     {
         st->load_delta = delta;
@@ -1723,6 +1817,32 @@ static void migrate(const struct scheduler *ops,
     }
 }
 
+static void trace_migrate_cost(const balance_state_t *st,
+                               const struct csched2_vcpu *svc,
+                               const struct csched2_runqueue_data *trqd)
+{
+    if ( unlikely(tb_init_done) )
+    {
+        struct {
+            unsigned vcpu:16, dom:16;
+            unsigned rqi:16, trqi:16;
+            unsigned hotness:16, cross_llc:16;
+            unsigned load_delta, cost;
+        } d;
+        d.dom = svc->vcpu->domain->domain_id;
+        d.vcpu = svc->vcpu->vcpu_id;
+        d.rqi = svc->rqd->id;
+        d.trqi = trqd->id;
+        d.hotness = vcpu_hotness(svc, st->now);
+        d.cross_llc = st->llc_cost != 0;
+        d.load_delta = st->load_delta;
+        d.cost = svc_migrate_cost(st, svc);
+        __trace_var(TRC_CSCHED2_MIGRATE_COST, 1,
+                    sizeof(d),
+                    (unsigned char *)&d);
+    }
+}
+
 /*
  * It makes sense considering migrating svc to rqd, if:
  *  - svc is not already flagged to migrate,
@@ -1741,8 +1861,10 @@ static void balance_load(const struct scheduler *ops, int cpu, s_time_t now)
     int i, max_delta_rqi = -1;
     struct list_head *push_iter, *pull_iter;
     bool_t inner_load_updated = 0;
+    s_time_t max_delta;
 
-    balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL };
+    balance_state_t st = { .best_push_svc = NULL, .best_pull_svc = NULL,
+                           .now = now };
 
     /*
      * Basic algorithm: Push, pull, or swap.
@@ -1761,10 +1883,11 @@ retry:
         return;
 
     st.load_delta = 0;
+    max_delta = 0;
 
     for_each_cpu(i, &prv->active_queues)
     {
-        s_time_t delta;
+        s_time_t delta, eff_delta;
         
         st.orqd = prv->rqd + i;
 
@@ -1778,8 +1901,18 @@ retry:
         if ( delta < 0 )
             delta = -delta;
 
-        if ( delta > st.load_delta )
+        /*
+         * Prefer evening out load within an LLC: an imbalance with a
+         * runqueue behind another LLC counts less, by the cost of moving
+         * a cache hot vcpu there.
+         */
+        eff_delta = delta;
+        if ( !same_llc(st.lrqd, st.orqd) )
+            eff_delta -= llc_migrate_cost(prv);
+
+        if ( eff_delta > max_delta )
         {
+            max_delta = eff_delta;
             st.load_delta = delta;
             max_delta_rqi = i;
         }
@@ -1848,6 +1981,8 @@ retry:
     if ( unlikely(st.orqd->id < 0) )
         goto out_up;
 
+    st.llc_cost = same_llc(st.lrqd, st.orqd) ? 0 : llc_migrate_cost(prv);
+
     if ( unlikely(tb_init_done) )
     {
         struct {
@@ -1908,9 +2043,15 @@ retry:
 
     /* OK, now we have some candidates; do the moving */
     if ( st.best_push_svc )
+    {
+        trace_migrate_cost(&st, st.best_push_svc, st.orqd);
         migrate(ops, st.best_push_svc, st.orqd, now);
+    }
     if ( st.best_pull_svc )
+    {
+        trace_migrate_cost(&st, st.best_pull_svc, st.lrqd);
         migrate(ops, st.best_pull_svc, st.lrqd, now);
+    }
 
  out_up:
     spin_unlock(&st.orqd->lock);
@@ -2280,7 +2421,7 @@ runq_candidate(struct csched2_runqueue_data *rqd,
      * no point forcing it to do so until rate limiting expires.
      */
     if ( !yield && prv->ratelimit_us && !is_idle_vcpu(scurr->vcpu) &&
-         vcpu_runnable(scurr->vcpu) &&
+         vcpu_runnable(scurr->vcpu) && sched_core_allowed(cpu, scurr->vcpu) &&
          (now - scurr->vcpu->runstate.state_entry_time) <
           MICROSECS(prv->ratelimit_us) )
     {
@@ -2300,8 +2441,8 @@ runq_candidate(struct csched2_runqueue_data *rqd,
         return scurr;
     }
 
-    /* Default to current if runnable, idle otherwise */
-    if ( vcpu_runnable(scurr->vcpu) )
+    /* Default to current if runnable (and allowed), idle otherwise */
+    if ( vcpu_runnable(scurr->vcpu) && sched_core_allowed(cpu, scurr->vcpu) )
         snext = scurr;
     else
         snext = CSCHED2_VCPU(idle_vcpu[cpu]);
@@ -2317,6 +2458,13 @@ runq_candidate(struct csched2_runqueue_data *rqd,
             continue;
         }
 
+        /* Nor those our sibling threads won't let us run right now. */
+        if ( !sched_core_allowed(cpu, svc->vcpu) )
+        {
+            (*skipped)++;
+            continue;
+        }
+
         /*
          * If a vcpu is meant to be picked up by another processor, and such
          * processor has not scheduled yet, leave it in the runqueue for him.
@@ -2750,6 +2898,11 @@ static inline bool_t same_core(unsigned int cpua, unsigned int cpub)
            cpu_to_core(cpua) == cpu_to_core(cpub);
 }
 
+static inline bool_t share_llc(unsigned int cpua, unsigned int cpub)
+{
+    return cpu_to_llc(cpua) == cpu_to_llc(cpub);
+}
+
 static unsigned int
 cpu_to_runqueue(struct csched2_private *prv, unsigned int cpu)
 {
@@ -2784,6 +2937,7 @@ cpu_to_runqueue(struct csched2_private *prv, unsigned int cpu)
 
         if ( opt_runqueue == OPT_RUNQUEUE_ALL ||
              (opt_runqueue == OPT_RUNQUEUE_CORE && same_core(peer_cpu, cpu)) ||
+             (opt_runqueue == OPT_RUNQUEUE_LLC && share_llc(peer_cpu, cpu)) ||
              (opt_runqueue == OPT_RUNQUEUE_SOCKET && same_socket(peer_cpu, cpu)) ||
              (opt_runqueue == OPT_RUNQUEUE_NODE && same_node(peer_cpu, cpu)) )
             break;
@@ -2815,7 +2969,10 @@ init_pdata(struct csched2_private *prv, unsigned int cpu)
     {
         printk(XENLOG_INFO " First cpu on runqueue, activating\n");
         activate_runqueue(prv, rqi);
+        rqd->llc = cpu_to_llc(cpu);
     }
+    else if ( rqd->llc != cpu_to_llc(cpu) )
+        rqd->llc = CSCHED2_LLC_MIXED;
     
     /* Set the runqueue map */
     prv->runq_map[cpu] = rqi;
@@ -2961,12 +3118,16 @@ csched2_init(struct scheduler *ops)
            XENLOG_INFO " load_window_shift: %d\n"
            XENLOG_INFO " underload_balance_tolerance: %d\n"
            XENLOG_INFO " overload_balance_tolerance: %d\n"
-           XENLOG_INFO " runqueues arrangement: %s\n",
+           XENLOG_INFO " runqueues arrangement: %s\n"
+           XENLOG_INFO " cache_hot_us: %u\n"
+           XENLOG_INFO " llc_migrate_cost: %u\n",
            opt_load_precision_shift,
            opt_load_window_shift,
            opt_underload_balance_tolerance,
            opt_overload_balance_tolerance,
-           opt_runqueue_str[opt_runqueue]);
+           opt_runqueue_str[opt_runqueue],
+           opt_cache_hot_us,
+           opt_llc_migrate_cost);
 
     if ( opt_load_precision_shift < LOADAVG_PRECISION_SHIFT_MIN )
     {
@@ -3027,6 +3188,7 @@ static const struct scheduler sched_credit2_def = {
     .opt_name       = "credit2",
     .sched_id       = XEN_SCHEDULER_CREDIT2,
     .sched_data     = NULL,
+    .cosched        = 1,
 
     .init_domain    = csched2_dom_init,
     .destroy_domain = csched2_dom_destroy,
@@ -43,8 +43,8 @@
 /*
  * Design:
  *
- * This scheduler follows the Preemptive Global Earliest Deadline First (EDF)
- * theory in real-time field.
+ * This scheduler follows the Preemptive Earliest Deadline First (EDF)
+ * theory in real-time field, applied globally within each runqueue.
  * At any scheduling point, the VCPU with earlier deadline has higher priority.
  * The scheduler always picks highest priority VCPU to run on a feasible PCPU.
  * A PCPU is feasible if the VCPU can run on this PCPU and (the PCPU is idle or
@@ -63,24 +63,39 @@
  * When a VCPU has no task but with budget left, its budget is preserved.
  *
  * Queue scheme:
- * A global runqueue and a global depletedqueue for each CPU pool.
+ * The pCPUs of a CPU pool are grouped in runqueues, one per socket by
+ * default (see sched_rtds_runqueue below).  Each runqueue has a runqueue,
+ * a depletedqueue and a replenishment queue, for the VCPUs whose
+ * v->processor is one of its pCPUs.
  * The runqueue holds all runnable VCPUs with budget, sorted by deadline;
  * The depletedqueue holds all VCPUs without budget, unsorted;
+ * The replenishment queue holds all VCPUs with a pending replenishment,
+ * sorted by deadline, and has its own replenishment timer.
+ *
+ * A VCPU only moves to another runqueue when it would otherwise have to
+ * wait while a pCPU of its affinity is idle: such pCPU is tickled if
+ * nothing can be done locally, and steals work from other runqueues when
+ * its own has none.
  *
  * Note: cpumask and cpupool is supported.
  */
 
 /*
  * Locking:
- * A global system lock is used to protect the RunQ and DepletedQ.
- * The global lock is referenced by schedule_data.schedule_lock
- * from all physical cpus.
+ * Each runqueue has a lock, protecting its queues and the scheduling
+ * data of the VCPUs on it.  It is referenced by schedule_data.schedule_lock
+ * from all the physical cpus of the runqueue.
  *
  * The lock is already grabbed when calling wake/sleep/schedule/ functions
  * in schedule.c
  *
  * The functions involes RunQ and needs to grab locks are:
  *    vcpu_insert, vcpu_remove, context_saved, runq_insert
+ *
+ * The private lock protects the list of domains and the assignment of
+ * cpus to runqueues.  It nests outside of the runqueue locks.  A runqueue
+ * lock is only taken while holding another one with a trylock (when
+ * stealing).
  */
 
 
@@ -165,18 +180,61 @@
 static void repl_timer_handler(void *data);
 
 /*
- * System-wide private data, include global RunQueue/DepletedQ
- * Global lock is referenced by schedule_data.schedule_lock from all
- * physical cpus. It can be grabbed via vcpu_schedule_lock_irq()
+ * Runqueue organization: either one runqueue per socket (the default),
+ * or a single runqueue for all the cpus of the pool (i.e., global EDF).
  */
-struct rt_private {
-    spinlock_t lock;            /* the global coarse-grained lock */
-    struct list_head sdom;      /* list of availalbe domains, used for dump */
+#define OPT_RUNQUEUE_SOCKET 0
+#define OPT_RUNQUEUE_ALL    1
+static const char *const opt_runqueue_str[] = {
+    [OPT_RUNQUEUE_SOCKET] = "socket",
+    [OPT_RUNQUEUE_ALL] = "all"
+};
+static int __read_mostly opt_runqueue = OPT_RUNQUEUE_SOCKET;
+
+static void __init parse_rtds_runqueue(const char *s)
+{
+    unsigned int i;
+
+    for ( i = 0; i < ARRAY_SIZE(opt_runqueue_str); i++ )
+    {
+        if ( !strcmp(s, opt_runqueue_str[i]) )
+        {
+            opt_runqueue = i;
+            return;
+        }
+    }
+
+    printk("WARNING, unrecognized value of sched_rtds_runqueue option!\n");
+}
+custom_param("sched_rtds_runqueue", parse_rtds_runqueue);
+
+/*
+ * Per-runqueue data
+ * The lock is referenced by schedule_data.schedule_lock from all the
+ * physical cpus of the runqueue. It can be grabbed via
+ * vcpu_schedule_lock_irq()
+ */
+struct rt_runqueue {
+    int id;                     /* index in rt_private.rqd, -1 if unused */
+    spinlock_t lock;            /* lock for this runqueue */
+    cpumask_t cpus;             /* cpus assigned to this runqueue */
     struct list_head runq;      /* ordered list of runnable vcpus */
     struct list_head depletedq; /* unordered list of depleted vcpus */
     struct list_head replq;     /* ordered list of vcpus that need replenishment */
+    struct timer repl_timer;    /* replenishment timer */
+    const struct scheduler *ops; /* for the timer handler */
+};
+
+/*
+ * System-wide private data
+ */
+struct rt_private {
+    spinlock_t lock;            /* protects sdom and the runqueue layout */
+    struct list_head sdom;      /* list of availalbe domains, used for dump */
     cpumask_t tickled;          /* cpus been tickled */
-    struct timer *repl_timer;   /* replenishment timer */
+    cpumask_t active_queues;    /* runqueues with cpus assigned */
+    int runq_map[NR_CPUS];      /* runqueue of each cpu */
+    struct rt_runqueue rqd[NR_CPUS];
 };
 
 /*
@@ -228,19 +286,19 @@ static inline struct rt_dom *rt_dom(const struct domain *dom)
     return dom->sched_priv;
 }
 
-static inline struct list_head *rt_runq(const struct scheduler *ops)
+static inline struct rt_runqueue *rt_rqd(const struct scheduler *ops,
+                                         unsigned int cpu)
 {
-    return &rt_priv(ops)->runq;
-}
+    struct rt_private *prv = rt_priv(ops);
 
-static inline struct list_head *rt_depletedq(const struct scheduler *ops)
-{
-    return &rt_priv(ops)->depletedq;
+    return &prv->rqd[prv->runq_map[cpu]];
 }
 
-static inline struct list_head *rt_replq(const struct scheduler *ops)
+/* The runqueue a vcpu is on is the one of its processor. */
+static inline struct rt_runqueue *vcpu_rqd(const struct scheduler *ops,
+                                           const struct rt_vcpu *svc)
 {
-    return &rt_priv(ops)->replq;
+    return rt_rqd(ops, svc->vcpu->processor);
 }
 
 /*
@@ -319,51 +377,63 @@ rt_dump_vcpu(const struct scheduler *ops, const struct rt_vcpu *svc)
 static void
 rt_dump_pcpu(const struct scheduler *ops, int cpu)
 {
-    struct rt_private *prv = rt_priv(ops);
+    spinlock_t *lock;
     unsigned long flags;
 
-    spin_lock_irqsave(&prv->lock, flags);
+    lock = pcpu_schedule_lock_irqsave(cpu, &flags);
     rt_dump_vcpu(ops, rt_vcpu(curr_on_cpu(cpu)));
-    spin_unlock_irqrestore(&prv->lock, flags);
+    pcpu_schedule_unlock_irqrestore(lock, flags, cpu);
 }
 
 static void
 rt_dump(const struct scheduler *ops)
 {
-    struct list_head *runq, *depletedq, *replq, *iter;
+    struct list_head *iter;
     struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd;
     struct rt_vcpu *svc;
     struct rt_dom *sdom;
     unsigned long flags;
+    unsigned int rqi;
 
     spin_lock_irqsave(&prv->lock, flags);
 
     if ( list_empty(&prv->sdom) )
         goto out;
 
-    runq = rt_runq(ops);
-    depletedq = rt_depletedq(ops);
-    replq = rt_replq(ops);
-
-    printk("Global RunQueue info:\n");
-    list_for_each ( iter, runq )
+    for_each_cpu ( rqi, &prv->active_queues )
     {
-        svc = q_elem(iter);
-        rt_dump_vcpu(ops, svc);
-    }
+        rqd = prv->rqd + rqi;
 
-    printk("Global DepletedQueue info:\n");
-    list_for_each ( iter, depletedq )
-    {
-        svc = q_elem(iter);
-        rt_dump_vcpu(ops, svc);
-    }
+        /* We need the lock to scan the runqueues. */
+        spin_lock(&rqd->lock);
 
-    printk("Global Replenishment Events info:\n");
-    list_for_each ( iter, replq )
-    {
-        svc = replq_elem(iter);
-        rt_dump_vcpu(ops, svc);
+        cpulist_scnprintf(keyhandler_scratch, sizeof(keyhandler_scratch),
+                          &rqd->cpus);
+        printk("Runqueue %d (cpus %s):\n", rqi, keyhandler_scratch);
+
+        printk("RunQueue info:\n");
+        list_for_each ( iter, &rqd->runq )
+        {
+            svc = q_elem(iter);
+            rt_dump_vcpu(ops, svc);
+        }
+
+        printk("DepletedQueue info:\n");
+        list_for_each ( iter, &rqd->depletedq )
+        {
+            svc = q_elem(iter);
+            rt_dump_vcpu(ops, svc);
+        }
+
+        printk("Replenishment Events info:\n");
+        list_for_each ( iter, &rqd->replq )
+        {
+            svc = replq_elem(iter);
+            rt_dump_vcpu(ops, svc);
+        }
+
+        spin_unlock(&rqd->lock);
     }
 
     printk("Domain info:\n");
@@ -376,8 +446,12 @@ rt_dump(const struct scheduler *ops)
 
         for_each_vcpu ( sdom->dom, v )
         {
+            spinlock_t *lock = vcpu_schedule_lock(v);
+
             svc = rt_vcpu(v);
             rt_dump_vcpu(ops, svc);
+
+            vcpu_schedule_unlock(lock, v);
         }
     }
 
@@ -484,8 +558,8 @@ q_remove(struct rt_vcpu *svc)
 static inline void
 replq_remove(const struct scheduler *ops, struct rt_vcpu *svc)
 {
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *replq = rt_replq(ops);
+    struct rt_runqueue *rqd = vcpu_rqd(ops, svc);
+    struct list_head *replq = &rqd->replq;
 
     ASSERT( vcpu_on_replq(svc) );
 
@@ -500,10 +574,10 @@ replq_remove(const struct scheduler *ops, struct rt_vcpu *svc)
         if ( !list_empty(replq) )
         {
             struct rt_vcpu *svc_next = replq_elem(replq->next);
-            set_timer(prv->repl_timer, svc_next->cur_deadline);
+            set_timer(&rqd->repl_timer, svc_next->cur_deadline);
         }
         else
-            stop_timer(prv->repl_timer);
+            stop_timer(&rqd->repl_timer);
     }
 }
 
@@ -515,25 +589,23 @@ replq_remove(const struct scheduler *ops, struct rt_vcpu *svc)
 static void
 runq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
 {
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *runq = rt_runq(ops);
+    struct rt_runqueue *rqd = vcpu_rqd(ops, svc);
 
-    ASSERT( spin_is_locked(&prv->lock) );
+    ASSERT( spin_is_locked(&rqd->lock) );
     ASSERT( !vcpu_on_q(svc) );
     ASSERT( vcpu_on_replq(svc) );
 
     /* add svc to runq if svc still has budget */
     if ( svc->cur_budget > 0 )
-        deadline_runq_insert(svc, &svc->q_elem, runq);
+        deadline_runq_insert(svc, &svc->q_elem, &rqd->runq);
     else
-        list_add(&svc->q_elem, &prv->depletedq);
+        list_add(&svc->q_elem, &rqd->depletedq);
 }
 
 static void
 replq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
 {
-    struct list_head *replq = rt_replq(ops);
-    struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd = vcpu_rqd(ops, svc);
 
     ASSERT( !vcpu_on_replq(svc) );
 
@@ -541,8 +613,8 @@ replq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
      * The timer may be re-programmed if svc is inserted
      * at the front of the event list.
      */
-    if ( deadline_replq_insert(svc, &svc->replq_elem, replq) )
-        set_timer(prv->repl_timer, svc->cur_deadline);
+    if ( deadline_replq_insert(svc, &svc->replq_elem, &rqd->replq) )
+        set_timer(&rqd->repl_timer, svc->cur_deadline);
 }
 
 /*
@@ -554,7 +626,8 @@ replq_insert(const struct scheduler *ops, struct rt_vcpu *svc)
 static void
 replq_reinsert(const struct scheduler *ops, struct rt_vcpu *svc)
 {
-    struct list_head *replq = rt_replq(ops);
+    struct rt_runqueue *rqd = vcpu_rqd(ops, svc);
+    struct list_head *replq = &rqd->replq;
     struct rt_vcpu *rearm_svc = svc;
     bool_t rearm = 0;
 
@@ -579,7 +652,7 @@ replq_reinsert(const struct scheduler *ops, struct rt_vcpu *svc)
         rearm = deadline_replq_insert(svc, &svc->replq_elem, replq);
 
     if ( rearm )
-        set_timer(rt_priv(ops)->repl_timer, rearm_svc->cur_deadline);
+        set_timer(&rqd->repl_timer, rearm_svc->cur_deadline);
 }
 
 /*
@@ -611,82 +684,149 @@ rt_cpu_pick(const struct scheduler *ops, struct vcpu *vc)
 static int
 rt_init(struct scheduler *ops)
 {
-    int rc = -ENOMEM;
     struct rt_private *prv = xzalloc(struct rt_private);
+    unsigned int i;
 
     printk("Initializing RTDS scheduler\n"
            "WARNING: This is experimental software in development.\n"
            "Use at your own risk.\n");
+    printk(XENLOG_INFO " runqueues arrangement: %s\n",
+           opt_runqueue_str[opt_runqueue]);
 
     if ( prv == NULL )
-        goto err;
-
-    prv->repl_timer = xzalloc(struct timer);
-    if ( prv->repl_timer == NULL )
-        goto err;
+        return -ENOMEM;
 
     spin_lock_init(&prv->lock);
     INIT_LIST_HEAD(&prv->sdom);
-    INIT_LIST_HEAD(&prv->runq);
-    INIT_LIST_HEAD(&prv->depletedq);
-    INIT_LIST_HEAD(&prv->replq);
 
     cpumask_clear(&prv->tickled);
 
-    ops->sched_data = prv;
-    rc = 0;
-
- err:
-    if ( rc && prv )
+    for ( i = 0; i < nr_cpu_ids; i++ )
     {
-        xfree(prv->repl_timer);
-        xfree(prv);
+        prv->runq_map[i] = -1;
+        prv->rqd[i].id = -1;
     }
 
-    return rc;
+    ops->sched_data = prv;
+
+    return 0;
 }
 
 static void
 rt_deinit(struct scheduler *ops)
 {
     struct rt_private *prv = rt_priv(ops);
+    unsigned int i;
 
-    ASSERT(prv->repl_timer->status == TIMER_STATUS_invalid ||
-           prv->repl_timer->status == TIMER_STATUS_killed);
-    xfree(prv->repl_timer);
+    for ( i = 0; i < nr_cpu_ids; i++ )
+        ASSERT(prv->rqd[i].repl_timer.status == TIMER_STATUS_invalid ||
+               prv->rqd[i].repl_timer.status == TIMER_STATUS_killed);
 
     ops->sched_data = NULL;
     xfree(prv);
 }
 
+static unsigned int
+cpu_to_runqueue(const struct rt_private *prv, unsigned int cpu)
+{
+    unsigned int rqi;
+
+    for ( rqi = 0; rqi < nr_cpu_ids; rqi++ )
+    {
+        unsigned int peer_cpu;
+
+        /*
+         * As soon as we come across an unused runqueue, use it: either
+         * this is the first cpu (possibly the boot cpu, for which the
+         * topology isn't known yet), or no runqueue with a matching
+         * topology exists.
+         */
+        if ( prv->rqd[rqi].id == -1 )
+            break;
+
+        peer_cpu = cpumask_first(&prv->rqd[rqi].cpus);
+        BUG_ON(cpu_to_socket(cpu) == XEN_INVALID_SOCKET_ID ||
+               cpu_to_socket(peer_cpu) == XEN_INVALID_SOCKET_ID);
+
+        if ( opt_runqueue == OPT_RUNQUEUE_ALL ||
+             cpu_to_socket(peer_cpu) == cpu_to_socket(cpu) )
+            break;
+    }
+
+    /* We really expect to be able to assign each cpu to a runqueue. */
+    BUG_ON(rqi >= nr_cpu_ids);
+
+    return rqi;
+}
+
+/* Assign cpu to a runqueue, activating the runqueue if necessary. */
+static struct rt_runqueue *
+init_pdata(const struct scheduler *ops, unsigned int cpu)
+{
+    struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd;
+    unsigned int rqi;
+
+    ASSERT(spin_is_locked(&prv->lock));
+
+    rqi = cpu_to_runqueue(prv, cpu);
+    rqd = prv->rqd + rqi;
+
+    if ( rqd->id == -1 )
+    {
+        rqd->id = rqi;
+        rqd->ops = ops;
+        spin_lock_init(&rqd->lock);
+        cpumask_clear(&rqd->cpus);
+        INIT_LIST_HEAD(&rqd->runq);
+        INIT_LIST_HEAD(&rqd->depletedq);
+        INIT_LIST_HEAD(&rqd->replq);
+        __cpumask_set_cpu(rqi, &prv->active_queues);
+    }
+
+    /*
+     * TIMER_STATUS_invalid means we are the first cpu that sees the timer
+     * allocated but not initialized, TIMER_STATUS_killed that all the cpus
+     * of the runqueue went away earlier. Either way, it's up to us to
+     * (re)initialize it.
+     */
+    if ( rqd->repl_timer.status == TIMER_STATUS_invalid ||
+         rqd->repl_timer.status == TIMER_STATUS_killed )
+    {
+        init_timer(&rqd->repl_timer, repl_timer_handler, rqd, cpu);
+        dprintk(XENLOG_DEBUG, "RTDS: runqueue %u timer initialized on cpu %u\n",
+                rqi, cpu);
+    }
+
+    printk(XENLOG_INFO "RTDS: adding cpu %u to runqueue %u\n", cpu, rqi);
+    __cpumask_set_cpu(cpu, &rqd->cpus);
+    prv->runq_map[cpu] = rqi;
+
+    return rqd;
+}
+
 /*
- * Point per_cpu spinlock to the global system lock;
- * All cpu have same global system lock
+ * Point per_cpu spinlock to the lock of the runqueue the cpu is in.
  */
 static void
 rt_init_pdata(const struct scheduler *ops, void *pdata, int cpu)
 {
     struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd;
     spinlock_t *old_lock;
     unsigned long flags;
 
-    old_lock = pcpu_schedule_lock_irqsave(cpu, &flags);
+    spin_lock_irqsave(&prv->lock, flags);
+    old_lock = pcpu_schedule_lock(cpu);
 
-    /*
-     * TIMER_STATUS_invalid means we are the first cpu that sees the timer
-     * allocated but not initialized, and so it's up to us to initialize it.
-     */
-    if ( prv->repl_timer->status == TIMER_STATUS_invalid )
-    {
-        init_timer(prv->repl_timer, repl_timer_handler, (void*) ops, cpu);
-        dprintk(XENLOG_DEBUG, "RTDS: timer initialized on cpu %u\n", cpu);
-    }
+    rqd = init_pdata(ops, cpu);
 
-    /* Move the scheduler lock to our global runqueue lock.  */
-    per_cpu(schedule_data, cpu).schedule_lock = &prv->lock;
+    /* Move the scheduler lock to our runqueue lock.  */
+    per_cpu(schedule_data, cpu).schedule_lock = &rqd->lock;
 
     /* _Not_ pcpu_schedule_unlock(): per_cpu().schedule_lock changed! */
-    spin_unlock_irqrestore(old_lock, flags);
+    spin_unlock(old_lock);
+    spin_unlock_irqrestore(&prv->lock, flags);
 }
 
 /* Change the scheduler of cpu to us (RTDS). */
@@ -696,32 +836,25 @@ rt_switch_sched(struct scheduler *new_ops, unsigned int cpu,
 {
     struct rt_private *prv = rt_priv(new_ops);
     struct rt_vcpu *svc = vdata;
+    struct rt_runqueue *rqd;
 
     ASSERT(!pdata && svc && is_idle_vcpu(svc->vcpu));
 
     /*
      * We are holding the runqueue lock already (it's been taken in
      * schedule_cpu_switch()). It's actually the runqueue lock of
-     * another scheduler, but that is how things need to be, for
-     * preventing races.
-     */
-    ASSERT(per_cpu(schedule_data, cpu).schedule_lock != &prv->lock);
-
-    /*
-     * If we are the absolute first cpu being switched toward this
-     * scheduler (in which case we'll see TIMER_STATUS_invalid), or the
-     * first one that is added back to the cpupool that had all its cpus
-     * removed (in which case we'll see TIMER_STATUS_killed), it's our
-     * job to (re)initialize the timer.
+     * another scheduler, which has no ordering relationship with our
+     * private lock, but that is how things need to be, for preventing
+     * races.
      */
-    if ( prv->repl_timer->status == TIMER_STATUS_invalid ||
-         prv->repl_timer->status == TIMER_STATUS_killed )
-    {
-        init_timer(prv->repl_timer, repl_timer_handler, (void*) new_ops, cpu);
-        dprintk(XENLOG_DEBUG, "RTDS: timer initialized on cpu %u\n", cpu);
-    }
+    ASSERT(!local_irq_is_enabled());
+    spin_lock(&prv->lock);
 
     idle_vcpu[cpu]->sched_priv = vdata;
+
+    rqd = init_pdata(new_ops, cpu);
+    ASSERT(per_cpu(schedule_data, cpu).schedule_lock != &rqd->lock);
+
     per_cpu(scheduler, cpu) = new_ops;
     per_cpu(schedule_data, cpu).sched_priv = NULL; /* no pdata */
 
@@ -731,7 +864,9 @@ rt_switch_sched(struct scheduler *new_ops, unsigned int cpu,
      * taking it, find all the initializations we've done above in place.
      */
     smp_mb();
-    per_cpu(schedule_data, cpu).schedule_lock = &prv->lock;
+    per_cpu(schedule_data, cpu).schedule_lock = &rqd->lock;
+
+    spin_unlock(&prv->lock);
 }
 
 static void
@@ -739,30 +874,49 @@ rt_deinit_pdata(const struct scheduler *ops, void *pcpu, int cpu)
 {
     unsigned long flags;
     struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd;
 
     spin_lock_irqsave(&prv->lock, flags);
 
-    if ( prv->repl_timer->cpu == cpu )
+    rqd = rt_rqd(ops, cpu);
+
+    /* No need to save IRQs here, they're already disabled */
+    spin_lock(&rqd->lock);
+
+    printk(XENLOG_INFO "RTDS: removing cpu %d from runqueue %d\n",
+           cpu, rqd->id);
+    __cpumask_clear_cpu(cpu, &rqd->cpus);
+
+    if ( rqd->repl_timer.cpu == cpu )
     {
-        struct cpupool *c = per_cpu(cpupool, cpu);
-        unsigned int new_cpu = cpumask_cycle(cpu, cpupool_online_cpumask(c));
+        unsigned int new_cpu = cpumask_first(&rqd->cpus);
 
         /*
-         * Make sure the timer run on one of the cpus that are still available
-         * to this scheduler. If there aren't any left, it means it's the time
+         * Make sure the timer run on one of the cpus that are still in
+         * this runqueue. If there aren't any left, it means it's the time
          * to just kill it.
          */
         if ( new_cpu >= nr_cpu_ids )
         {
-            kill_timer(prv->repl_timer);
+            kill_timer(&rqd->repl_timer);
             dprintk(XENLOG_DEBUG, "RTDS: timer killed on cpu %d\n", cpu);
         }
         else
         {
-            migrate_timer(prv->repl_timer, new_cpu);
+            migrate_timer(&rqd->repl_timer, new_cpu);
         }
     }
 
+    if ( cpumask_empty(&rqd->cpus) )
+    {
+        ASSERT(list_empty(&rqd->runq) && list_empty(&rqd->depletedq) &&
+               list_empty(&rqd->replq));
+        __cpumask_clear_cpu(rqd->id, &prv->active_queues);
+        rqd->id = -1;
+    }
+
+    spin_unlock(&rqd->lock);
+
     spin_unlock_irqrestore(&prv->lock, flags);
 }
 
@@ -973,12 +1127,13 @@ burn_budget(const struct scheduler *ops, struct rt_vcpu *svc, s_time_t now)
 
 /*
  * RunQ is sorted. Pick first one within cpumask. If no one, return NULL
- * lock is grabbed before calling this function
+ * lock of rqd is grabbed before calling this function
  */
 static struct rt_vcpu *
-runq_pick(const struct scheduler *ops, const cpumask_t *mask)
+runq_pick(const struct scheduler *ops, struct rt_runqueue *rqd,
+          const cpumask_t *mask)
 {
-    struct list_head *runq = rt_runq(ops);
+    struct list_head *runq = &rqd->runq;
     struct list_head *iter;
     struct rt_vcpu *svc = NULL;
     struct rt_vcpu *iter_svc = NULL;
@@ -1023,6 +1178,57 @@ runq_pick(const struct scheduler *ops, const cpumask_t *mask)
     return svc;
 }
 
+/*
+ * Nothing can run on cpu from its own runqueue: look for a vcpu that can
+ * in the other runqueues, and move the first one found to cpu's runqueue.
+ * The lock of cpu's runqueue is held, so we may only trylock the others.
+ */
+static struct rt_vcpu *
+runq_steal(const struct scheduler *ops, unsigned int cpu)
+{
+    struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd = rt_rqd(ops, cpu), *orqd;
+    struct rt_vcpu *svc = NULL;
+    unsigned int rqi = rqd->id;
+
+    while ( (rqi = cpumask_cycle(rqi, &prv->active_queues)) != rqd->id )
+    {
+        orqd = prv->rqd + rqi;
+
+        /* Unlocked peek, to avoid bothering runqueues with nothing to do. */
+        if ( list_empty(&orqd->runq) )
+            continue;
+
+        if ( !spin_trylock(&orqd->lock) )
+        {
+            SCHED_STAT_CRANK(rtds_steal_trylock_failed);
+            continue;
+        }
+
+        svc = runq_pick(ops, orqd, cpumask_of(cpu));
+        if ( svc != NULL )
+        {
+            /*
+             * The replenishment event moves along, to be handled (and
+             * timed) by our runqueue from now on.
+             */
+            q_remove(svc);
+            replq_remove(ops, svc);
+            svc->vcpu->processor = cpu;
+            replq_insert(ops, svc);
+            runq_insert(ops, svc);
+            SCHED_STAT_CRANK(rtds_stolen);
+        }
+
+        spin_unlock(&orqd->lock);
+
+        if ( svc != NULL )
+            break;
+    }
+
+    return svc;
+}
+
 /*
  * schedule function for rt scheduler.
  * The lock is already grabbed in schedule.c, no need to lock here
@@ -1032,9 +1238,11 @@ rt_schedule(const struct scheduler *ops, s_time_t now, bool_t tasklet_work_sched
 {
     const int cpu = smp_processor_id();
     struct rt_private *prv = rt_priv(ops);
+    struct rt_runqueue *rqd = rt_rqd(ops, cpu);
     struct rt_vcpu *const scurr = rt_vcpu(current);
     struct rt_vcpu *snext = NULL;
     struct task_slice ret = { .migrated = 0 };
+    bool_t stolen = 0;
 
     /* TRACE */
     {
@@ -1063,7 +1271,20 @@ rt_schedule(const struct scheduler *ops, s_time_t now, bool_t tasklet_work_sched
     }
     else
     {
-        snext = runq_pick(ops, cpumask_of(cpu));
+        snext = runq_pick(ops, rqd, cpumask_of(cpu));
+
+        /*
+         * If we'd otherwise go idle, see whether any other runqueue has
+         * work for us.
+         */
+        if ( snext == NULL &&
+             (is_idle_vcpu(current) || !vcpu_runnable(current) ||
+              scurr->cur_budget <= 0) )
+        {
+            snext = runq_steal(ops, cpu);
+            stolen = snext != NULL;
+        }
+
         if ( snext == NULL )
             snext = rt_vcpu(idle_vcpu[cpu]);
 
@@ -1090,7 +1311,7 @@ rt_schedule(const struct scheduler *ops, s_time_t now, bool_t tasklet_work_sched
             q_remove(snext);
             __set_bit(__RTDS_scheduled, &snext->flags);
         }
-        if ( snext->vcpu->processor != cpu )
+        if ( snext->vcpu->processor != cpu || stolen )
         {
             snext->vcpu->processor = cpu;
             ret.migrated = 1;
@@ -1151,7 +1372,7 @@ runq_tickle(const struct scheduler *ops, struct rt_vcpu *new)
     struct rt_vcpu *iter_svc;
     struct vcpu *iter_vc;
     int cpu = 0, cpu_to_tickle = 0;
-    cpumask_t not_tickled;
+    cpumask_t not_tickled, others;
     cpumask_t *online;
 
     if ( new == NULL || is_idle_vcpu(new->vcpu) )
@@ -1161,6 +1382,10 @@ runq_tickle(const struct scheduler *ops, struct rt_vcpu *new)
     cpumask_and(&not_tickled, online, new->vcpu->cpu_hard_affinity);
     cpumask_andnot(&not_tickled, &not_tickled, &prv->tickled);
 
+    /* Only cpus in our runqueue are considered, until step 4. */
+    cpumask_andnot(&others, &not_tickled, &vcpu_rqd(ops, new)->cpus);
+    cpumask_and(&not_tickled, &not_tickled, &vcpu_rqd(ops, new)->cpus);
+
     /* 1) if new's previous cpu is idle, kick it for cache benefit */
     if ( is_idle_vcpu(curr_on_cpu(new->vcpu->processor)) )
     {
@@ -1195,6 +1420,21 @@ runq_tickle(const struct scheduler *ops, struct rt_vcpu *new)
         goto out;
     }
 
+    /*
+     * 4) if an idle pcpu in another runqueue is available, kick it: it
+     *    will steal new (or some other vcpu, if faster) from our runqueue.
+     *    We don't hold the other runqueues' locks, so this is just a hint.
+     */
+    for_each_cpu(cpu, &others)
+    {
+        if ( is_idle_vcpu(curr_on_cpu(cpu)) )
+        {
+            SCHED_STAT_CRANK(tickled_idle_cpu);
+            cpu_to_tickle = cpu;
+            goto out;
+        }
+    }
+
     /* didn't tickle any cpu */
     SCHED_STAT_CRANK(tickled_no_cpu);
     return;
@@ -1325,9 +1565,9 @@ rt_dom_cntl(
     struct domain *d,
     struct xen_domctl_scheduler_op *op)
 {
-    struct rt_private *prv = rt_priv(ops);
     struct rt_vcpu *svc;
     struct vcpu *v;
+    spinlock_t *lock;
     unsigned long flags;
     int rc = 0;
     xen_domctl_schedparam_vcpu_t local_sched;
@@ -1347,14 +1587,14 @@ rt_dom_cntl(
             rc = -EINVAL;
             break;
         }
-        spin_lock_irqsave(&prv->lock, flags);
         for_each_vcpu ( d, v )
         {
+            lock = vcpu_schedule_lock_irqsave(v, &flags);
             svc = rt_vcpu(v);
             svc->period = MICROSECS(op->u.rtds.period); /* transfer to nanosec */
             svc->budget = MICROSECS(op->u.rtds.budget);
+            vcpu_schedule_unlock_irqrestore(lock, flags, v);
         }
-        spin_unlock_irqrestore(&prv->lock, flags);
         break;
     case XEN_DOMCTL_SCHEDOP_getvcpuinfo:
     case XEN_DOMCTL_SCHEDOP_putvcpuinfo:
@@ -1375,11 +1615,12 @@ rt_dom_cntl(
 
             if ( op->cmd == XEN_DOMCTL_SCHEDOP_getvcpuinfo )
             {
-                spin_lock_irqsave(&prv->lock, flags);
-                svc = rt_vcpu(d->vcpu[local_sched.vcpuid]);
+                v = d->vcpu[local_sched.vcpuid];
+                lock = vcpu_schedule_lock_irqsave(v, &flags);
+                svc = rt_vcpu(v);
                 local_sched.u.rtds.budget = svc->budget / MICROSECS(1);
                 local_sched.u.rtds.period = svc->period / MICROSECS(1);
-                spin_unlock_irqrestore(&prv->lock, flags);
+                vcpu_schedule_unlock_irqrestore(lock, flags, v);
 
                 if ( copy_to_guest_offset(op->u.v.vcpus, index,
                                           &local_sched, 1) )
@@ -1399,11 +1640,12 @@ rt_dom_cntl(
                     break;
                 }
 
-                spin_lock_irqsave(&prv->lock, flags);
-                svc = rt_vcpu(d->vcpu[local_sched.vcpuid]);
+                v = d->vcpu[local_sched.vcpuid];
+                lock = vcpu_schedule_lock_irqsave(v, &flags);
+                svc = rt_vcpu(v);
                 svc->period = period;
                 svc->budget = budget;
-                spin_unlock_irqrestore(&prv->lock, flags);
+                vcpu_schedule_unlock_irqrestore(lock, flags, v);
             }
             /* Process a most 64 vCPUs without checking for preemptions. */
             if ( (++index > 63) && hypercall_preempt_check() )
@@ -1420,20 +1662,20 @@ rt_dom_cntl(
 
 /*
  * The replenishment timer handler picks vcpus
- * from the replq and does the actual replenishment.
+ * from the replq of a runqueue and does the actual replenishment.
  */
 static void repl_timer_handler(void *data){
     s_time_t now;
-    struct scheduler *ops = data;
-    struct rt_private *prv = rt_priv(ops);
-    struct list_head *replq = rt_replq(ops);
-    struct list_head *runq = rt_runq(ops);
-    struct timer *repl_timer = prv->repl_timer;
+    struct rt_runqueue *rqd = data;
+    const struct scheduler *ops = rqd->ops;
+    struct list_head *replq = &rqd->replq;
+    struct list_head *runq = &rqd->runq;
+    struct timer *repl_timer = &rqd->repl_timer;
     struct list_head *iter, *tmp;
     struct rt_vcpu *svc;
     LIST_HEAD(tmp_replq);
 
-    spin_lock_irq(&prv->lock);
+    spin_lock_irq(&rqd->lock);
 
     now = NOW();
 
@@ -1496,7 +1738,7 @@ static void repl_timer_handler(void *data){
     if ( !list_empty(replq) )
         set_timer(repl_timer, replq_elem(replq->next)->cur_deadline);
 
-    spin_unlock_irq(&prv->lock);
+    spin_unlock_irq(&rqd->lock);
 }
 
 static const struct scheduler sched_rtds_def = {
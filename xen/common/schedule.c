@@ -55,6 +55,43 @@ boolean_param("sched_smt_power_savings", sched_smt_power_savings);
  * */
 int sched_ratelimit_us = SCHED_DEFAULT_RATELIMIT_US;
 integer_param("sched_ratelimit_us", sched_ratelimit_us);
+
+/*
+ * SMT co-scheduling: if sched_smt_cosched is set, the sibling threads of a
+ * core only ever run vcpus of one domain at the same time (the others are
+ * idle), so guests never share a core with each other.
+ *
+ * The first thread to pick a vcpu on an idle core makes that vcpu's domain
+ * the owner of the core, and its siblings are then only allowed to pick
+ * vcpus of the owner (see sched_core_allowed()).  If a thread had to hold
+ * back a vcpu of another domain and the owner has had the core for at least
+ * sched_smt_cosched_slice_us, the core is drained: all threads go idle,
+ * and the first one to schedule afterwards picks the next owner.
+ */
+static bool_t __read_mostly opt_smt_cosched;
+boolean_param("sched_smt_cosched", opt_smt_cosched);
+static unsigned int __read_mostly opt_smt_cosched_slice_us = 5000;
+integer_param("sched_smt_cosched_slice_us", opt_smt_cosched_slice_us);
+#define SMT_COSCHED_SLICE MICROSECS(opt_smt_cosched_slice_us)
+
+static bool_t __read_mostly smt_cosched_active;
+
+struct sched_core {
+    spinlock_t   lock;        /* Serialises scheduling on the whole core */
+    s_time_t     owner_since; /* When the current owner got the core */
+    bool_t       draining;    /* Threads are being emptied for a new owner */
+    unsigned int nr_threads;  /* Threads which are up and use the core */
+};
+
+/*
+ * The core of each cpu which is up.  A cpu coming up joins the core of a
+ * sibling which is already up, or else takes the one allocated for it in
+ * advance, so the core and its lock stay the same while any of its threads
+ * are up, whatever the sibling masks say.
+ */
+static DEFINE_PER_CPU(struct sched_core *, sched_core);
+static DEFINE_PER_CPU(struct sched_core *, sched_core_spare);
+
 /* Various timer handlers. */
 static void s_timer_fn(void *unused);
 static void vcpu_periodic_timer_fn(void *data);
@@ -1325,6 +1362,186 @@ static void vcpu_periodic_timer_work(struct vcpu *v)
     set_timer(&v->periodic_timer, periodic_next_event);
 }
 
+/* The domain the other threads of cpu's core are running, if any. */
+static struct domain *core_owner(unsigned int cpu)
+{
+    unsigned int sib;
+
+    for_each_cpu ( sib, per_cpu(cpu_sibling_mask, cpu) )
+        if ( sib != cpu && per_cpu(schedule_data, sib).core_dom )
+            return per_cpu(schedule_data, sib).core_dom;
+
+    return NULL;
+}
+
+static void core_sched_prepare(unsigned int cpu, const struct scheduler *sched,
+                               const struct sched_core *core)
+{
+    struct schedule_data *sd = &per_cpu(schedule_data, cpu);
+
+    sd->core_refused = 0;
+    if ( !sched->cosched )
+        sd->core_allowed = NULL;
+    else if ( core->draining )
+        sd->core_allowed = idle_vcpu[cpu]->domain;
+    else
+        sd->core_allowed = core_owner(cpu);
+}
+
+/*
+ * Record what cpu is going to run, and deal with its siblings: let them
+ * have a go if the core became free, or start draining the core if cpu
+ * had to hold back other work for long enough.  May shorten *time, for
+ * cpu to come back and check when the owner's slice ends.
+ */
+static void core_sched_commit(unsigned int cpu, const struct scheduler *sched,
+                              struct sched_core *core, struct vcpu *next,
+                              s_time_t now, s_time_t *time)
+{
+    struct schedule_data *sd = &per_cpu(schedule_data, cpu);
+    struct domain *owner = core_owner(cpu);
+    unsigned int sib;
+
+    /* Account for the time we have been kept idle by our siblings. */
+    if ( sd->core_idle_start )
+    {
+        sd->core_idle_time += now - sd->core_idle_start;
+        sd->core_idle_start = 0;
+    }
+
+    if ( is_idle_vcpu(next) || !sched->cosched )
+    {
+        sd->core_dom = NULL;
+        if ( sd->core_refused )
+        {
+            sd->core_idle_start = now;
+            SCHED_STAT_CRANK(core_forced_idle);
+        }
+    }
+    else
+    {
+        if ( owner == NULL && sd->core_dom != next->domain )
+            core->owner_since = now;
+        sd->core_dom = next->domain;
+        owner = next->domain;
+    }
+
+    if ( owner == NULL )
+    {
+        /* The core is free: wake up whoever had to stay idle (us too). */
+        core->draining = 0;
+        for_each_cpu ( sib, per_cpu(cpu_sibling_mask, cpu) )
+            if ( per_cpu(schedule_data, sib).core_idle_start )
+                cpu_raise_softirq(sib, SCHEDULE_SOFTIRQ);
+        return;
+    }
+
+    if ( !sd->core_refused || core->draining )
+        return;
+
+    if ( now - core->owner_since >= SMT_COSCHED_SLICE )
+    {
+        core->draining = 1;
+        SCHED_STAT_CRANK(core_drain);
+        for_each_cpu ( sib, per_cpu(cpu_sibling_mask, cpu) )
+            if ( per_cpu(schedule_data, sib).core_dom )
+                cpu_raise_softirq(sib, SCHEDULE_SOFTIRQ);
+    }
+    else if ( *time < 0 || *time > core->owner_since + SMT_COSCHED_SLICE - now )
+        *time = core->owner_since + SMT_COSCHED_SLICE - now;
+}
+
+static void schedule_unlock(spinlock_t *lock, unsigned int cpu,
+                            struct sched_core *core)
+{
+    if ( core == NULL )
+        pcpu_schedule_unlock_irq(lock, cpu);
+    else
+    {
+        pcpu_schedule_unlock(lock, cpu);
+        spin_unlock_irq(&core->lock);
+    }
+}
+
+/* Allocate the core cpu will use unless a sibling is up already. */
+static int sched_core_alloc(unsigned int cpu)
+{
+    struct sched_core *core;
+
+    if ( !opt_smt_cosched || per_cpu(sched_core_spare, cpu) != NULL )
+        return 0;
+
+    core = xzalloc(struct sched_core);
+    if ( core == NULL )
+        return -ENOMEM;
+
+    spin_lock_init(&core->lock);
+    per_cpu(sched_core_spare, cpu) = core;
+
+    return 0;
+}
+
+static void sched_core_attach(unsigned int cpu)
+{
+    struct sched_core *core = NULL;
+    unsigned int sib;
+
+    for_each_cpu ( sib, per_cpu(cpu_sibling_mask, cpu) )
+        if ( sib != cpu && (core = per_cpu(sched_core, sib)) != NULL )
+            break;
+
+    if ( core == NULL )
+    {
+        core = per_cpu(sched_core_spare, cpu);
+        per_cpu(sched_core_spare, cpu) = NULL;
+        if ( core == NULL )
+            return;
+    }
+
+    core->nr_threads++;
+    per_cpu(sched_core, cpu) = core;
+}
+
+static void sched_core_detach(unsigned int cpu)
+{
+    struct sched_core *core = per_cpu(sched_core, cpu);
+
+    per_cpu(sched_core, cpu) = NULL;
+    if ( core != NULL && --core->nr_threads == 0 )
+        xfree(core);
+
+    xfree(per_cpu(sched_core_spare, cpu));
+    per_cpu(sched_core_spare, cpu) = NULL;
+}
+
+static int __init smt_cosched_init(void)
+{
+    unsigned int cpu;
+
+    if ( !opt_smt_cosched )
+        return 0;
+
+    /* The boot CPU came up before its siblings were known. */
+    sched_core_attach(0);
+
+    for_each_online_cpu ( cpu )
+        if ( cpumask_weight(per_cpu(cpu_sibling_mask, cpu)) > 1 )
+            break;
+
+    if ( cpu >= nr_cpu_ids )
+    {
+        printk("SMT co-scheduling: no SMT siblings, not enabling\n");
+        return 0;
+    }
+
+    printk("Enabling SMT co-scheduling (%uus slice)\n",
+           opt_smt_cosched_slice_us);
+    smt_cosched_active = 1;
+
+    return 0;
+}
+__initcall(smt_cosched_init);
+
 /* 
  * The main function
  * - deschedule the current domain (scheduler independent).
@@ -1339,6 +1556,7 @@ static void schedule(void)
     bool_t                tasklet_work_scheduled = 0;
     struct schedule_data *sd;
     spinlock_t           *lock;
+    struct sched_core    *core = NULL;
     struct task_slice     next_slice;
     int cpu = smp_processor_id();
 
@@ -1366,7 +1584,14 @@ static void schedule(void)
         BUG();
     }
 
-    lock = pcpu_schedule_lock_irq(cpu);
+    /* With SMT co-scheduling, the threads of a core schedule one by one. */
+    if ( smt_cosched_active && (core = this_cpu(sched_core)) != NULL )
+    {
+        spin_lock_irq(&core->lock);
+        lock = pcpu_schedule_lock(cpu);
+    }
+    else
+        lock = pcpu_schedule_lock_irq(cpu);
 
     now = NOW();
 
@@ -1374,18 +1599,23 @@ static void schedule(void)
     
     /* get policy-specific decision on scheduling... */
     sched = this_cpu(scheduler);
+    if ( core )
+        core_sched_prepare(cpu, sched, core);
     next_slice = sched->do_schedule(sched, now, tasklet_work_scheduled);
 
     next = next_slice.task;
 
     sd->curr = next;
 
+    if ( core )
+        core_sched_commit(cpu, sched, core, next, now, &next_slice.time);
+
     if ( next_slice.time >= 0 ) /* -ve means no limit */
         set_timer(&sd->s_timer, now + next_slice.time);
 
     if ( unlikely(prev == next) )
     {
-        pcpu_schedule_unlock_irq(lock, cpu);
+        schedule_unlock(lock, cpu, core);
         trace_continue_running(next);
         return continue_running(prev);
     }
@@ -1423,7 +1653,7 @@ static void schedule(void)
     ASSERT(!next->is_running);
     next->is_running = 1;
 
-    pcpu_schedule_unlock_irq(lock, cpu);
+    schedule_unlock(lock, cpu, core);
 
     SCHED_STAT_CRANK(sched_ctx);
 
@@ -1494,10 +1724,13 @@ static int cpu_schedule_up(unsigned int cpu)
     sd->curr = idle_vcpu[cpu];
     init_timer(&sd->s_timer, s_timer_fn, NULL, cpu);
     atomic_set(&sd->urgent_count, 0);
+    sd->core_dom = NULL;
+    sd->core_allowed = NULL;
+    sd->core_idle_start = 0;
 
     /* Boot CPU is dealt with later in schedule_init(). */
     if ( cpu == 0 )
-        return 0;
+        return sched_core_alloc(cpu);
 
     if ( idle_vcpu[cpu] == NULL )
         alloc_vcpu(idle_vcpu[0]->domain, cpu, cpu);
@@ -1536,7 +1769,7 @@ static int cpu_schedule_up(unsigned int cpu)
 
     sd->sched_priv = sched_priv;
 
-    return 0;
+    return sched_core_alloc(cpu);
 }
 
 static void cpu_schedule_down(unsigned int cpu)
@@ -1551,6 +1784,8 @@ static void cpu_schedule_down(unsigned int cpu)
     sd->sched_priv = NULL;
 
     kill_timer(&sd->s_timer);
+
+    sched_core_detach(cpu);
 }
 
 static int cpu_schedule_callback(
@@ -1597,6 +1832,7 @@ static int cpu_schedule_callback(
     {
     case CPU_STARTING:
         SCHED_OP(sched, init_pdata, sd->sched_priv, cpu);
+        sched_core_attach(cpu);
         break;
     case CPU_UP_PREPARE:
         rc = cpu_schedule_up(cpu);
@@ -1836,6 +2072,14 @@ void schedule_dump(struct cpupool *c)
     {
         printk("CPU[%02d] ", i);
         SCHED_OP(sched, dump_cpu_state, i);
+        if ( smt_cosched_active )
+        {
+            const struct domain *d = per_cpu(schedule_data, i).core_dom;
+
+            printk("\tco-sched: d%d, kept idle %"PRI_stime"us\n",
+                   d ? d->domain_id : -1,
+                   per_cpu(schedule_data, i).core_idle_time / MICROSECS(1));
+        }
     }
 }
 
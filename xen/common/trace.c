@@ -54,9 +54,19 @@ static struct t_info *t_info;
 static unsigned int t_info_pages;
 
 static DEFINE_PER_CPU_READ_MOSTLY(struct t_buf *, t_bufs);
-static DEFINE_PER_CPU_READ_MOSTLY(spinlock_t, t_lock);
 static u32 data_size __read_mostly;
 
+/*
+ * Each cpu is the only producer for its buffer, so records are added
+ * without a lock: space is reserved by moving t_reserve forward with
+ * cmpxchg (which only has to guard against interrupts, NMIs included,
+ * tracing on the same cpu), and the record is written there.  Only the
+ * outermost of any nested __trace_var() calls publishes the new producer
+ * index to buf->prod, once all the records up to it have been written.
+ */
+static DEFINE_PER_CPU(u32, t_reserve);
+static DEFINE_PER_CPU(unsigned int, t_nesting);
+
 /* High water mark for trace buffers; */
 /* Send virtual interrupt when buffer level reaches this point */
 static u32 t_buf_highwater;
@@ -79,21 +89,6 @@ static u32 tb_event_mask = TRC_ALL;
  * i.e., sizeof(_type) * ans >= _x. */
 #define fit_to_type(_type, _x) (((_x)+sizeof(_type)-1) / sizeof(_type))
 
-static int cpu_callback(
-    struct notifier_block *nfb, unsigned long action, void *hcpu)
-{
-    unsigned int cpu = (unsigned long)hcpu;
-
-    if ( action == CPU_UP_PREPARE )
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
-    return NOTIFY_DONE;
-}
-
-static struct notifier_block cpu_nfb = {
-    .notifier_call = cpu_callback
-};
-
 static uint32_t calc_tinfo_first_offset(void)
 {
     int offset_in_bytes = offsetof(struct t_info, mfn_offset[NR_CPUS]);
@@ -226,13 +221,12 @@ static int alloc_trace_bufs(unsigned int pages)
         struct t_buf *buf;
         struct page_info *pg;
 
-        spin_lock_init(&per_cpu(t_lock, cpu));
-
         offset = t_info->mfn_offset[cpu];
 
         /* Initialize the buffer metadata */
         per_cpu(t_bufs, cpu) = buf = mfn_to_virt(t_info_mfn_list[offset]);
         buf->cons = buf->prod = 0;
+        per_cpu(t_reserve, cpu) = 0;
 
         printk(XENLOG_INFO "xentrace: p%d mfn %x offset %u\n",
                    cpu, t_info_mfn_list[offset], offset);
@@ -342,7 +336,6 @@ int trace_will_trace_event(u32 event)
 void __init init_trace_bufs(void)
 {
     cpumask_setall(&tb_cpu_mask);
-    register_cpu_notifier(&cpu_nfb);
 
     if ( opt_tbuf_size )
     {
@@ -416,15 +409,10 @@ int tb_control(xen_sysctl_tbuf_op_t *tbc)
         tb_init_done = 0;
         smp_wmb();
         /* Clear any lost-record info so we don't get phantom lost records next time we
-         * start tracing.  Grab the lock to make sure we're not racing anyone.  After this
-         * hypercall returns, no more records should be placed into the buffers. */
+         * start tracing.  After this hypercall returns, no more records should be
+         * placed into the buffers. */
         for_each_online_cpu(i)
-        {
-            unsigned long flags;
-            spin_lock_irqsave(&per_cpu(t_lock, i), flags);
-            per_cpu(lost_records, i)=0;
-            spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
-        }
+            xchg(&per_cpu(lost_records, i), 0);
     }
         break;
     default:
@@ -460,16 +448,10 @@ static inline bool_t bogus(u32 prod, u32 cons)
     return 0;
 }
 
-static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
+static inline u32 calc_unconsumed_bytes(u32 prod, u32 cons)
 {
-    u32 prod = buf->prod, cons = buf->cons;
-    s32 x;
+    s32 x = prod - cons;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    if ( bogus(prod, cons) )
-        return data_size;
-
-    x = prod - cons;
     if ( x < 0 )
         x += 2*data_size;
 
@@ -479,16 +461,10 @@ static inline u32 calc_unconsumed_bytes(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
+static inline u32 calc_bytes_to_wrap(u32 prod)
 {
-    u32 prod = buf->prod, cons = buf->cons;
-    s32 x;
-
-    barrier(); /* must read buf->prod and buf->cons only once */
-    if ( bogus(prod, cons) )
-        return 0;
+    s32 x = data_size - prod;
 
-    x = data_size - prod;
     if ( x <= 0 )
         x += data_size;
 
@@ -498,27 +474,15 @@ static inline u32 calc_bytes_to_wrap(const struct t_buf *buf)
     return x;
 }
 
-static inline u32 calc_bytes_avail(const struct t_buf *buf)
-{
-    return data_size - calc_unconsumed_bytes(buf);
-}
-
-static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
-                                 unsigned char **next_page,
-                                 uint32_t *offset_in_page)
+static unsigned char *next_record(u32 x, unsigned char **next_page,
+                                  uint32_t *offset_in_page)
 {
-    u32 x = buf->prod, cons = buf->cons;
     uint16_t per_cpu_mfn_offset;
     uint32_t per_cpu_mfn_nr;
     uint32_t *mfn_list;
     uint32_t mfn;
     unsigned char *this_page;
 
-    barrier(); /* must read buf->prod and buf->cons only once */
-    *next = x;
-    if ( !tb_init_done || bogus(x, cons) )
-        return NULL;
-
     if ( x >= data_size )
         x -= data_size;
 
@@ -547,41 +511,33 @@ static unsigned char *next_record(const struct t_buf *buf, uint32_t *next,
     return this_page;
 }
 
-static inline void __insert_record(struct t_buf *buf,
-                                   unsigned long event,
-                                   unsigned int extra,
-                                   bool_t cycles,
-                                   unsigned int rec_size,
-                                   const void *extra_data)
+/* Write a record at prod, which has been reserved; returns the next prod. */
+static inline u32 __insert_record(u32 prod,
+                                  unsigned long event,
+                                  unsigned int extra,
+                                  bool_t cycles,
+                                  u64 tsc,
+                                  unsigned int rec_size,
+                                  const void *extra_data)
 {
     struct t_rec split_rec, *rec;
     uint32_t *dst;
     unsigned char *this_page, *next_page;
     unsigned int extra_word = extra / sizeof(u32);
     unsigned int local_rec_size = calc_rec_size(cycles, extra);
-    uint32_t next;
     uint32_t offset;
     uint32_t remaining;
 
     BUG_ON(local_rec_size != rec_size);
     BUG_ON(extra & 3);
 
-    this_page = next_record(buf, &next, &next_page, &offset);
-    if ( !this_page )
-        return;
-
+    this_page = next_record(prod, &next_page, &offset);
     remaining = PAGE_SIZE - offset;
 
     if ( unlikely(rec_size > remaining) )
     {
-        if ( next_page == NULL )
-        {
-            /* access beyond end of buffer */
-            printk(XENLOG_WARNING
-                   "%s: size=%08x prod=%08x cons=%08x rec=%u remaining=%u\n",
-                   __func__, data_size, next, buf->cons, rec_size, remaining);
-            return;
-        }
+        /* The reservation never goes past the end of the buffer. */
+        BUG_ON(next_page == NULL);
         rec = &split_rec;
     } else {
         rec = (struct t_rec*)(this_page + offset);
@@ -592,7 +548,6 @@ static inline void __insert_record(struct t_buf *buf,
     dst = rec->u.nocycles.extra_u32;
     if ( (rec->cycles_included = cycles) != 0 )
     {
-        u64 tsc = (u64)get_cycles();
         rec->u.cycles.cycles_lo = (uint32_t)tsc;
         rec->u.cycles.cycles_hi = (uint32_t)(tsc >> 32);
         dst = rec->u.cycles.extra_u32;
@@ -607,19 +562,17 @@ static inline void __insert_record(struct t_buf *buf,
         memcpy(next_page, (char *)rec + remaining, rec_size - remaining);
     }
 
-    smp_wmb();
+    prod += rec_size;
+    if ( prod >= 2*data_size )
+        prod -= 2*data_size;
+    ASSERT(prod < 2*data_size);
 
-    next += rec_size;
-    if ( next >= 2*data_size )
-        next -= 2*data_size;
-    ASSERT(next < 2*data_size);
-    buf->prod = next;
+    return prod;
 }
 
-static inline void insert_wrap_record(struct t_buf *buf,
-                                      unsigned int size)
+static inline u32 insert_wrap_record(u32 prod, unsigned int size, u64 tsc)
 {
-    u32 space_left = calc_bytes_to_wrap(buf);
+    u32 space_left = calc_bytes_to_wrap(prod);
     unsigned int extra_space = space_left - sizeof(u32);
     bool_t cycles = 0;
 
@@ -633,13 +586,13 @@ static inline void insert_wrap_record(struct t_buf *buf,
         ASSERT((extra_space/sizeof(u32)) <= TRACE_EXTRA_MAX);
     }
 
-    __insert_record(buf, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
-                    space_left, NULL);
+    return __insert_record(prod, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
+                           tsc, space_left, NULL);
 }
 
 #define LOST_REC_SIZE (4 + 8 + 16) /* header + tsc + sizeof(struct ed) */
 
-static inline void insert_lost_records(struct t_buf *buf)
+static inline u32 insert_lost_records(u32 prod, u64 tsc)
 {
     struct __packed {
         u32 lost_records;
@@ -649,13 +602,12 @@ static inline void insert_lost_records(struct t_buf *buf)
 
     ed.vid = current->vcpu_id;
     ed.did = current->domain->domain_id;
-    ed.lost_records = this_cpu(lost_records);
     ed.first_tsc = this_cpu(lost_records_first_tsc);
+    /* A nested caller may have beaten us to it: then this records 0. */
+    ed.lost_records = xchg(&this_cpu(lost_records), 0);
 
-    this_cpu(lost_records) = 0;
-
-    __insert_record(buf, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
-                    LOST_REC_SIZE, &ed);
+    return __insert_record(prod, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
+                           tsc, LOST_REC_SIZE, &ed);
 }
 
 /*
@@ -669,6 +621,22 @@ static void trace_notify_dom0(unsigned long unused)
 static DECLARE_SOFTIRQ_TASKLET(trace_notify_dom0_tasklet,
                                trace_notify_dom0, 0);
 
+/* Make what has been reserved so far visible to the consumer. */
+static void publish_records(struct t_buf *buf)
+{
+    u32 prod;
+
+    /*
+     * Records may still get reserved (and completely written) by interrupts
+     * while we do this, so go again until there are no more.
+     */
+    do {
+        prod = read_atomic(&this_cpu(t_reserve));
+        smp_wmb(); /* Records must be visible before the index. */
+        buf->prod = prod;
+    } while ( prod != read_atomic(&this_cpu(t_reserve)) );
+}
+
 /**
  * __trace_var - Enters a trace tuple into the trace buffer for the current CPU.
  * @event: the event type being logged
@@ -682,11 +650,11 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
                  const void *extra_data)
 {
     struct t_buf *buf;
-    unsigned long flags;
-    u32 bytes_to_tail, bytes_to_wrap;
-    unsigned int rec_size, total_size;
+    u32 prod, cons, next;
+    unsigned int rec_size, total_size, nesting;
     unsigned int extra_word;
-    bool_t started_below_highwater;
+    bool_t lost, started_below_highwater = 0;
+    u64 tsc;
 
     if( !tb_init_done )
         return;
@@ -720,100 +688,111 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     /* Read tb_init_done /before/ t_bufs. */
     smp_rmb();
 
-    spin_lock_irqsave(&this_cpu(t_lock), flags);
-
     buf = this_cpu(t_bufs);
-
     if ( unlikely(!buf) )
-    {
-        /* Make gcc happy */
-        started_below_highwater = 0;
-        goto unlock;
-    }
+        return;
 
-    started_below_highwater = (calc_unconsumed_bytes(buf) < t_buf_highwater);
+    nesting = ++this_cpu(t_nesting);
+    barrier();
 
     /* Calculate the record size */
     rec_size = calc_rec_size(cycles, extra);
- 
-    /* How many bytes are available in the buffer? */
-    bytes_to_tail = calc_bytes_avail(buf);
-    
-    /* How many bytes until the next wrap-around? */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
-    
-    /* 
-     * Calculate expected total size to commit this record by
-     * doing a dry-run.
-     */
-    total_size = 0;
 
-    /* First, check to see if we need to include a lost_record.
-     */
-    if ( this_cpu(lost_records) )
-    {
-        if ( LOST_REC_SIZE > bytes_to_wrap )
+    /* Reserve space for everything we need to write. */
+    do {
+        /*
+         * One timestamp does for both the record and a lost_record.  Take
+         * it afresh on every attempt: a record traced by an interrupt in
+         * the meantime makes the cmpxchg fail and lands first, so ours
+         * must not carry an older timestamp.
+         */
+        tsc = (u64)get_cycles();
+        prod = read_atomic(&this_cpu(t_reserve));
+        cons = read_atomic(&buf->cons);
+        if ( bogus(prod, cons) )
         {
-            total_size += bytes_to_wrap;
-            bytes_to_wrap = data_size;
-        } 
-        total_size += LOST_REC_SIZE;
-        bytes_to_wrap -= LOST_REC_SIZE;
-
-        /* LOST_REC might line up perfectly with the buffer wrap */
-        if ( bytes_to_wrap == 0 )
-            bytes_to_wrap = data_size;
-    }
+            started_below_highwater = 0;
+            goto out;
+        }
 
-    if ( rec_size > bytes_to_wrap )
-    {
-        total_size += bytes_to_wrap;
-    } 
-    total_size += rec_size;
+        started_below_highwater =
+            (calc_unconsumed_bytes(prod, cons) < t_buf_highwater);
 
-    /* Do we have enough space for everything? */
-    if ( total_size > bytes_to_tail )
-    {
-        if ( ++this_cpu(lost_records) == 1 )
-            this_cpu(lost_records_first_tsc)=(u64)get_cycles();
-        started_below_highwater = 0;
-        goto unlock;
-    }
+        /* First, check to see if we need to include a lost_record. */
+        lost = (this_cpu(lost_records) != 0);
+        total_size = 0;
+        next = prod;
+        if ( lost )
+        {
+            if ( LOST_REC_SIZE > calc_bytes_to_wrap(next) )
+            {
+                total_size += calc_bytes_to_wrap(next);
+                next = 0;
+            }
+            total_size += LOST_REC_SIZE;
+            next += LOST_REC_SIZE;
+            if ( next >= 2*data_size )
+                next -= 2*data_size;
+        }
+
+        if ( rec_size > calc_bytes_to_wrap(next) )
+            total_size += calc_bytes_to_wrap(next);
+        total_size += rec_size;
+
+        /* Do we have enough space for everything? */
+        if ( total_size > data_size - calc_unconsumed_bytes(prod, cons) )
+        {
+            if ( ++this_cpu(lost_records) == 1 )
+                this_cpu(lost_records_first_tsc) = tsc;
+            started_below_highwater = 0;
+            goto out;
+        }
+
+        next = prod + total_size;
+        if ( next >= 2*data_size )
+            next -= 2*data_size;
+    } while ( cmpxchg(&this_cpu(t_reserve), prod, next) != prod );
 
     /*
-     * Now, actually write information 
+     * Now, actually write information
      */
-    bytes_to_wrap = calc_bytes_to_wrap(buf);
-
-    if ( this_cpu(lost_records) )
+    if ( lost )
     {
-        if ( LOST_REC_SIZE > bytes_to_wrap )
-        {
-            insert_wrap_record(buf, LOST_REC_SIZE);
-            bytes_to_wrap = data_size;
-        } 
-        insert_lost_records(buf);
-        bytes_to_wrap -= LOST_REC_SIZE;
-
-        /* LOST_REC might line up perfectly with the buffer wrap */
-        if ( bytes_to_wrap == 0 )
-            bytes_to_wrap = data_size;
+        if ( LOST_REC_SIZE > calc_bytes_to_wrap(prod) )
+            prod = insert_wrap_record(prod, LOST_REC_SIZE, tsc);
+        prod = insert_lost_records(prod, tsc);
     }
 
-    if ( rec_size > bytes_to_wrap )
-        insert_wrap_record(buf, rec_size);
+    if ( rec_size > calc_bytes_to_wrap(prod) )
+        prod = insert_wrap_record(prod, rec_size, tsc);
 
     /* Write the original record */
-    __insert_record(buf, event, extra, cycles, rec_size, extra_data);
+    prod = __insert_record(prod, event, extra, cycles, tsc, rec_size,
+                           extra_data);
+    ASSERT(prod == next);
 
-unlock:
-    spin_unlock_irqrestore(&this_cpu(t_lock), flags);
+ out:
+    /* Also publishes what nested callers wrote, even if we lost ours. */
+    if ( nesting == 1 )
+        publish_records(buf);
 
     /* Notify trace buffer consumer that we've crossed the high water mark. */
-    if ( likely(buf!=NULL)
-         && started_below_highwater
-         && (calc_unconsumed_bytes(buf) >= t_buf_highwater) )
+    if ( started_below_highwater &&
+         calc_unconsumed_bytes(next, cons) >= t_buf_highwater )
         tasklet_schedule(&trace_notify_dom0_tasklet);
+
+    barrier();
+    this_cpu(t_nesting)--;
+    barrier();
+
+    /*
+     * Records nested in between the publishing above and dropping the
+     * count weren't published by their callers.  Interrupts from here on
+     * publish their own.
+     */
+    if ( nesting == 1 &&
+         read_atomic(&this_cpu(t_reserve)) != read_atomic(&buf->prod) )
+        publish_records(buf);
 }
 
 void __trace_hypercall(uint32_t event, unsigned long op,
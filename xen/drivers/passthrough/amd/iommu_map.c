@@ -444,7 +444,7 @@ static int iommu_pde_from_gfn(struct domain *d, unsigned long pfn,
     unsigned long  next_table_mfn;
     unsigned int level;
     struct page_info *table;
-    const struct domain_iommu *hd = dom_iommu(d);
+    struct domain_iommu *hd = dom_iommu(d);
 
     table = hd->arch.root_table;
     level = hd->arch.paging_mode;
@@ -493,6 +493,7 @@ static int iommu_pde_from_gfn(struct domain *d, unsigned long pfn,
                 unmap_domain_page(next_table_vaddr);
                 return 1;
             }
+            hd->pgtables++;
 
             next_table_mfn = page_to_mfn(table);
             set_iommu_pde_present((u32*)pde, next_table_mfn, next_level, 
@@ -521,6 +522,7 @@ static int iommu_pde_from_gfn(struct domain *d, unsigned long pfn,
                     unmap_domain_page(next_table_vaddr);
                     return 1;
                 }
+                hd->pgtables++;
                 next_table_mfn = page_to_mfn(table);
                 set_iommu_pde_present((u32*)pde, next_table_mfn, next_level,
                                       !!IOMMUF_writable, !!IOMMUF_readable);
@@ -576,6 +578,7 @@ static int update_paging_mode(struct domain *d, unsigned long gfn)
                             __func__);
             return -ENOMEM;
         }
+        hd->pgtables++;
 
         new_root_vaddr = __map_domain_page(new_root);
         old_root_mfn = page_to_mfn(old_root);
@@ -706,6 +709,7 @@ int amd_iommu_map_page(struct domain *d, unsigned long gfn, unsigned long mfn,
 
         /* Deallocate lower level page table */
         free_amd_iommu_pgtable(mfn_to_page(pt_mfn[merge_level - 1]));
+        hd->pgtables--;
     }
 
 out:
@@ -797,6 +801,7 @@ void amd_iommu_share_p2m(struct domain *d)
     {
         free_amd_iommu_pgtable(hd->arch.root_table);
         hd->arch.root_table = p2m_table;
+        hd->pgtables = 0;
 
         /* When sharing p2m with iommu, paging mode = 4 */
         hd->arch.paging_mode = IOMMU_PAGING_MODE_LEVEL_4;
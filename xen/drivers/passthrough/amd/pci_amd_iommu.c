@@ -234,6 +234,7 @@ static int allocate_domain_resources(struct domain_iommu *hd)
             spin_unlock(&hd->arch.mapping_lock);
             return -ENOMEM;
         }
+        hd->pgtables = 1;
     }
     spin_unlock(&hd->arch.mapping_lock);
     return 0;
@@ -475,6 +476,7 @@ static void deallocate_iommu_page_tables(struct domain *d)
     {
         deallocate_next_page_table(hd->arch.root_table, hd->arch.paging_mode);
         hd->arch.root_table = NULL;
+        hd->pgtables = 0;
     }
     spin_unlock(&hd->arch.mapping_lock);
 }
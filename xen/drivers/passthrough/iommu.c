@@ -314,6 +314,117 @@ static void iommu_free_pagetables(unsigned long unused)
                             cpumask_cycle(smp_processor_id(), &cpu_online_map));
 }
 
+/*
+ * Run the low level operations of a batch with IOTLB flushes suppressed,
+ * and flush once at the end, unless the caller defers flushing itself.
+ */
+static bool_t iommu_batch_start(void)
+{
+    bool_t deferred = this_cpu(iommu_dont_flush_iotlb);
+
+    this_cpu(iommu_dont_flush_iotlb) = 1;
+
+    return deferred;
+}
+
+static int iommu_batch_end(struct domain *d, bool_t deferred,
+                           unsigned long gfn, unsigned int page_count)
+{
+    this_cpu(iommu_dont_flush_iotlb) = deferred;
+
+    return deferred ? 0 : iommu_iotlb_flush(d, gfn, page_count);
+}
+
+int iommu_map_pages(struct domain *d, unsigned long gfn, unsigned long mfn,
+                    unsigned int order, unsigned int flags)
+{
+    const struct domain_iommu *hd = dom_iommu(d);
+    unsigned long i;
+    bool_t deferred;
+    int rc = 0, ret;
+
+    if ( !iommu_enabled || !hd->platform_ops )
+        return 0;
+
+    deferred = iommu_batch_start();
+
+    if ( order && hd->platform_ops->map_pages )
+    {
+        rc = hd->platform_ops->map_pages(d, gfn, mfn, order, flags);
+        if ( unlikely(rc) )
+        {
+            /* Best effort: undo whatever part got mapped. */
+            ret = hd->platform_ops->unmap_pages(d, gfn, order);
+
+            if ( !d->is_shutting_down && printk_ratelimit() )
+                printk(XENLOG_ERR
+                       "d%d: IOMMU mapping gfn %#lx to mfn %#lx order %u failed: %d\n",
+                       d->domain_id, gfn, mfn, order, rc);
+
+            if ( !is_hardware_domain(d) )
+                domain_crash(d);
+        }
+    }
+    else
+        for ( i = 0; i < (1UL << order); i++ )
+        {
+            rc = iommu_map_page(d, gfn + i, mfn + i, flags);
+            if ( unlikely(rc) )
+            {
+                while ( i-- )
+                    /* If statement to satisfy __must_check. */
+                    if ( iommu_unmap_page(d, gfn + i) )
+                        continue;
+
+                break;
+            }
+        }
+
+    /* Flush even on failure: the unmapping above wasn't flushed either. */
+    ret = iommu_batch_end(d, deferred, gfn, 1U << order);
+
+    return rc ?: ret;
+}
+
+int iommu_unmap_pages(struct domain *d, unsigned long gfn, unsigned int order)
+{
+    const struct domain_iommu *hd = dom_iommu(d);
+    unsigned long i;
+    bool_t deferred;
+    int rc = 0, ret;
+
+    if ( !iommu_enabled || !hd->platform_ops )
+        return 0;
+
+    deferred = iommu_batch_start();
+
+    if ( order && hd->platform_ops->unmap_pages )
+    {
+        rc = hd->platform_ops->unmap_pages(d, gfn, order);
+        if ( unlikely(rc) )
+        {
+            if ( !d->is_shutting_down && printk_ratelimit() )
+                printk(XENLOG_ERR
+                       "d%d: IOMMU unmapping gfn %#lx order %u failed: %d\n",
+                       d->domain_id, gfn, order, rc);
+
+            if ( !is_hardware_domain(d) )
+                domain_crash(d);
+        }
+    }
+    else
+        for ( i = 0; i < (1UL << order); i++ )
+        {
+            ret = iommu_unmap_page(d, gfn + i);
+            if ( !rc )
+                rc = ret;
+        }
+
+    ret = iommu_batch_end(d, deferred, gfn, 1U << order);
+
+    return rc ?: ret;
+}
+
 int iommu_iotlb_flush(struct domain *d, unsigned long gfn,
                       unsigned int page_count)
 {
@@ -497,7 +608,8 @@ static void iommu_dump_p2m_table(unsigned char key)
             continue;
         }
 
-        printk("\ndomain%d IOMMU p2m table: \n", d->domain_id);
+        printk("\ndomain%d IOMMU p2m table (%lu pages): \n", d->domain_id,
+               dom_iommu(d)->pgtables);
         ops->dump_p2m_table(d);
     }
 }
@@ -30,6 +30,7 @@
 #include <xen/pci.h>
 #include <xen/pci_regs.h>
 #include <xen/keyhandler.h>
+#include <xen/perfc.h>
 #include <asm/msi.h>
 #include <asm/irq.h>
 #include <asm/hvm/vmx/vmx.h>
@@ -50,6 +51,12 @@ struct mapped_rmrr {
 /* Possible unfiltered LAPIC/MSI messages from untrusted sources? */
 bool_t __read_mostly untrusted_msi;
 
+/*
+ * Superpage levels supported by all IOMMUs for non-shared page tables:
+ * 0 for none, 1 for 2M, 2 for 2M and 1G.
+ */
+static unsigned int __read_mostly vtd_sp_levels = 2;
+
 int nr_iommus;
 
 static struct tasklet vtd_fault_tasklet;
@@ -249,46 +256,118 @@ static u64 bus_to_context_maddr(struct iommu *iommu, u8 bus)
     return maddr;
 }
 
-static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
+/* Allocate a page table for domain, return its machine address. */
+static u64 alloc_domain_pgtable_maddr(struct domain *domain)
 {
+    struct domain_iommu *hd = dom_iommu(domain);
     struct acpi_drhd_unit *drhd;
     struct pci_dev *pdev;
+    u64 maddr;
+
+    ASSERT(spin_is_locked(&hd->arch.mapping_lock));
+
+    /*
+     * just get any passthrough device in the domainr - assume user
+     * assigns only devices from same node to a given guest.
+     */
+    pdev = pci_get_pdev_by_domain(domain, -1, -1, -1);
+    drhd = acpi_find_matched_drhd_unit(pdev);
+    maddr = alloc_pgtable_maddr(drhd, 1);
+    if ( maddr )
+        hd->pgtables++;
+
+    return maddr;
+}
+
+/*
+ * Replace the superpage mapped by *pte at level with a page table mapping
+ * the same range with pages of the next level down.  Returns the machine
+ * address of the new table, or 0 on failure.
+ */
+static u64 dma_split_superpage(struct domain *domain, struct dma_pte *pte,
+                               int level)
+{
+    struct dma_pte *table, new = { 0 };
+    u64 maddr = alloc_domain_pgtable_maddr(domain);
+    unsigned int i;
+
+    if ( !maddr )
+        return 0;
+
+    table = map_vtd_domain_page(maddr);
+    for ( i = 0; i < PTE_NUM; i++ )
+    {
+        table[i].val = pte->val + offset_level_address(i, level - 1);
+        if ( level == 2 )
+            table[i].val &= ~DMA_PTE_SP;
+    }
+    iommu_flush_cache_page(table, 1);
+    unmap_vtd_domain_page(table);
+
+    dma_set_pte_addr(new, maddr);
+    dma_set_pte_readable(new);
+    dma_set_pte_writable(new);
+    *pte = new;
+    iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
+
+    return maddr;
+}
+
+/*
+ * Return the machine address of the page table at *level holding the entry
+ * for addr.  Missing tables are allocated if alloc is set, and superpages
+ * above *level are split.  If alloc isn't set, the walk stops at such a
+ * superpage instead, and *level is set to the level of the table holding
+ * it.  Returns 0 if there is no such table or it can't be allocated.
+ */
+static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr,
+                                  unsigned int *level, int alloc)
+{
     struct domain_iommu *hd = dom_iommu(domain);
     int addr_width = agaw_to_width(hd->arch.agaw);
     struct dma_pte *parent, *pte = NULL;
-    int level = agaw_to_level(hd->arch.agaw);
+    int cur = agaw_to_level(hd->arch.agaw);
     int offset;
-    u64 pte_maddr = 0;
+    u64 parent_maddr, pte_maddr = 0;
+
+    ASSERT(*level >= 1 && *level < cur);
 
     addr &= (((u64)1) << addr_width) - 1;
     ASSERT(spin_is_locked(&hd->arch.mapping_lock));
     if ( hd->arch.pgd_maddr == 0 )
     {
-        /*
-         * just get any passthrough device in the domainr - assume user
-         * assigns only devices from same node to a given guest.
-         */
-        pdev = pci_get_pdev_by_domain(domain, -1, -1, -1);
-        drhd = acpi_find_matched_drhd_unit(pdev);
-        if ( !alloc || ((hd->arch.pgd_maddr = alloc_pgtable_maddr(drhd, 1)) == 0) )
+        if ( !alloc ||
+             ((hd->arch.pgd_maddr = alloc_domain_pgtable_maddr(domain)) == 0) )
             goto out;
     }
 
-    parent = (struct dma_pte *)map_vtd_domain_page(hd->arch.pgd_maddr);
-    while ( level > 1 )
+    parent_maddr = hd->arch.pgd_maddr;
+    parent = (struct dma_pte *)map_vtd_domain_page(parent_maddr);
+    while ( cur > *level )
     {
-        offset = address_level_offset(addr, level);
+        offset = address_level_offset(addr, cur);
         pte = &parent[offset];
 
         pte_maddr = dma_pte_addr(*pte);
-        if ( !pte_maddr )
+        if ( dma_pte_present(*pte) && dma_pte_superpage(*pte) )
+        {
+            if ( !alloc )
+            {
+                *level = cur;
+                pte_maddr = parent_maddr;
+                break;
+            }
+
+            pte_maddr = dma_split_superpage(domain, pte, cur);
+            if ( !pte_maddr )
+                break;
+        }
+        else if ( !pte_maddr )
         {
             if ( !alloc )
                 break;
 
-            pdev = pci_get_pdev_by_domain(domain, -1, -1, -1);
-            drhd = acpi_find_matched_drhd_unit(pdev);
-            pte_maddr = alloc_pgtable_maddr(drhd, 1);
+            pte_maddr = alloc_domain_pgtable_maddr(domain);
             if ( !pte_maddr )
                 break;
 
@@ -303,12 +382,13 @@ static u64 addr_to_dma_page_maddr(struct domain *domain, u64 addr, int alloc)
             iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
         }
 
-        if ( level == 2 )
+        if ( cur == *level + 1 )
             break;
 
         unmap_vtd_domain_page(parent);
-        parent = map_vtd_domain_page(pte_maddr);
-        level--;
+        parent_maddr = pte_maddr;
+        parent = map_vtd_domain_page(parent_maddr);
+        cur--;
     }
 
     unmap_vtd_domain_page(parent);
@@ -612,6 +692,8 @@ static int __must_check iommu_flush_iotlb(struct domain *d,
         if ( iommu_domid == -1 )
             continue;
 
+        perfc_incr(iommu_iotlb_flush);
+
         if ( page_count != 1 || gfn == gfn_x(INVALID_GFN) )
             rc = iommu_flush_iotlb_dsi(iommu, iommu_domid,
                                        0, flush_dev_iotlb);
@@ -644,25 +726,94 @@ static int __must_check iommu_flush_iotlb_all(struct domain *d)
     return iommu_flush_iotlb(d, gfn_x(INVALID_GFN), 0, 0);
 }
 
-/* clear one page's page table */
-static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr)
+/*
+ * Free a page table at level which has been unhooked from the domain's
+ * tables and flushed from the IOTLB, along with the tables below it.
+ * Returns the number of pages freed.
+ */
+static unsigned long dma_free_pgtable(u64 pt_maddr, int level)
+{
+    struct dma_pte *pt_vaddr = map_vtd_domain_page(pt_maddr);
+    unsigned long freed = 1;
+    unsigned int i;
+
+    for ( i = 0; level > 1 && i < PTE_NUM; i++ )
+        if ( dma_pte_present(pt_vaddr[i]) && !dma_pte_superpage(pt_vaddr[i]) )
+            freed += dma_free_pgtable(dma_pte_addr(pt_vaddr[i]), level - 1);
+
+    unmap_vtd_domain_page(pt_vaddr);
+    free_pgtable_maddr(pt_maddr);
+
+    return freed;
+}
+
+/*
+ * The entry at level for addr has been replaced: flush it, and free the
+ * page table it pointed to, if any.  Flushing can only be deferred if there
+ * is no such table, as the IOMMU may still be walking it.
+ */
+static int __must_check dma_pte_replaced(struct domain *domain, u64 addr,
+                                         int level, struct dma_pte old)
+{
+    struct domain_iommu *hd = dom_iommu(domain);
+    unsigned int page_count = 1 << (level_to_offset_bits(level) -
+                                    PAGE_SHIFT_4K);
+    unsigned long freed;
+    int rc;
+
+    if ( level == 1 || !dma_pte_present(old) || dma_pte_superpage(old) )
+    {
+        if ( this_cpu(iommu_dont_flush_iotlb) )
+        {
+            perfc_incr(iommu_iotlb_flush_deferred);
+            return 0;
+        }
+
+        return iommu_flush_iotlb(domain, addr >> PAGE_SHIFT_4K,
+                                 dma_pte_present(old), page_count);
+    }
+
+    rc = iommu_flush_iotlb(domain, addr >> PAGE_SHIFT_4K, 1, page_count);
+
+    freed = dma_free_pgtable(dma_pte_addr(old), level - 1);
+    spin_lock(&hd->arch.mapping_lock);
+    hd->pgtables -= freed;
+    spin_unlock(&hd->arch.mapping_lock);
+
+    return rc;
+}
+
+/* clear the page table entry at level for addr */
+static int __must_check dma_pte_clear(struct domain *domain, u64 addr,
+                                      int level)
 {
     struct domain_iommu *hd = dom_iommu(domain);
-    struct dma_pte *page = NULL, *pte = NULL;
+    struct dma_pte *page = NULL, *pte = NULL, old;
+    unsigned int target = level;
     u64 pg_maddr;
-    int rc = 0;
 
     spin_lock(&hd->arch.mapping_lock);
-    /* get last level pte */
-    pg_maddr = addr_to_dma_page_maddr(domain, addr, 0);
+    pg_maddr = addr_to_dma_page_maddr(domain, addr, &target, 0);
     if ( pg_maddr == 0 )
     {
         spin_unlock(&hd->arch.mapping_lock);
         return 0;
     }
 
+    /* Only part of a superpage is cleared: split it. */
+    if ( target != level )
+    {
+        target = level;
+        pg_maddr = addr_to_dma_page_maddr(domain, addr, &target, 1);
+        if ( pg_maddr == 0 )
+        {
+            spin_unlock(&hd->arch.mapping_lock);
+            return -ENOMEM;
+        }
+    }
+
     page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = page + address_level_offset(addr, 1);
+    pte = page + address_level_offset(addr, level);
 
     if ( !dma_pte_present(*pte) )
     {
@@ -671,16 +822,13 @@ static int __must_check dma_pte_clear_one(struct domain *domain, u64 addr)
         return 0;
     }
 
+    old = *pte;
     dma_clear_pte(*pte);
     spin_unlock(&hd->arch.mapping_lock);
     iommu_flush_cache_entry(pte, sizeof(struct dma_pte));
-
-    if ( !this_cpu(iommu_dont_flush_iotlb) )
-        rc = iommu_flush_iotlb_pages(domain, addr >> PAGE_SHIFT_4K, 1);
-
     unmap_vtd_domain_page(page);
 
-    return rc;
+    return dma_pte_replaced(domain, addr, level, old);
 }
 
 static void iommu_free_pagetable(u64 pt_maddr, int level)
@@ -711,7 +859,7 @@ static void iommu_free_page_table(struct page_info *pg)
         if ( !dma_pte_present(*pte) )
             continue;
 
-        if ( next_level >= 1 )
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             iommu_free_pagetable(dma_pte_addr(*pte), next_level);
 
         dma_clear_pte(*pte);
@@ -1387,7 +1535,9 @@ int domain_context_mapping_one(
         /* Ensure we have pagetables allocated down to leaf PTE. */
         if ( hd->arch.pgd_maddr == 0 )
         {
-            addr_to_dma_page_maddr(domain, 0, 1);
+            unsigned int level = 1;
+
+            addr_to_dma_page_maddr(domain, 0, &level, 1);
             if ( hd->arch.pgd_maddr == 0 )
             {
             nomem:
@@ -1747,42 +1897,40 @@ static void iommu_domain_teardown(struct domain *d)
     spin_lock(&hd->arch.mapping_lock);
     iommu_free_pagetable(hd->arch.pgd_maddr, agaw_to_level(hd->arch.agaw));
     hd->arch.pgd_maddr = 0;
+    hd->pgtables = 0;
     spin_unlock(&hd->arch.mapping_lock);
 }
 
-static int __must_check intel_iommu_map_page(struct domain *d,
-                                             unsigned long gfn,
-                                             unsigned long mfn,
-                                             unsigned int flags)
+/* Map a page of level at gfn, i.e. a superpage if level > 1. */
+static int __must_check intel_iommu_map_level(struct domain *d,
+                                              unsigned long gfn,
+                                              unsigned long mfn,
+                                              int level,
+                                              unsigned int flags)
 {
     struct domain_iommu *hd = dom_iommu(d);
     struct dma_pte *page = NULL, *pte = NULL, old, new = { 0 };
+    paddr_t addr = (paddr_t)gfn << PAGE_SHIFT_4K;
+    unsigned int target = level;
     u64 pg_maddr;
-    int rc = 0;
-
-    /* Do nothing if VT-d shares EPT page table */
-    if ( iommu_use_hap_pt(d) )
-        return 0;
-
-    /* Do nothing if hardware domain and iommu supports pass thru. */
-    if ( iommu_passthrough && is_hardware_domain(d) )
-        return 0;
 
     spin_lock(&hd->arch.mapping_lock);
 
-    pg_maddr = addr_to_dma_page_maddr(d, (paddr_t)gfn << PAGE_SHIFT_4K, 1);
+    pg_maddr = addr_to_dma_page_maddr(d, addr, &target, 1);
     if ( pg_maddr == 0 )
     {
         spin_unlock(&hd->arch.mapping_lock);
         return -ENOMEM;
     }
     page = (struct dma_pte *)map_vtd_domain_page(pg_maddr);
-    pte = page + (gfn & LEVEL_MASK);
+    pte = page + address_level_offset(addr, level);
     old = *pte;
     dma_set_pte_addr(new, (paddr_t)mfn << PAGE_SHIFT_4K);
     dma_set_pte_prot(new,
                      ((flags & IOMMUF_readable) ? DMA_PTE_READ  : 0) |
                      ((flags & IOMMUF_writable) ? DMA_PTE_WRITE : 0));
+    if ( level > 1 )
+        dma_set_pte_superpage(new);
 
     /* Set the SNP on leaf page table if Snoop Control available */
     if ( iommu_snoop )
@@ -1800,8 +1948,65 @@ static int __must_check intel_iommu_map_page(struct domain *d,
     spin_unlock(&hd->arch.mapping_lock);
     unmap_vtd_domain_page(page);
 
-    if ( !this_cpu(iommu_dont_flush_iotlb) )
-        rc = iommu_flush_iotlb(d, gfn, dma_pte_present(old), 1);
+    return dma_pte_replaced(d, addr, level, old);
+}
+
+/*
+ * Level of the largest pages that can be used for a range of 2^order
+ * pages at gfn (and mfn, if mapping).
+ */
+static int vtd_range_level(const struct domain *d, unsigned long frames,
+                           unsigned int order)
+{
+    int level = 1 + min(order / LEVEL_STRIDE, vtd_sp_levels);
+
+    /* Superpages live in tables below the top level. */
+    level = min(level, agaw_to_level(dom_iommu(d)->arch.agaw) - 1);
+
+    while ( level > 1 &&
+            (frames & ((1UL << ((level - 1) * LEVEL_STRIDE)) - 1)) )
+        level--;
+
+    return level;
+}
+
+static int __must_check intel_iommu_map_page(struct domain *d,
+                                             unsigned long gfn,
+                                             unsigned long mfn,
+                                             unsigned int flags)
+{
+    /* Do nothing if VT-d shares EPT page table */
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
+    /* Do nothing if hardware domain and iommu supports pass thru. */
+    if ( iommu_passthrough && is_hardware_domain(d) )
+        return 0;
+
+    return intel_iommu_map_level(d, gfn, mfn, 1, flags);
+}
+
+static int __must_check intel_iommu_map_pages(struct domain *d,
+                                              unsigned long gfn,
+                                              unsigned long mfn,
+                                              unsigned int order,
+                                              unsigned int flags)
+{
+    unsigned long i, nr, step;
+    int level, rc = 0;
+
+    if ( iommu_use_hap_pt(d) )
+        return 0;
+
+    if ( iommu_passthrough && is_hardware_domain(d) )
+        return 0;
+
+    level = vtd_range_level(d, gfn | mfn, order);
+    step = 1UL << ((level - 1) * LEVEL_STRIDE);
+    nr = 1UL << order;
+
+    for ( i = 0; i < nr && !rc; i += step )
+        rc = intel_iommu_map_level(d, gfn + i, mfn + i, level, flags);
 
     return rc;
 }
@@ -1813,7 +2018,31 @@ static int __must_check intel_iommu_unmap_page(struct domain *d,
     if ( iommu_passthrough && is_hardware_domain(d) )
         return 0;
 
-    return dma_pte_clear_one(d, (paddr_t)gfn << PAGE_SHIFT_4K);
+    return dma_pte_clear(d, (paddr_t)gfn << PAGE_SHIFT_4K, 1);
+}
+
+static int __must_check intel_iommu_unmap_pages(struct domain *d,
+                                                unsigned long gfn,
+                                                unsigned int order)
+{
+    unsigned long i, nr, step;
+    int level, rc = 0, ret;
+
+    if ( iommu_passthrough && is_hardware_domain(d) )
+        return 0;
+
+    level = vtd_range_level(d, gfn, order);
+    step = 1UL << ((level - 1) * LEVEL_STRIDE);
+    nr = 1UL << order;
+
+    for ( i = 0; i < nr; i += step )
+    {
+        ret = dma_pte_clear(d, (paddr_t)(gfn + i) << PAGE_SHIFT_4K, level);
+        if ( !rc )
+            rc = ret;
+    }
+
+    return rc;
 }
 
 int iommu_pte_flush(struct domain *d, u64 gfn, u64 *pte,
@@ -2250,6 +2479,11 @@ int __init intel_vtd_setup(void)
 
         printk(".\n");
 
+        if ( !cap_sps_1gb(iommu->cap) )
+            vtd_sp_levels = min(vtd_sp_levels, 1U);
+        if ( !cap_sps_2mb(iommu->cap) )
+            vtd_sp_levels = 0;
+
         if ( iommu_snoop && !ecap_snp_ctl(iommu->ecap) )
             iommu_snoop = 0;
 
@@ -2604,14 +2838,15 @@ static void vtd_dump_p2m_table_level(paddr_t pt_maddr, int level, paddr_t gpa,
             continue;
 
         address = gpa + offset_level_address(i, level);
-        if ( next_level >= 1 ) 
+        if ( next_level >= 1 && !dma_pte_superpage(*pte) )
             vtd_dump_p2m_table_level(dma_pte_addr(*pte), next_level, 
                                      address, indent + 1);
         else
-            printk("%*sgfn: %08lx mfn: %08lx\n",
+            printk("%*sgfn: %08lx mfn: %08lx%s\n",
                    indent, "",
                    (unsigned long)(address >> PAGE_SHIFT_4K),
-                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K));
+                   (unsigned long)(dma_pte_addr(*pte) >> PAGE_SHIFT_4K),
+                   next_level >= 1 ? " superpage" : "");
     }
 
     unmap_vtd_domain_page(pt_vaddr);
@@ -2639,6 +2874,8 @@ const struct iommu_ops intel_iommu_ops = {
     .teardown = iommu_domain_teardown,
     .map_page = intel_iommu_map_page,
     .unmap_page = intel_iommu_unmap_page,
+    .map_pages = intel_iommu_map_pages,
+    .unmap_pages = intel_iommu_unmap_pages,
     .free_page_table = iommu_free_page_table,
     .reassign_device = reassign_device_ownership,
     .get_device_group_id = intel_iommu_group_id,
@@ -44,6 +44,12 @@ struct page_info
         struct {
             /* Do TLBs need flushing for safety before next page use? */
             bool_t need_tlbflush;
+            /*
+             * Index of the first page of the buddy which needs scrubbing,
+             * INVALID_DIRTY_IDX if it is all clean.  Valid in the head
+             * page of a buddy only.
+             */
+            unsigned int first_dirty;
         } free;
 
     } u;
@@ -95,6 +101,9 @@ struct page_info
  /* Cleared when the owning guest 'frees' this page. */
 #define _PGC_allocated    PG_shift(1)
 #define PGC_allocated     PG_mask(1, 1)
+ /* Free page needs scrubbing?  Aliases PGC_allocated, unused on free pages. */
+#define _PGC_need_scrub   _PGC_allocated
+#define PGC_need_scrub    PGC_allocated
   /* Page is Xen heap? */
 #define _PGC_xen_heap     PG_shift(2)
 #define PGC_xen_heap      PG_mask(1, 2)
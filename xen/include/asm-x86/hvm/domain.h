@@ -84,6 +84,8 @@ struct hvm_domain {
         spinlock_t       lock;
         ioservid_t       id;
         struct list_head list;
+        /* Lookup index of the servers' ranges, RCU protected */
+        struct hvm_ioreq_index *index;
     } ioreq_server;
     struct hvm_ioreq_server *default_ioreq_server;
 
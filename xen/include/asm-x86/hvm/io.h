@@ -73,6 +73,11 @@ struct hvm_io_handler {
     };
     const struct hvm_io_ops *ops;
     uint8_t type;
+    /*
+     * No other exclusive handler accepts any access this one accepts.  This
+     * is only known for handlers with fixed ranges.
+     */
+    bool_t exclusive;
 };
 
 typedef int (*hvm_io_read_t)(const struct hvm_io_handler *,
@@ -89,6 +89,9 @@ struct hvm_vcpu_io {
     unsigned long msix_snoop_gpa;
 
     const struct g2m_ioport *g2m_ioport;
+
+    /* Internal handler of the last access, by IOREQ_TYPE_{PIO,COPY}. */
+    const struct hvm_io_handler *io_handler[2];
 };
 
 static inline bool_t hvm_vcpu_io_need_completion(const struct hvm_vcpu_io *vio)
@@ -329,6 +329,14 @@ struct p2m_domain {
             unsigned long list[NR_POD_MRP_ENTRIES];
             unsigned int idx;
         } mrp;
+
+        /* Statistics. */
+        unsigned long    faults,       /* # of demand-populate faults       */
+                         sweeps,       /* # of emergency sweeps             */
+                         reclaimed,    /* # of zero pages reclaimed         */
+                         allocated;    /* # of pages allocated on demand    */
+        unsigned long    dump_faults;  /* faults as of the last dump        */
+        s_time_t         dump_time;    /* time of the last dump             */
         mm_lock_t        lock;         /* Locking of private pod structs,   *
                                         * not relying on the p2m lock.      */
     } pod;
@@ -205,6 +205,7 @@ struct cpuinfo_x86 {
     __u32 phys_proc_id;    /* package ID of each logical CPU */
     __u32 cpu_core_id;     /* core ID of each logical CPU*/
     __u32 compute_unit_id; /* AMD compute unit ID of each logical CPU */
+    __u32 cpu_llc_id;      /* last level cache ID of each logical CPU */
     unsigned short x86_clflush_size;
 } __cacheline_aligned;
 
@@ -244,6 +245,7 @@ extern void detect_ht(struct cpuinfo_x86 *c);
 
 #define cpu_to_core(_cpu)   (cpu_data[_cpu].cpu_core_id)
 #define cpu_to_socket(_cpu) (cpu_data[_cpu].phys_proc_id)
+#define cpu_to_llc(_cpu)    (cpu_data[_cpu].cpu_llc_id)
 
 unsigned int apicid_to_socket(unsigned int);
 
@@ -18,6 +18,7 @@
 
 #define BAD_APICID   (-1U)
 #define INVALID_CUID (~0U)   /* AMD Compute Unit ID */
+#define INVALID_LLC_ID (~0U) /* Last level cache ID */
 #ifndef __ASSEMBLY__
 
 /*
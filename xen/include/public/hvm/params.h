@@ -253,6 +253,13 @@
  */
 #define HVM_PARAM_X87_FIP_WIDTH 36
 
-#define HVM_NR_PARAMS 37
+/*
+ * Boolean: populate PoD entries lazily.  Faults on PoD entries are served
+ * from the PoD cache without reclaiming zero pages, and once the cache is
+ * empty, by allocating memory for the domain (up to its maximum).
+ */
+#define HVM_PARAM_POD_LAZY 37
+
+#define HVM_NR_PARAMS 38
 
 #endif /* __XEN_PUBLIC_HVM_PARAMS_H__ */
@@ -102,7 +102,7 @@ struct xen_sysctl_physinfo {
     uint32_t cpu_khz;
     uint64_aligned_t total_pages;
     uint64_aligned_t free_pages;
-    uint64_aligned_t scrub_pages;
+    uint64_aligned_t scrub_pages;   /* Included in free_pages. */
     uint64_aligned_t outstanding_pages;
     uint32_t hw_cap[8];
 
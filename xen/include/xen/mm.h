@@ -175,8 +175,10 @@ unsigned int online_page(unsigned long mfn, uint32_t *status);
 int offline_page(unsigned long mfn, int broken, uint32_t *status);
 int query_page_offline(unsigned long mfn, uint32_t *status);
 unsigned long total_free_pages(void);
+unsigned long total_scrub_pages(void);
 
 void scrub_heap_pages(void);
+bool scrub_free_pages(void);
 
 int assign_pages(
     struct domain *d,
@@ -32,6 +32,8 @@ PERFCOUNTER(tickled_no_cpu,         "sched: tickled_no_cpu")
 PERFCOUNTER(tickled_idle_cpu,       "sched: tickled_idle_cpu")
 PERFCOUNTER(tickled_busy_cpu,       "sched: tickled_busy_cpu")
 PERFCOUNTER(vcpu_check,             "sched: vcpu_check")
+PERFCOUNTER(core_forced_idle,       "sched: core_forced_idle")
+PERFCOUNTER(core_drain,             "sched: core_drain")
 
 /* credit specific counters */
 PERFCOUNTER(delay_ms,               "csched: delay")
@@ -71,6 +73,13 @@ PERFCOUNTER(deferred_to_tickled_cpu,"csched2: deferred_to_tickled_cpu")
 PERFCOUNTER(tickled_cpu_overwritten,"csched2: tickled_cpu_overwritten")
 PERFCOUNTER(tickled_cpu_overridden, "csched2: tickled_cpu_overridden")
 
+/* rtds specific counters */
+PERFCOUNTER(rtds_stolen,            "rtds: stolen")
+PERFCOUNTER(rtds_steal_trylock_failed, "rtds: steal_trylock_failed")
+
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
 
+PERFCOUNTER(iommu_iotlb_flush,      "IOMMU IOTLB flushes")
+PERFCOUNTER(iommu_iotlb_flush_deferred, "IOMMU IOTLB flushes deferred")
+
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
@@ -39,6 +39,12 @@ struct schedule_data {
     void               *sched_priv;
     struct timer        s_timer;        /* scheduling timer                */
     atomic_t            urgent_count;   /* how many urgent vcpus           */
+    /* SMT co-scheduling state, see schedule.c. */
+    struct domain      *core_dom;       /* domain running here, if any     */
+    const struct domain *core_allowed;  /* only domain allowed next, if any*/
+    bool_t              core_refused;   /* a vcpu was held back by that    */
+    s_time_t            core_idle_start;/* kept idle for siblings since    */
+    s_time_t            core_idle_time; /* total time kept idle            */
 };
 
 #define curr_on_cpu(c)    (per_cpu(schedule_data, c).curr)
@@ -115,6 +121,24 @@ static inline spinlock_t *pcpu_schedule_trylock(unsigned int cpu)
     return NULL;
 }
 
+/*
+ * With SMT co-scheduling, sibling threads of a core only run vcpus of the
+ * same domain at the same time.  Schedulers which support it (cosched set
+ * in struct scheduler) must not pick, for running on cpu, a vcpu for which
+ * this returns false.
+ */
+static inline bool_t sched_core_allowed(unsigned int cpu, const struct vcpu *v)
+{
+    struct schedule_data *sd = &per_cpu(schedule_data, cpu);
+
+    if ( likely(sd->core_allowed == NULL) || v->domain == sd->core_allowed ||
+         is_idle_vcpu(v) )
+        return 1;
+
+    sd->core_refused = 1;
+    return 0;
+}
+
 struct task_slice {
     struct vcpu *task;
     s_time_t     time;
@@ -126,6 +150,7 @@ struct scheduler {
     char *opt_name;         /* option name for this scheduler    */
     unsigned int sched_id;  /* ID for this scheduler             */
     void *sched_data;       /* global data pointer               */
+    bool_t cosched;         /* honours sched_core_allowed()      */
 
     int          (*global_init)    (void);
 
@@ -225,6 +225,14 @@ struct vcpu
     /* Maptrack */
     unsigned int     maptrack_head;
     unsigned int     maptrack_tail;
+    /*
+     * Free maptrack handles only this VCPU allocates from.  The lock is
+     * only contended when another VCPU drains the cache.
+     */
+#define MAPTRACK_CACHE_SIZE 32
+    spinlock_t       maptrack_cache_lock;
+    unsigned int     maptrack_cached;
+    unsigned int     maptrack_cache[MAPTRACK_CACHE_SIZE];
 
     /* IRQ-safe virq_lock protects against delivering VIRQ to stale evtchn. */
     evtchn_port_t    virq_to_evtchn[NR_VIRQS];